@@ -28,12 +28,14 @@ enum {
 	UREADAHEAD_ERROR_START = NIH_ERROR_APPLICATION_START,
 
 	PACK_DATA_ERROR,
-	PACK_TOO_OLD
+	PACK_TOO_OLD,
+	PACK_NOT_READ
 };
 
 /* Error strings for defined messages */
 #define PACK_DATA_ERROR_STR N_("Pack data error")
 #define PACK_TOO_OLD_STR    N_("Pack too old")
+#define PACK_NOT_READ_STR   N_("Pack not entirely read")
 
 #endif /* UREADAHEAD_ERRORS_H */
 
@@ -0,0 +1,576 @@
+/* ureadahead
+ *
+ * fantrace.c - boot tracing with fanotify
+ *
+ * Copyright © 2009 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <mntent.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "fantrace.h"
+
+
+/**
+ * FAN_BUFFER_SIZE:
+ *
+ * Size of the buffer fanotify events are read into.
+ **/
+#define FAN_BUFFER_SIZE 65536
+
+#ifndef FAN_MARK_FILESYSTEM
+# define FAN_MARK_FILESYSTEM 0x00000100
+#endif
+#ifndef FAN_OPEN_EXEC
+# define FAN_OPEN_EXEC 0x00001000
+#endif
+#ifndef FAN_REPORT_DFID_NAME
+# define FAN_REPORT_DFID_NAME 0x00000c00
+#endif
+#ifndef FAN_EVENT_INFO_TYPE_DFID_NAME
+# define FAN_EVENT_INFO_TYPE_DFID_NAME 2
+#endif
+
+
+/**
+ * FanMount:
+ * @fsid: filesystem id,
+ * @fd: open directory on the filesystem.
+ *
+ * Filesystem marked, whose directory handles are opened relative to @fd.
+ **/
+typedef struct fan_mount {
+	fsid_t fsid;
+	int    fd;
+} FanMount;
+
+/**
+ * FanDir:
+ * @entry: list header,
+ * @key: filesystem id and handle in hex,
+ * @mount: index of the filesystem in the marked mounts,
+ * @handle: handle of the directory,
+ * @path: path of the directory once resolved, NULL before and empty if
+ * it couldn't be.
+ *
+ * Directory that files were opened from; each is only resolved to a
+ * path once, after tracing.
+ **/
+typedef struct fan_dir {
+	NihList             entry;
+	char *              key;
+	size_t              mount;
+	struct file_handle *handle;
+	char *              path;
+} FanDir;
+
+/**
+ * FanEvent:
+ * @timestamp: time the event was read in nanoseconds,
+ * @pid: process that opened the file,
+ * @dir: directory the file was opened from,
+ * @name: name of the file within @dir.
+ **/
+typedef struct fan_event {
+	unsigned long long timestamp;
+	pid_t              pid;
+	FanDir *           dir;
+	char *             name;
+} FanEvent;
+
+/**
+ * FanTrace:
+ * @fd: fanotify group,
+ * @stop: pipe written to stop reading,
+ * @mounts: filesystems marked,
+ * @num_mounts: number of entries in @mounts,
+ * @dirs: hash of FanDir,
+ * @num_dirs: number of entries in @dirs,
+ * @events: events read,
+ * @num_events: number of entries in @events,
+ * @max_events: number of entries allocated in @events,
+ * @overflows: number of times the event queue overflowed.
+ **/
+struct fan_trace {
+	int       fd;
+	int       stop[2];
+	FanMount *mounts;
+	size_t    num_mounts;
+	NihHash * dirs;
+	size_t    num_dirs;
+	FanEvent *events;
+	size_t    num_events;
+	size_t    max_events;
+	size_t    overflows;
+};
+
+
+/* Prototypes for static functions */
+static int   fan_trace_destroy (FanTrace *trace);
+static int   fan_mark          (FanTrace *trace, const char *dir);
+static void  fan_read_events   (FanTrace *trace, const char *buf, ssize_t len);
+static void  fan_add_event     (FanTrace *trace, pid_t pid,
+				const struct fanotify_event_info_fid *info);
+static char *fan_dir_path      (const void *parent, FanTrace *trace,
+				FanDir *dir);
+
+
+/**
+ * fan_trace_open:
+ * @parent: parent of the returned object.
+ *
+ * Prepares to trace the files opened and executed on every block device
+ * filesystem mounted with fanotify, rather than with the kernel's trace
+ * events.  Each event gives the handle of the directory and the name of
+ * the file, which are only resolved to a path once tracing is done.
+ *
+ * Returns: newly allocated trace or NULL on raised error.
+ **/
+FanTrace *
+fan_trace_open (const void *parent)
+{
+	nih_local FanTrace *trace = NULL;
+	FILE *              mounts;
+	struct mntent *     mnt;
+
+	trace = NIH_MUST (nih_new (NULL, FanTrace));
+	trace->fd = -1;
+	trace->stop[0] = trace->stop[1] = -1;
+	trace->mounts = NULL;
+	trace->num_mounts = 0;
+	trace->dirs = NIH_MUST (nih_hash_string_new (trace, 1000));
+	trace->num_dirs = 0;
+	trace->events = NULL;
+	trace->num_events = 0;
+	trace->max_events = 0;
+	trace->overflows = 0;
+
+	nih_alloc_set_destructor (trace, fan_trace_destroy);
+
+	trace->fd = fanotify_init (FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK
+				   | FAN_REPORT_DFID_NAME,
+				   O_RDONLY | O_LARGEFILE | O_CLOEXEC);
+	if (trace->fd < 0)
+		nih_return_system_error (NULL);
+
+	if (pipe2 (trace->stop, O_CLOEXEC) < 0)
+		nih_return_system_error (NULL);
+
+	/* Mark every filesystem on a block device, since those are what
+	 * packs are made for.
+	 */
+	mounts = setmntent ("/proc/self/mounts", "r");
+	if (! mounts)
+		nih_return_system_error (NULL);
+
+	while ((mnt = getmntent (mounts)) != NULL) {
+		if (strncmp (mnt->mnt_fsname, "/dev/", 5))
+			continue;
+
+		if (fan_mark (trace, mnt->mnt_dir) < 0) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_debug ("%s: %s", mnt->mnt_dir, err->message);
+			nih_free (err);
+		}
+	}
+
+	endmntent (mounts);
+
+	if (! trace->num_mounts)
+		nih_return_error (NULL, ENOENT, _("No filesystems to trace"));
+
+	nih_ref (trace, parent);
+
+	return trace;
+}
+
+static int
+fan_trace_destroy (FanTrace *trace)
+{
+	nih_assert (trace != NULL);
+
+	if (trace->fd >= 0)
+		close (trace->fd);
+	if (trace->stop[0] >= 0)
+		close (trace->stop[0]);
+	if (trace->stop[1] >= 0)
+		close (trace->stop[1]);
+
+	for (size_t i = 0; i < trace->num_mounts; i++)
+		close (trace->mounts[i].fd);
+
+	return 0;
+}
+
+/**
+ * fan_mark:
+ * @trace: trace,
+ * @dir: mount point.
+ *
+ * Marks the filesystem mounted at @dir, unless it's already marked
+ * through another mount point.  Kernels that can't report executions
+ * have only opens marked.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+fan_mark (FanTrace *  trace,
+	  const char *dir)
+{
+	struct statfs statfsbuf;
+	int           fd;
+
+	nih_assert (trace != NULL);
+	nih_assert (dir != NULL);
+
+	fd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		nih_return_system_error (-1);
+
+	if (fstatfs (fd, &statfsbuf) < 0) {
+		nih_error_raise_system ();
+		close (fd);
+		return -1;
+	}
+
+	for (size_t i = 0; i < trace->num_mounts; i++) {
+		if (! memcmp (&trace->mounts[i].fsid, &statfsbuf.f_fsid,
+			      sizeof (fsid_t))) {
+			close (fd);
+			return 0;
+		}
+	}
+
+	if ((fanotify_mark (trace->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+			    FAN_OPEN | FAN_OPEN_EXEC, fd, NULL) < 0)
+	    && ((errno != EINVAL)
+		|| (fanotify_mark (trace->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+				   FAN_OPEN, fd, NULL) < 0))) {
+		nih_error_raise_system ();
+		close (fd);
+		return -1;
+	}
+
+	trace->mounts = NIH_MUST (nih_realloc (trace->mounts, trace,
+					       (sizeof (FanMount)
+						* (trace->num_mounts + 1))));
+	trace->mounts[trace->num_mounts].fsid = statfsbuf.f_fsid;
+	trace->mounts[trace->num_mounts].fd = fd;
+	trace->num_mounts++;
+
+	return 0;
+}
+
+
+/**
+ * fan_trace_read:
+ * @trace: trace.
+ *
+ * Reads events as they arrive until fan_trace_stop() is called, which
+ * may be done from another thread.
+ **/
+void
+fan_trace_read (FanTrace *trace)
+{
+	char buf[FAN_BUFFER_SIZE]
+		__attribute__ ((aligned (__alignof__ (struct fanotify_event_metadata))));
+
+	nih_assert (trace != NULL);
+
+	for (;;) {
+		struct pollfd fds[2];
+		ssize_t       len;
+
+		fds[0].fd = trace->fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = trace->stop[0];
+		fds[1].events = POLLIN;
+
+		if ((poll (fds, 2, -1) < 0) && (errno != EINTR))
+			break;
+
+		/* Take everything queued, even once asked to stop */
+		while ((len = read (trace->fd, buf, sizeof buf)) > 0)
+			fan_read_events (trace, buf, len);
+
+		if (fds[1].revents)
+			break;
+	}
+
+	if (trace->overflows)
+		nih_warn (_("fanotify queue overflowed %zu times, some opens were lost"),
+			  trace->overflows);
+}
+
+/**
+ * fan_trace_stop:
+ * @trace: trace.
+ *
+ * Stops fan_trace_read() once it has read the events queued so far.
+ **/
+void
+fan_trace_stop (FanTrace *trace)
+{
+	nih_assert (trace != NULL);
+
+	while ((write (trace->stop[1], "", 1) < 0) && (errno == EINTR))
+		;
+}
+
+static void
+fan_read_events (FanTrace *  trace,
+		 const char *buf,
+		 ssize_t     len)
+{
+	const struct fanotify_event_metadata *event;
+
+	nih_assert (trace != NULL);
+	nih_assert (buf != NULL);
+
+	for (event = (const struct fanotify_event_metadata *)buf;
+	     FAN_EVENT_OK (event, len);
+	     event = FAN_EVENT_NEXT (event, len)) {
+		const char *ptr;
+		const char *end;
+
+		if (event->vers != FANOTIFY_METADATA_VERSION)
+			continue;
+
+		if (event->mask & FAN_Q_OVERFLOW) {
+			trace->overflows++;
+			continue;
+		}
+
+		/* Our own opens aren't part of the boot */
+		if (event->pid == getpid ())
+			continue;
+
+		ptr = (const char *)event + event->metadata_len;
+		end = (const char *)event + event->event_len;
+
+		while (ptr + sizeof (struct fanotify_event_info_header) <= end) {
+			const struct fanotify_event_info_fid *info;
+
+			info = (const struct fanotify_event_info_fid *)ptr;
+			if ((info->hdr.len < sizeof *info)
+			    || (ptr + info->hdr.len > end))
+				break;
+
+			if (info->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+				fan_add_event (trace, event->pid, info);
+
+			ptr += info->hdr.len;
+		}
+	}
+}
+
+/**
+ * fan_add_event:
+ * @trace: trace,
+ * @pid: process that opened the file,
+ * @info: directory handle and name of the file.
+ *
+ * The directory handle is followed by the name of the file, which is
+ * "." for events on the directory itself.
+ **/
+static void
+fan_add_event (FanTrace *                            trace,
+	       pid_t                                 pid,
+	       const struct fanotify_event_info_fid *info)
+{
+	const struct file_handle *handle;
+	const char *              name;
+	nih_local char *          key = NULL;
+	FanDir *                  dir;
+	FanEvent *                event;
+	struct timespec           now;
+	size_t                    mount;
+
+	nih_assert (trace != NULL);
+	nih_assert (info != NULL);
+
+	handle = (const struct file_handle *)info->handle;
+	name = (const char *)handle->f_handle + handle->handle_bytes;
+
+	if ((name >= (const char *)info + info->hdr.len)
+	    || (! strcmp (name, ".")))
+		return;
+
+	for (mount = 0; mount < trace->num_mounts; mount++)
+		if (! memcmp (&trace->mounts[mount].fsid, &info->fsid,
+			      sizeof (fsid_t)))
+			break;
+
+	if (mount == trace->num_mounts)
+		return;
+
+	/* Each directory is only kept once */
+	key = NIH_MUST (nih_sprintf (NULL, "%zu:%d:", mount,
+				     handle->handle_type));
+	for (unsigned int i = 0; i < handle->handle_bytes; i++)
+		NIH_MUST (nih_strcat_sprintf (&key, NULL, "%02x",
+					      handle->f_handle[i]));
+
+	dir = (FanDir *)nih_hash_lookup (trace->dirs, key);
+	if (! dir) {
+		dir = NIH_MUST (nih_new (trace->dirs, FanDir));
+		nih_list_init (&dir->entry);
+		nih_alloc_set_destructor (dir, nih_list_destroy);
+
+		dir->key = NIH_MUST (nih_strdup (dir, key));
+		dir->mount = mount;
+		dir->handle = NIH_MUST (nih_alloc (dir, (sizeof (struct file_handle)
+							 + handle->handle_bytes)));
+		memcpy (dir->handle, handle, (sizeof (struct file_handle)
+					      + handle->handle_bytes));
+		dir->path = NULL;
+
+		nih_hash_add (trace->dirs, &dir->entry);
+		trace->num_dirs++;
+	}
+
+	if (trace->num_events == trace->max_events) {
+		trace->max_events = nih_max (trace->max_events * 2, 1024U);
+		trace->events = NIH_MUST (nih_realloc (trace->events, trace,
+						       (sizeof (FanEvent)
+							* trace->max_events)));
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	event = &trace->events[trace->num_events++];
+	event->timestamp = ((unsigned long long)now.tv_sec * 1000000000ULL
+			    + now.tv_nsec);
+	event->pid = pid;
+	event->dir = dir;
+	event->name = NIH_MUST (nih_strdup (trace->events, name));
+}
+
+
+/**
+ * fan_trace_events:
+ * @parent: parent of @events,
+ * @trace: trace,
+ * @events: set to newly allocated array of events,
+ * @num_events: set to number of entries in @events.
+ *
+ * Resolves the files opened while tracing to paths, returning them in
+ * the order they were opened; the process names aren't known.
+ **/
+void
+fan_trace_events (const void *parent,
+		  FanTrace *  trace,
+		  RawEvent ** events,
+		  size_t *    num_events)
+{
+	nih_assert (trace != NULL);
+	nih_assert (events != NULL);
+	nih_assert (num_events != NULL);
+
+	*events = NIH_MUST (nih_alloc (parent, (sizeof (RawEvent)
+						* (trace->num_events + 1))));
+	*num_events = 0;
+
+	for (size_t i = 0; i < trace->num_events; i++) {
+		FanEvent *event = &trace->events[i];
+		RawEvent *raw;
+
+		if (! event->dir->path)
+			event->dir->path = fan_dir_path (event->dir, trace,
+							 event->dir);
+		if (! event->dir->path[0])
+			continue;
+
+		raw = &(*events)[(*num_events)++];
+		raw->timestamp = event->timestamp;
+		raw->pid = event->pid;
+		raw->tgid = event->pid;
+		raw->comm = NULL;
+		raw->path = NIH_MUST (nih_sprintf (*events, "%s/%s",
+						   (strcmp (event->dir->path, "/")
+						    ? event->dir->path : ""),
+						   event->name));
+	}
+
+	nih_info ("Read %zu events from %zu filesystems, %zu directories",
+		  *num_events, trace->num_mounts, trace->num_dirs);
+}
+
+/**
+ * fan_dir_path:
+ * @parent: parent of the returned string,
+ * @trace: trace,
+ * @dir: directory.
+ *
+ * Returns: newly allocated path of @dir, empty if it no longer exists.
+ **/
+static char *
+fan_dir_path (const void *parent,
+	      FanTrace *  trace,
+	      FanDir *    dir)
+{
+	char    link[32];
+	char    path[PATH_MAX];
+	ssize_t len;
+	int     fd;
+
+	nih_assert (trace != NULL);
+	nih_assert (dir != NULL);
+
+	fd = open_by_handle_at (trace->mounts[dir->mount].fd, dir->handle,
+				O_PATH | O_CLOEXEC);
+	if (fd < 0)
+		return NIH_MUST (nih_strdup (parent, ""));
+
+	sprintf (link, "/proc/self/fd/%d", fd);
+	len = readlink (link, path, sizeof path - 1);
+	close (fd);
+
+	if (len <= 0)
+		return NIH_MUST (nih_strdup (parent, ""));
+
+	path[len] = '\0';
+
+	return NIH_MUST (nih_strdup (parent, path));
+}
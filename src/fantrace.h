@@ -0,0 +1,43 @@
+/* ureadahead
+ *
+ * Copyright © 2009 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef UREADAHEAD_FANTRACE_H
+#define UREADAHEAD_FANTRACE_H
+
+#include <sys/types.h>
+
+#include <nih/macros.h>
+
+#include "rawtrace.h"
+
+
+typedef struct fan_trace FanTrace;
+
+
+NIH_BEGIN_EXTERN
+
+FanTrace *fan_trace_open   (const void *parent);
+void      fan_trace_read   (FanTrace *trace);
+void      fan_trace_stop   (FanTrace *trace);
+void      fan_trace_events (const void *parent, FanTrace *trace,
+			    RawEvent **events, size_t *num_events);
+
+NIH_END_EXTERN
+
+#endif /* UREADAHEAD_FANTRACE_H */
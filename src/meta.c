@@ -0,0 +1,566 @@
+/* ureadahead
+ *
+ * meta.c - filesystem metadata plugins
+ *
+ * Copyright © 2009 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <blkid.h>
+#define NO_INLINE_FUNCS
+#include <ext2fs.h>
+
+#include <linux/btrfs.h>
+#include <linux/magic.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "meta.h"
+#include "pack.h"
+
+
+/* From linux/btrfs_tree.h */
+#ifndef BTRFS_INODE_ITEM_KEY
+#define BTRFS_INODE_ITEM_KEY 1
+#endif
+
+/* From xfs/xfs_fs.h, which isn't always installed */
+struct xfs_bulk_ireq {
+	uint64_t ino;
+	uint32_t flags;
+	uint32_t icount;
+	uint32_t ocount;
+	uint32_t agno;
+	uint64_t reserved[5];
+};
+
+#define XFS_BULKSTAT_SIZE 192
+#define XFS_IOC_BULKSTAT  _IOR ('X', 127, struct xfs_bulk_ireq)
+
+
+/**
+ * XFS_BULKSTAT_BATCH:
+ *
+ * Number of inodes asked for in each bulkstat call; XFS reads inodes from
+ * disk in clusters of at least 32.
+ **/
+#define XFS_BULKSTAT_BATCH 64
+
+
+/**
+ * MappingCtx:
+ * @parent: parent of extents array,
+ * @file: pack file,
+ * @blocksize: block size of the filesystem.
+ **/
+typedef struct mapping_ctx {
+	const void *parent;
+	PackFile *  file;
+	off_t       blocksize;
+} MappingCtx;
+
+
+/* Prototypes for static functions */
+static int    ext2_trace         (const void *parent, PackFile *file);
+static void   ext2_trace_mapping (const void *parent, PackFile *file,
+				  ext2_filsys fs);
+static int    ext2_mapping_block (ext2_filsys fs, blk64_t *blocknr,
+				  e2_blkcnt_t blockcnt, blk64_t ref_blk,
+				  int ref_offset, void *priv_data);
+static void   ext2_preload       (PackFile *file, const int *selected,
+				  int device_read);
+static void   ext2_preload_group (ext2_filsys fs, int group);
+static void   xfs_preload        (PackFile *file, const int *selected,
+				  int device_read);
+static void   btrfs_preload      (PackFile *file, const int *selected,
+				  int device_read);
+static size_t sorted_inodes      (PackFile *file, ino_t **inodes);
+static int    ino_compar         (const void *a, const void *b);
+static int    open_any_path      (PackFile *file);
+
+
+/**
+ * meta_plugins:
+ *
+ * Filesystems we know how to read the metadata of; only ext2/3/4 reads
+ * its directories through the block device.
+ **/
+static const MetaPlugin meta_plugins[] = {
+	{ "ext2/3/4", EXT4_SUPER_MAGIC,  ext2_trace, ext2_preload,  TRUE  },
+	{ "xfs",      XFS_SUPER_MAGIC,   NULL,       xfs_preload,   FALSE },
+	{ "btrfs",    BTRFS_SUPER_MAGIC, NULL,       btrfs_preload, FALSE },
+};
+
+
+/**
+ * meta_plugin:
+ * @magic: statfs() type of filesystem.
+ *
+ * Returns: plugin for the filesystem, or NULL if there isn't one.
+ **/
+const MetaPlugin *
+meta_plugin (long magic)
+{
+	for (size_t i = 0; i < sizeof meta_plugins / sizeof meta_plugins[0]; i++)
+		if (meta_plugins[i].magic == magic)
+			return &meta_plugins[i];
+
+	return NULL;
+}
+
+
+/**
+ * ext2_trace:
+ * @parent: parent of arrays in @file,
+ * @file: pack file.
+ *
+ * Records the inode groups the files in @file were opened from, where
+ * their inode tables lie, and the blocks mapping each file.
+ *
+ * Returns: zero.
+ **/
+static int
+ext2_trace (const void *parent,
+	    PackFile *  file)
+{
+	const char *devname;
+	ext2_filsys fs = NULL;
+
+	nih_assert (file != NULL);
+
+	devname = blkid_devno_to_devname (file->dev);
+	if (devname
+	    && (! ext2fs_open (devname, 0, 0, 0, unix_io_manager, &fs))) {
+		nih_assert (fs != NULL);
+		size_t            num_groups = 0;
+		nih_local size_t *num_inodes = NULL;
+		size_t            mean = 0;
+		size_t            hits = 0;
+
+		nih_assert (fs != NULL);
+
+		/* Calculate the number of inode groups on this filesystem */
+		num_groups = ((fs->super->s_blocks_count - 1)
+			      / fs->super->s_blocks_per_group) + 1;
+
+		/* Fill in the pack path's group member, and count the
+		 * number of inodes in each group.
+		 */
+		num_inodes = NIH_MUST (nih_alloc (NULL, (sizeof (size_t)
+							 * num_groups)));
+		memset (num_inodes, 0, sizeof (size_t) * num_groups);
+
+		for (size_t i = 0; i < file->num_paths; i++) {
+			file->paths[i].group = ext2fs_group_of_ino (fs, file->paths[i].ino);
+			num_inodes[file->paths[i].group]++;
+		}
+
+		/* Iterate the groups and add any group that any of the
+		 * files are in, along with the number of them and where
+		 * its inode table lies on the device; which are worth
+		 * preloading is decided when reading the pack.
+		 */
+		for (size_t i = 0; i < num_groups; i++) {
+			PackGroup *group;
+
+			mean += num_inodes[i];
+			if (! num_inodes[i])
+				continue;
+
+			file->groups = NIH_MUST (nih_realloc (file->groups, parent,
+							      (sizeof (PackGroup)
+							       * (file->num_groups + 1))));
+
+			group = &file->groups[file->num_groups++];
+			group->group = i;
+			group->hits = num_inodes[i];
+			group->physical = ((off_t)ext2fs_inode_table_loc (fs, i)
+					   * fs->blocksize);
+			group->length = ((off_t)fs->inode_blocks_per_group
+					 * fs->blocksize);
+			hits++;
+		}
+
+		mean /= num_groups;
+
+		nih_debug ("%zu inode groups, mean %zu inodes per group, %zu hits",
+			   num_groups, mean, hits);
+
+		ext2_trace_mapping (parent, file, fs);
+
+		ext2fs_close (fs);
+	}
+
+	return 0;
+}
+
+/**
+ * ext2_trace_mapping:
+ * @parent: parent of extents array,
+ * @file: pack file,
+ * @fs: filesystem of @file.
+ *
+ * FIEMAP only tells us where the data of each file lies, not where the
+ * extent tree or indirect blocks that map it do, and the first read of a
+ * large or fragmented file stalls on those.  Walk the blocks of each file
+ * with libext2fs and add the mapping blocks to the metadata extents of
+ * @file, so they're read in the same sweep as the inode tables.
+ **/
+static void
+ext2_trace_mapping (const void *parent,
+		    PackFile *  file,
+		    ext2_filsys fs)
+{
+	MappingCtx ctx;
+	size_t     num_extents;
+
+	nih_assert (file != NULL);
+	nih_assert (fs != NULL);
+
+	ctx.parent = parent;
+	ctx.file = file;
+	ctx.blocksize = fs->blocksize;
+
+	num_extents = file->num_extents;
+
+	for (size_t i = 0; i < file->num_paths; i++) {
+		if (! file->paths[i].ino)
+			continue;
+
+		/* Files without mapping blocks have nothing to add, and
+		 * inodes we can't walk (such as those with inline data)
+		 * are skipped.
+		 */
+		ext2fs_block_iterate3 (fs, file->paths[i].ino,
+				       BLOCK_FLAG_READ_ONLY, NULL,
+				       ext2_mapping_block, &ctx);
+	}
+
+	nih_debug ("%zu mapping block extents",
+		   file->num_extents - num_extents);
+}
+
+static int
+ext2_mapping_block (ext2_filsys fs,
+		    blk64_t *   blocknr,
+		    e2_blkcnt_t blockcnt,
+		    blk64_t     ref_blk,
+		    int         ref_offset,
+		    void *      priv_data)
+{
+	MappingCtx *ctx = priv_data;
+	PackFile *  file;
+	off_t       physical;
+	PackExtent *last;
+
+	nih_assert (blocknr != NULL);
+	nih_assert (ctx != NULL);
+
+	/* Data blocks have a non-negative count */
+	if (blockcnt >= 0)
+		return 0;
+
+	file = ctx->file;
+	physical = (off_t)*blocknr * ctx->blocksize;
+
+	/* Mapping blocks are often allocated next to each other */
+	last = file->num_extents ? &file->extents[file->num_extents - 1] : NULL;
+	if (last && (last->physical + last->length == physical)) {
+		last->length += ctx->blocksize;
+		return 0;
+	}
+
+	file->extents = NIH_MUST (nih_realloc (file->extents, ctx->parent,
+					       (sizeof (PackExtent)
+						* (file->num_extents + 1))));
+	file->extents[file->num_extents].physical = physical;
+	file->extents[file->num_extents].length = ctx->blocksize;
+	file->num_extents++;
+
+	return 0;
+}
+
+/**
+ * ext2_preload:
+ * @file: pack file,
+ * @selected: groups to preload,
+ * @device_read: TRUE if their inode tables have already been read.
+ *
+ * Falls back to opening the device as an ext2/3/4 filesystem and loading
+ * the inodes of the selected groups through that, when their inode
+ * tables couldn't be read from the device directly.
+ **/
+static void
+ext2_preload (PackFile * file,
+	      const int *selected,
+	      int        device_read)
+{
+	const char *devname;
+	ext2_filsys fs = NULL;
+
+	nih_assert (file != NULL);
+	nih_assert (selected != NULL);
+
+	if (device_read)
+		return;
+
+	devname = blkid_devno_to_devname (file->dev);
+	if (devname
+	    && (! ext2fs_open (devname, 0, 0, 0, unix_io_manager, &fs))) {
+		nih_assert (fs != NULL);
+
+		for (size_t i = 0; i < file->num_groups; i++)
+			if (selected[i])
+				ext2_preload_group (fs, file->groups[i].group);
+
+		ext2fs_close (fs);
+	}
+}
+
+static void
+ext2_preload_group (ext2_filsys fs,
+		    int         group)
+{
+	ext2_inode_scan scan = NULL;
+
+	nih_assert (fs != NULL);
+
+	if (! ext2fs_open_inode_scan (fs, 0, &scan)) {
+		nih_assert (scan != NULL);
+
+		if (! ext2fs_inode_scan_goto_blockgroup (scan, group)) {
+			struct ext2_inode inode;
+			ext2_ino_t        ino = 0;
+
+			while ((! ext2fs_get_next_inode (scan, &ino, &inode))
+			       && (ext2fs_group_of_ino (fs, ino) == group))
+				;
+		}
+
+		ext2fs_close_inode_scan (scan);
+	}
+}
+
+
+/**
+ * xfs_preload:
+ * @file: pack file,
+ * @selected: unused,
+ * @device_read: unused.
+ *
+ * Asks XFS for the details of the inodes of the files in the pack with
+ * bulkstat, in inode order, which reads the inode clusters they live in
+ * into its buffer cache.  Each call returns the allocated inodes from
+ * the one asked for onwards, so inodes that call covered are skipped.
+ **/
+static void
+xfs_preload (PackFile * file,
+	     const int *selected,
+	     int        device_read)
+{
+	nih_local ino_t *     inodes = NULL;
+	nih_local char *      buf = NULL;
+	struct xfs_bulk_ireq *req;
+	size_t                num_inodes;
+	uint64_t              covered = 0;
+	int                   fd;
+
+	nih_assert (file != NULL);
+
+	num_inodes = sorted_inodes (file, &inodes);
+	if (! num_inodes)
+		return;
+
+	fd = open_any_path (file);
+	if (fd < 0)
+		return;
+
+	buf = NIH_MUST (nih_alloc (NULL, (sizeof (struct xfs_bulk_ireq)
+					  + (XFS_BULKSTAT_SIZE
+					     * XFS_BULKSTAT_BATCH))));
+	req = (struct xfs_bulk_ireq *)buf;
+
+	for (size_t i = 0; i < num_inodes; i++) {
+		if (inodes[i] <= covered)
+			continue;
+
+		memset (req, 0, sizeof (struct xfs_bulk_ireq));
+		req->ino = inodes[i];
+		req->icount = XFS_BULKSTAT_BATCH;
+
+		if (ioctl (fd, XFS_IOC_BULKSTAT, req) < 0) {
+			nih_warn ("%s: %s", _("Unable to preload XFS inodes"),
+				  strerror (errno));
+			break;
+		}
+
+		if (! req->ocount)
+			break;
+
+		/* The first member of each result is its inode number */
+		memcpy (&covered, (buf + sizeof (struct xfs_bulk_ireq)
+				   + XFS_BULKSTAT_SIZE * (req->ocount - 1)),
+			sizeof covered);
+	}
+
+	close (fd);
+}
+
+/**
+ * btrfs_preload:
+ * @file: pack file,
+ * @selected: unused,
+ * @device_read: unused.
+ *
+ * Searches the subvolume's tree for the inode item of each file in the
+ * pack, in inode order, which reads the tree leaves they live in into
+ * memory.
+ **/
+static void
+btrfs_preload (PackFile * file,
+	       const int *selected,
+	       int        device_read)
+{
+	nih_local ino_t *                         inodes = NULL;
+	nih_local struct btrfs_ioctl_search_args *args = NULL;
+	size_t                                    num_inodes;
+	int                                       fd;
+
+	nih_assert (file != NULL);
+
+	num_inodes = sorted_inodes (file, &inodes);
+	if (! num_inodes)
+		return;
+
+	fd = open_any_path (file);
+	if (fd < 0)
+		return;
+
+	args = NIH_MUST (nih_new (NULL, struct btrfs_ioctl_search_args));
+
+	for (size_t i = 0; i < num_inodes; i++) {
+		struct btrfs_ioctl_search_key *key = &args->key;
+
+		memset (key, 0, sizeof (struct btrfs_ioctl_search_key));
+		key->tree_id = 0;
+		key->min_objectid = key->max_objectid = inodes[i];
+		key->min_type = key->max_type = BTRFS_INODE_ITEM_KEY;
+		key->max_offset = (uint64_t)-1;
+		key->max_transid = (uint64_t)-1;
+		key->nr_items = 1;
+
+		if (ioctl (fd, BTRFS_IOC_TREE_SEARCH, args) < 0) {
+			nih_warn ("%s: %s", _("Unable to preload btrfs inodes"),
+				  strerror (errno));
+			break;
+		}
+	}
+
+	close (fd);
+}
+
+
+/**
+ * sorted_inodes:
+ * @file: pack file,
+ * @inodes: set to newly allocated array of inode numbers.
+ *
+ * Returns: number of distinct inode numbers of paths in @file, in order.
+ **/
+static size_t
+sorted_inodes (PackFile *file,
+	       ino_t **  inodes)
+{
+	size_t num_inodes = 0;
+
+	nih_assert (file != NULL);
+	nih_assert (inodes != NULL);
+
+	*inodes = NIH_MUST (nih_alloc (NULL, (sizeof (ino_t)
+					      * (file->num_paths + 1))));
+
+	for (size_t i = 0; i < file->num_paths; i++)
+		(*inodes)[i] = file->paths[i].ino;
+
+	qsort (*inodes, file->num_paths, sizeof (ino_t), ino_compar);
+
+	for (size_t i = 0; i < file->num_paths; i++)
+		if ((! num_inodes) || ((*inodes)[i] != (*inodes)[num_inodes - 1]))
+			(*inodes)[num_inodes++] = (*inodes)[i];
+
+	return num_inodes;
+}
+
+static int
+ino_compar (const void *a,
+	    const void *b)
+{
+	const ino_t *ino_a = a;
+	const ino_t *ino_b = b;
+
+	nih_assert (ino_a != NULL);
+	nih_assert (ino_b != NULL);
+
+	if (*ino_a < *ino_b) {
+		return -1;
+	} else if (*ino_a > *ino_b) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+/**
+ * open_any_path:
+ * @file: pack file.
+ *
+ * Filesystem ioctls can be made on any file within it.
+ *
+ * Returns: open file on the filesystem of @file, or negative value.
+ **/
+static int
+open_any_path (PackFile *file)
+{
+	nih_assert (file != NULL);
+
+	for (size_t i = 0; i < file->num_paths; i++) {
+		int fd;
+
+		fd = open (file->paths[i].path, O_RDONLY | O_NOATIME);
+		if (fd >= 0)
+			return fd;
+	}
+
+	return -1;
+}
@@ -0,0 +1,64 @@
+/* ureadahead
+ *
+ * Copyright © 2009 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef UREADAHEAD_META_H
+#define UREADAHEAD_META_H
+
+#include <nih/macros.h>
+
+#include "pack.h"
+
+
+/**
+ * MetaPlugin:
+ * @name: name of the filesystem,
+ * @magic: statfs() type of the filesystem,
+ * @trace: function called when tracing to record the metadata of the
+ * files in a pack, or NULL,
+ * @preload: function called before the files in a pack are opened to
+ * read their metadata, or NULL,
+ * @bdev_directories: TRUE if the filesystem reads directory blocks
+ * through the page cache of its block device, so that they're worth
+ * recording in the pack and reading from there.
+ *
+ * Filesystem-specific means of reading the metadata needed to open the
+ * files in a pack.  Other filesystems cache directories themselves, and
+ * btrfs reports addresses that aren't on the block device at all, so
+ * reading their directory blocks from the block device would be wasted.
+ *
+ * @preload is passed the groups selected for preloading, and whether
+ * their inode tables and the pack's metadata extents have already been
+ * read from the block device.
+ **/
+typedef struct meta_plugin {
+	const char *name;
+	long        magic;
+	int       (*trace)   (const void *parent, PackFile *file);
+	void      (*preload) (PackFile *file, const int *selected,
+			      int device_read);
+	int         bdev_directories;
+} MetaPlugin;
+
+
+NIH_BEGIN_EXTERN
+
+const MetaPlugin *meta_plugin (long magic);
+
+NIH_END_EXTERN
+
+#endif /* UREADAHEAD_META_H */
@@ -0,0 +1,558 @@
+/* ureadahead
+ *
+ * model.c - learning and predicting which files are opened next
+ *
+ * Copyright © 2009 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "model.h"
+#include "pack.h"
+#include "file.h"
+
+
+/**
+ * MODEL_HEADER:
+ *
+ * First line of the model file, changed when the format does.
+ **/
+#define MODEL_HEADER "ureadahead model 1"
+
+/**
+ * MODEL_SUCCESSORS_MAX:
+ *
+ * Number of different successors remembered for each file; beyond this
+ * the least frequent is forgotten.
+ **/
+#define MODEL_SUCCESSORS_MAX 16
+
+/**
+ * MODEL_TOTAL_MAX:
+ *
+ * Once a file has been followed by others this many times, the counts
+ * are halved so that recent traces outweigh old ones.
+ **/
+#define MODEL_TOTAL_MAX 1024
+
+/**
+ * PREDICT_DEDUP_TIME:
+ *
+ * Number of seconds for which a file we've read is assumed to still be
+ * in memory, and isn't read again.
+ **/
+#define PREDICT_DEDUP_TIME 60
+
+/**
+ * PREDICT_BUFFER_SIZE:
+ *
+ * Size of the buffer fanotify events are read into.
+ **/
+#define PREDICT_BUFFER_SIZE 8192
+
+#ifndef FAN_MARK_FILESYSTEM
+# define FAN_MARK_FILESYSTEM 0x00000100
+#endif
+
+
+/**
+ * PredictRead:
+ * @entry: list header,
+ * @path: file read,
+ * @issued: time it was read.
+ **/
+typedef struct predict_read {
+	NihList entry;
+	char *  path;
+	time_t  issued;
+} PredictRead;
+
+
+/* Prototypes for static functions */
+static ModelNode *model_node     (Model *model, const char *path);
+static void       model_count    (Model *model, const char *from,
+				  const char *to, unsigned int count);
+static void       predict_open   (Model *model, NihHash *read,
+				  const char *path, int threshold);
+static void       predict_read   (NihHash *read, const char *path);
+
+
+/**
+ * model_read:
+ * @parent: parent of returned model,
+ * @filename: file to read from.
+ *
+ * Reads the model from @filename; a missing file, or one in an older
+ * format, gives an empty model.
+ *
+ * Returns: newly allocated model, or NULL on raised error.
+ **/
+Model *
+model_read (const void *parent,
+	    const char *filename)
+{
+	Model *     model;
+	FILE *      fp;
+	char *      line;
+	ModelNode * node = NULL;
+
+	nih_assert (filename != NULL);
+
+	model = NIH_MUST (nih_new (parent, Model));
+	model->nodes = NIH_MUST (nih_hash_string_new (model, 2500));
+	model->last = NULL;
+
+	fp = fopen (filename, "r");
+	if ((! fp) && (errno == ENOENT)) {
+		return model;
+	} else if (! fp) {
+		nih_error_raise_system ();
+		nih_free (model);
+		return NULL;
+	}
+
+	line = fgets_alloc (NULL, fp);
+	if ((! line) || strcmp (line, MODEL_HEADER)) {
+		nih_warn ("%s: %s", filename, _("Ignored model in old format"));
+		if (line)
+			nih_free (line);
+		fclose (fp);
+		return model;
+	}
+	nih_free (line);
+
+	/* Each file opened is on a line of its own, followed by the
+	 * files opened after it indented and prefixed by a count.
+	 */
+	while ((line = fgets_alloc (NULL, fp)) != NULL) {
+		char *       ptr;
+		unsigned int count;
+
+		if (line[0] == '/') {
+			node = model_node (model, line);
+		} else if (node && (line[0] == '\t')
+			   && (sscanf (line + 1, "%u", &count) == 1)
+			   && (ptr = strchr (line + 1, ' '))) {
+			model_count (model, node->path, ptr + 1, count);
+		}
+
+		nih_free (line);
+	}
+
+	if (fclose (fp) < 0) {
+		nih_error_raise_system ();
+		nih_free (model);
+		return NULL;
+	}
+
+	return model;
+}
+
+/**
+ * model_write:
+ * @model: model to write,
+ * @filename: file to write to.
+ *
+ * The model is written to a temporary file which then replaces
+ * @filename, so that a reader never sees it half-written.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+model_write (Model *     model,
+	     const char *filename)
+{
+	nih_local char *tmpname = NULL;
+	int             fd;
+	FILE *          fp;
+
+	nih_assert (model != NULL);
+	nih_assert (filename != NULL);
+
+	tmpname = NIH_MUST (nih_sprintf (NULL, "%s.tmp", filename));
+
+	fd = open (tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+	if (fd < 0)
+		nih_return_system_error (-1);
+
+	fp = fdopen (fd, "w");
+	if (! fp) {
+		nih_error_raise_system ();
+		close (fd);
+		unlink (tmpname);
+		return -1;
+	}
+
+	fprintf (fp, "%s\n", MODEL_HEADER);
+
+	NIH_HASH_FOREACH (model->nodes, iter) {
+		ModelNode *node = (ModelNode *)iter;
+
+		if (! node->num_successors)
+			continue;
+
+		fprintf (fp, "%s\n", node->path);
+		for (size_t i = 0; i < node->num_successors; i++)
+			fprintf (fp, "\t%u %s\n", node->successors[i].count,
+				 node->successors[i].path);
+	}
+
+	if ((fclose (fp) < 0)
+	    || (rename (tmpname, filename) < 0)) {
+		nih_error_raise_system ();
+		unlink (tmpname);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * model_observe:
+ * @model: model to learn into,
+ * @path: file opened.
+ *
+ * Counts @path as following the file previously observed.  Repeated
+ * opens of the same file count only once.
+ **/
+void
+model_observe (Model *     model,
+	       const char *path)
+{
+	nih_assert (model != NULL);
+	nih_assert (path != NULL);
+
+	/* Paths are stored a line at a time */
+	if (strchr (path, '\n'))
+		return;
+
+	if (model->last && (! strcmp (model->last, path)))
+		return;
+
+	if (model->last) {
+		model_count (model, model->last, path, 1);
+		nih_free (model->last);
+	}
+
+	model->last = NIH_MUST (nih_strdup (model, path));
+}
+
+
+/**
+ * model_node:
+ * @model: model,
+ * @path: file opened.
+ *
+ * Returns: node for @path, created if not already in @model.
+ **/
+static ModelNode *
+model_node (Model *     model,
+	    const char *path)
+{
+	ModelNode *node;
+
+	nih_assert (model != NULL);
+	nih_assert (path != NULL);
+
+	node = (ModelNode *)nih_hash_lookup (model->nodes, path);
+	if (node)
+		return node;
+
+	node = NIH_MUST (nih_new (model->nodes, ModelNode));
+	nih_list_init (&node->entry);
+	nih_alloc_set_destructor (node, nih_list_destroy);
+
+	node->path = NIH_MUST (nih_strdup (node, path));
+	node->total = 0;
+	node->num_successors = 0;
+	node->successors = NULL;
+
+	nih_hash_add (model->nodes, &node->entry);
+
+	return node;
+}
+
+/**
+ * model_count:
+ * @model: model,
+ * @from: file opened first,
+ * @to: file opened after it,
+ * @count: number of times it was.
+ **/
+static void
+model_count (Model *      model,
+	     const char * from,
+	     const char * to,
+	     unsigned int count)
+{
+	ModelNode *     node;
+	ModelSuccessor *successor = NULL;
+
+	nih_assert (model != NULL);
+	nih_assert (from != NULL);
+	nih_assert (to != NULL);
+
+	node = model_node (model, from);
+
+	for (size_t i = 0; i < node->num_successors; i++) {
+		if (! strcmp (node->successors[i].path, to)) {
+			successor = &node->successors[i];
+			break;
+		}
+	}
+
+	if ((! successor) && (node->num_successors < MODEL_SUCCESSORS_MAX)) {
+		node->successors = NIH_MUST (nih_realloc (
+			node->successors, node,
+			(sizeof (ModelSuccessor)
+			 * (node->num_successors + 1))));
+
+		successor = &node->successors[node->num_successors++];
+		successor->path = NIH_MUST (nih_strdup (node->successors, to));
+		successor->count = 0;
+	} else if (! successor) {
+		/* Forget the least frequent successor to make room */
+		successor = &node->successors[0];
+		for (size_t i = 1; i < node->num_successors; i++)
+			if (node->successors[i].count < successor->count)
+				successor = &node->successors[i];
+
+		node->total -= successor->count;
+
+		nih_free (successor->path);
+		successor->path = NIH_MUST (nih_strdup (node->successors, to));
+		successor->count = 0;
+	}
+
+	successor->count += count;
+	node->total += count;
+
+	if (node->total > MODEL_TOTAL_MAX) {
+		node->total = 0;
+		for (size_t i = 0; i < node->num_successors; i++) {
+			node->successors[i].count = (node->successors[i].count + 1) / 2;
+			node->total += node->successors[i].count;
+		}
+	}
+}
+
+
+/**
+ * do_predict:
+ * @model: model to predict from,
+ * @threshold: percentage probability above which a file is read,
+ * @daemonise: TRUE to detach once watching.
+ *
+ * Watches for files being opened on the root filesystem with fanotify,
+ * and reads those that @model says have at least a @threshold percent
+ * chance of being opened next.
+ *
+ * Only returns on error.
+ *
+ * Returns: negative value on error.
+ **/
+int
+do_predict (Model *model,
+	    int    threshold,
+	    int    daemonise)
+{
+	int      fd;
+	NihHash *read_hash;
+	char     buf[PREDICT_BUFFER_SIZE]
+		__attribute__ ((aligned (__alignof__ (struct fanotify_event_metadata))));
+
+	nih_assert (model != NULL);
+
+	fd = fanotify_init (FAN_CLASS_NOTIF | FAN_CLOEXEC,
+			    O_RDONLY | O_LARGEFILE | O_CLOEXEC | O_NOATIME);
+	if (fd < 0)
+		nih_return_system_error (-1);
+
+	/* Older kernels can only mark the mount */
+	if ((fanotify_mark (fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+			    FAN_OPEN, AT_FDCWD, "/") < 0)
+	    && ((errno != EINVAL)
+		|| (fanotify_mark (fd, FAN_MARK_ADD | FAN_MARK_MOUNT,
+				   FAN_OPEN, AT_FDCWD, "/") < 0))) {
+		nih_error_raise_system ();
+		close (fd);
+		return -1;
+	}
+
+	if (daemonise) {
+		pid_t pid;
+
+		pid = fork ();
+		if (pid < 0) {
+			nih_error_raise_system ();
+			close (fd);
+			return -1;
+		} else if (pid > 0) {
+			_exit (0);
+		}
+	}
+
+	read_hash = NIH_MUST (nih_hash_string_new (NULL, 2500));
+
+	for (;;) {
+		struct fanotify_event_metadata *event;
+		ssize_t                         len;
+
+		len = read (fd, buf, sizeof buf);
+		if ((len < 0) && (errno == EINTR)) {
+			continue;
+		} else if (len < 0) {
+			nih_error_raise_system ();
+			close (fd);
+			nih_free (read_hash);
+			return -1;
+		}
+
+		for (event = (struct fanotify_event_metadata *)buf;
+		     FAN_EVENT_OK (event, len);
+		     event = FAN_EVENT_NEXT (event, len)) {
+			char    link[32];
+			char    path[PATH_MAX];
+			ssize_t path_len;
+
+			if (event->fd < 0)
+				continue;
+
+			/* Our own reads would otherwise feed back */
+			if (event->pid == getpid ()) {
+				close (event->fd);
+				continue;
+			}
+
+			sprintf (link, "/proc/self/fd/%d", event->fd);
+			path_len = readlink (link, path, sizeof path - 1);
+			close (event->fd);
+
+			if (path_len <= 0)
+				continue;
+
+			path[path_len] = '\0';
+			predict_open (model, read_hash, path, threshold);
+		}
+	}
+}
+
+/**
+ * predict_open:
+ * @model: model to predict from,
+ * @read: files recently read,
+ * @path: file just opened,
+ * @threshold: percentage probability above which a file is read.
+ **/
+static void
+predict_open (Model *     model,
+	      NihHash *   read,
+	      const char *path,
+	      int         threshold)
+{
+	ModelNode *node;
+
+	nih_assert (model != NULL);
+	nih_assert (read != NULL);
+	nih_assert (path != NULL);
+
+	node = (ModelNode *)nih_hash_lookup (model->nodes, path);
+	if ((! node) || (! node->total))
+		return;
+
+	for (size_t i = 0; i < node->num_successors; i++) {
+		ModelSuccessor *successor = &node->successors[i];
+
+		if (successor->count * 100 < (unsigned int)threshold * node->total)
+			continue;
+
+		nih_debug ("%s: %s (%u%%)", path, successor->path,
+			   successor->count * 100 / node->total);
+		predict_read (read, successor->path);
+	}
+}
+
+/**
+ * predict_read:
+ * @read: files recently read,
+ * @path: file to read.
+ *
+ * Reads all of @path, unless it was read recently.
+ **/
+static void
+predict_read (NihHash *   read,
+	      const char *path)
+{
+	struct timespec now;
+	PredictRead *   entry;
+	struct stat     statbuf;
+	int             fd;
+
+	nih_assert (read != NULL);
+	nih_assert (path != NULL);
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	entry = (PredictRead *)nih_hash_lookup (read, path);
+	if (entry && (now.tv_sec - entry->issued < PREDICT_DEDUP_TIME))
+		return;
+
+	if (! entry) {
+		entry = NIH_MUST (nih_new (read, PredictRead));
+		nih_list_init (&entry->entry);
+		nih_alloc_set_destructor (entry, nih_list_destroy);
+
+		entry->path = NIH_MUST (nih_strdup (entry, path));
+		nih_hash_add (read, &entry->entry);
+	}
+
+	entry->issued = now.tv_sec;
+
+	fd = open (path, O_RDONLY | O_NOATIME);
+	if (fd < 0)
+		return;
+
+	if ((fstat (fd, &statbuf) == 0)
+	    && S_ISREG (statbuf.st_mode)
+	    && statbuf.st_size)
+		load_pages_in_core (fd, 0, statbuf.st_size);
+
+	close (fd);
+}
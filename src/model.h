@@ -0,0 +1,84 @@
+/* ureadahead
+ *
+ * Copyright © 2009 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef UREADAHEAD_MODEL_H
+#define UREADAHEAD_MODEL_H
+
+#include <nih/macros.h>
+#include <nih/hash.h>
+
+
+/**
+ * PATH_MODEL:
+ *
+ * Where the model of which files are opened after which is kept,
+ * alongside the packs.
+ **/
+#define PATH_MODEL "/var/lib/ureadahead/model"
+
+
+/**
+ * ModelSuccessor:
+ * @path: file opened next,
+ * @count: number of times it was.
+ **/
+typedef struct model_successor {
+	char *       path;
+	unsigned int count;
+} ModelSuccessor;
+
+/**
+ * ModelNode:
+ * @entry: list header,
+ * @path: file opened,
+ * @total: number of times it was followed by another open,
+ * @num_successors: number of entries in @successors,
+ * @successors: files opened next.
+ **/
+typedef struct model_node {
+	NihList         entry;
+	char *          path;
+	unsigned int    total;
+	size_t          num_successors;
+	ModelSuccessor *successors;
+} ModelNode;
+
+/**
+ * Model:
+ * @nodes: hash table of ModelNode by path,
+ * @last: path last observed while learning.
+ *
+ * First-order model of the order in which files are opened.
+ **/
+typedef struct model {
+	NihHash *nodes;
+	char *   last;
+} Model;
+
+
+NIH_BEGIN_EXTERN
+
+Model *model_read    (const void *parent, const char *filename);
+int    model_write   (Model *model, const char *filename);
+void   model_observe (Model *model, const char *path);
+
+int    do_predict    (Model *model, int threshold, int daemonise);
+
+NIH_END_EXTERN
+
+#endif /* UREADAHEAD_MODEL_H */
@@ -26,20 +26,28 @@
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/vfs.h>
+#include <sys/utsname.h>
 #include <sys/syscall.h>
 #include <sys/resource.h>
 
 #include <time.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <signal.h>
 
 #include <blkid.h>
-#include <ext2fs.h>
+
+#include <linux/magic.h>
 
 #include <nih/macros.h>
 #include <nih/alloc.h>
@@ -51,19 +59,35 @@
 #include "values.h"
 #include "file.h"
 #include "errors.h"
+#include "meta.h"
 
 
 /* From linux/ioprio.h */
 #define IOPRIO_CLASS_SHIFT 13
 
 #define IOPRIO_CLASS_RT    1
+#define IOPRIO_CLASS_BE    2
 #define IOPRIO_CLASS_IDLE  3
 
 #define IOPRIO_WHO_PROCESS 1
 
 #define IOPRIO_RT_HIGHEST  (0 | (IOPRIO_CLASS_RT << IOPRIO_CLASS_SHIFT))
+#define IOPRIO_BE_HIGHEST  (0 | (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT))
 #define IOPRIO_IDLE_LOWEST (7 | (IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT))
 
+/* From linux/mman.h, since 5.14 */
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+
+/**
+ * PACK_VERSION:
+ *
+ * Version of the pack file format, written into the header; packs with
+ * any other version are ignored and will be regenerated.
+ **/
+#define PACK_VERSION 7
 
 /**
  * PATH_PACKDIR:
@@ -79,6 +103,62 @@
  **/
 #define NUM_THREADS 4
 
+/**
+ * HDD_QUEUE_DEPTH_MAX:
+ *
+ * Largest number of reads we'll keep in flight at once on a rotational
+ * disk, which is as many as NCQ can queue.
+ **/
+#define HDD_QUEUE_DEPTH_MAX 32
+
+/**
+ * HDD_SEEK_US:
+ *
+ * Cost, in microseconds, of opening a file on a rotational disk whose
+ * inode wasn't preloaded, until it's been measured.
+ **/
+#define HDD_SEEK_US 8000
+
+/**
+ * HDD_TRANSFER_KBS:
+ *
+ * Sequential transfer rate, in kB/s, assumed of rotational disks when
+ * weighing the cost of preloading an inode table.
+ **/
+#define HDD_TRANSFER_KBS (100 * 1024)
+
+/**
+ * SSD_READ_US:
+ *
+ * Cost, in microseconds, of opening a file on a solid-state disk whose
+ * inode wasn't preloaded.
+ **/
+#define SSD_READ_US 100
+
+/**
+ * SSD_TRANSFER_KBS:
+ *
+ * Transfer rate, in kB/s, assumed of solid-state disks when weighing the
+ * cost of preloading an inode table.
+ **/
+#define SSD_TRANSFER_KBS (1024 * 1024)
+
+/**
+ * META_CHUNK_LENGTH:
+ *
+ * Length of the pieces metadata extents are split into so that threads
+ * can read them in parallel on solid-state disks.
+ **/
+#define META_CHUNK_LENGTH (1024 * 1024)
+
+/**
+ * HDD_SEEK_SAMPLES_MIN:
+ *
+ * Number of files opened from groups that weren't preloaded before the
+ * time taken to open them is used to measure the cost.
+ **/
+#define HDD_SEEK_SAMPLES_MIN 16
+
 /**
  * READAHEAD_MAX_LENGTH:
  *
@@ -87,17 +167,96 @@
  **/
 #define READAHEAD_MAX_LENGTH (32 * 4096)
 
+/**
+ * READAHEAD_FOLIO_LENGTH:
+ *
+ * Length, and alignment, of readahead() requests on filesystems whose page
+ * cache uses large folios; matches the largest folio the kernel will
+ * allocate for them on most architectures.
+ **/
+#define READAHEAD_FOLIO_LENGTH (2 * 1024 * 1024)
+
+/**
+ * WARM_BUFFER_SIZE:
+ *
+ * Size of the buffer that data is read into and discarded when warming
+ * ranges on kernels without MADV_POPULATE_READ.
+ **/
+#define WARM_BUFFER_SIZE (64 * 1024)
+
+/**
+ * WARM_IOVECS:
+ *
+ * Number of times the discard buffer is repeated in a single preadv()
+ * call, so that each system call reads up to a megabyte.
+ **/
+#define WARM_IOVECS 16
+
 typedef enum pack_flags {
 	PACK_ROTATIONAL = 0x01,
 } PackFlags;
 
 
+/**
+ * large_folio_fs:
+ *
+ * Filesystems whose page cache can be made of large folios, and the
+ * kernel version in which they gained that.
+ **/
+static const struct {
+	long magic;
+	int  major;
+	int  minor;
+} large_folio_fs[] = {
+	{ XFS_SUPER_MAGIC,  5, 18 },
+	{ EXT4_SUPER_MAGIC, 6, 16 },
+};
+
+/**
+ * max_length:
+ *
+ * Length of each readahead() request made by load_pages_in_core(), set
+ * for the device being read by do_readahead().
+ **/
+static off_t max_length = READAHEAD_MAX_LENGTH;
+
+
 /* Prototypes for static functions */
 static void  print_time          (const char *message, struct timespec *start);
-static int   do_readahead_hdd    (PackFile *file, int daemonise);
-static void  preload_inode_group (ext2_filsys fs, int group);
-static int   do_readahead_ssd    (PackFile *file, int daemonise);
+static off_t readahead_length    (PackFile *file);
+static int   pin_critical        (PackFile *file, int daemonise, off_t limit);
+static void  tune_queue          (PackFile *file, PackQueue *old);
+static int   get_queue_value     (dev_t dev, const char *name);
+static int   raise_queue_value   (dev_t dev, const char *name, int value);
+static void  restore_queue       (PackFile *file, PackQueue *old);
+static void  print_warm_times    (PackFile *file, struct timespec *start,
+				  struct timespec *warmed);
+static int   do_readahead_hdd    (PackFile *file, int daemonise,
+				  const ReadaheadOptions *options);
+static int   hdd_seek_cost       (const char *stats_file);
+static void  hdd_write_stats     (const char *stats_file, int seek_us,
+				  long open_us, size_t misses, off_t preloaded);
+static off_t select_groups       (PackFile *file, int seek_us,
+				  int transfer_kbs, int *selected);
+static int   group_compar        (const void *key, const void *member);
+static int   extent_compar       (const void *a, const void *b);
+static size_t merge_extents      (PackFile *file, const int *selected,
+				  off_t chunk, PackExtent **extents);
+static int   open_device         (PackFile *file);
+static int   preload_extents     (PackFile *file, const int *selected);
+static int   warm_metadata       (PackFile *file, int ioprio);
+static void *meta_thread         (void *ptr);
+static void *hdd_sweep           (void *ptr);
+static void *hdd_thread          (void *ptr);
+static int   do_readahead_ssd    (PackFile *file, int daemonise,
+				  const ReadaheadOptions *options);
 static void *ra_thread           (void *ptr);
+static int   readahead_failed    (size_t failed);
+static int   pack_critical       (PackFile *file);
+static void  set_thread_ioprio   (int ioprio);
+static int   read_block          (int fd, const PackBlock *block,
+				  int warm);
+static int   read_whole          (int fd, int warm);
 
 
 char *
@@ -228,15 +387,25 @@ pack_file_name_for_device (const void *parent,
 	nih_return_system_error (NULL);
 }
 
-static int
+int
 load_pages_in_core (int   fd,
 		    off_t offset,
 		    off_t length)
 {
 	while (length > 0) {
-		const off_t read_length = length <= READAHEAD_MAX_LENGTH ?
-			length : READAHEAD_MAX_LENGTH;
-		int ret = readahead (fd, offset, read_length);
+		off_t read_length;
+		int   ret;
+
+		/* Split on multiples of the request length, rather than
+		 * every request length from the start of the range, so
+		 * that requests are aligned the way the page cache would
+		 * like to allocate its folios.
+		 */
+		read_length = max_length - (offset % max_length);
+		if (read_length > length)
+			read_length = length;
+
+		ret = readahead (fd, offset, read_length);
 		if (ret < 0) {
 			return ret;
 		}
@@ -246,6 +415,166 @@ load_pages_in_core (int   fd,
 	return 0;
 }
 
+/**
+ * readahead_length:
+ * @file: pack file to be read.
+ *
+ * Works out how long each readahead() request for the device of @file
+ * can usefully be.  Kernels before 4.10 read no more than 32 pages per
+ * request, later ones read as much as the larger of the device's
+ * read_ahead_kb and max_sectors_kb; on filesystems with large folio page
+ * caches we go up to READAHEAD_FOLIO_LENGTH so that each request can be
+ * filled with a few large folios.
+ *
+ * Returns: length in bytes.
+ **/
+static off_t
+readahead_length (PackFile *file)
+{
+	struct utsname  uts;
+	int             kernel_major = 0;
+	int             kernel_minor = 0;
+	struct statfs   fs;
+	int             large_folios = FALSE;
+	off_t           length = 0;
+	const char *    queue_limits[] = { "read_ahead_kb", "max_sectors_kb" };
+
+	nih_assert (file != NULL);
+
+	if ((uname (&uts) < 0)
+	    || (sscanf (uts.release, "%d.%d", &kernel_major, &kernel_minor) < 2))
+		return READAHEAD_MAX_LENGTH;
+
+	if ((kernel_major < 4)
+	    || ((kernel_major == 4) && (kernel_minor < 10)))
+		return READAHEAD_MAX_LENGTH;
+
+	/* Any path will do to find out the filesystem type */
+	for (size_t i = 0; i < file->num_paths; i++) {
+		if (statfs (file->paths[i].path, &fs) < 0)
+			continue;
+
+		for (size_t j = 0; j < sizeof large_folio_fs / sizeof large_folio_fs[0]; j++)
+			if ((fs.f_type == large_folio_fs[j].magic)
+			    && ((kernel_major > large_folio_fs[j].major)
+				|| ((kernel_major == large_folio_fs[j].major)
+				    && (kernel_minor >= large_folio_fs[j].minor))))
+				large_folios = TRUE;
+		break;
+	}
+
+	if (large_folios)
+		return READAHEAD_FOLIO_LENGTH;
+
+	/* The kernel silently truncates requests longer than this */
+	for (size_t i = 0; i < sizeof queue_limits / sizeof queue_limits[0]; i++) {
+		nih_local char *path = NULL;
+		int             value;
+
+		path = queue_value_path (NULL, file->dev, queue_limits[i]);
+		if (get_value (AT_FDCWD, path, &value) < 0) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_free (err);
+			continue;
+		}
+
+		length = nih_max (length, (off_t)value * 1024);
+	}
+
+	if (length < READAHEAD_MAX_LENGTH)
+		return READAHEAD_MAX_LENGTH;
+
+	return nih_min (length, READAHEAD_FOLIO_LENGTH);
+}
+
+/**
+ * warm_pages_in_core:
+ * @fd: file descriptor to read from,
+ * @offset: offset of range,
+ * @length: length of range.
+ *
+ * Unlike load_pages_in_core(), which only queues the I/O, this does not
+ * return until the range is actually in the page cache.  The range is
+ * populated through a temporary mapping with MADV_POPULATE_READ, or on
+ * older kernels by reading it into a buffer that is thrown away.
+ *
+ * Returns: zero on success, negative value on error.
+ **/
+int
+warm_pages_in_core (int   fd,
+		    off_t offset,
+		    off_t length)
+{
+	static int           page_size = -1;
+	static int           no_populate = FALSE;
+	static __thread char discard[WARM_BUFFER_SIZE];
+
+	if (page_size < 0)
+		page_size = sysconf (_SC_PAGESIZE);
+
+	if (! no_populate) {
+		off_t start;
+		off_t map_length;
+		void *buf;
+
+		start = offset - (offset % page_size);
+		map_length = length + (offset - start);
+
+		buf = mmap (NULL, map_length, PROT_READ, MAP_SHARED, fd, start);
+		if (buf != MAP_FAILED) {
+			int ret;
+			int saved_errno;
+
+			ret = madvise (buf, map_length, MADV_POPULATE_READ);
+			saved_errno = errno;
+			munmap (buf, map_length);
+
+			if (! ret)
+				return 0;
+
+			/* EINVAL means the kernel doesn't know the advice,
+			 * anything else (usually EFAULT for a range past
+			 * the end of a file that shrunk) we leave to the
+			 * read below to sort out.
+			 */
+			if (saved_errno == EINVAL)
+				no_populate = TRUE;
+		}
+	}
+
+	while (length > 0) {
+		struct iovec iov[WARM_IOVECS];
+		int          iovcnt;
+		off_t        want;
+		ssize_t      len;
+
+		for (iovcnt = 0, want = 0;
+		     (iovcnt < WARM_IOVECS) && (want < length);
+		     iovcnt++) {
+			iov[iovcnt].iov_base = discard;
+			iov[iovcnt].iov_len = nih_min (length - want,
+						       WARM_BUFFER_SIZE);
+			want += iov[iovcnt].iov_len;
+		}
+
+		len = preadv (fd, iov, iovcnt, offset);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		} else if (! len) {
+			break;
+		}
+
+		offset += len;
+		length -= len;
+	}
+
+	return 0;
+}
+
 PackFile *
 read_pack (const void *parent,
 	   const char *filename,
@@ -287,7 +616,7 @@ read_pack (const void *parent,
 		goto error;
 	}
 
-	if (hdr[3] != 2) {
+	if (hdr[3] != PACK_VERSION) {
 		nih_debug ("Pack version error");
 		goto error;
 	}
@@ -319,6 +648,25 @@ read_pack (const void *parent,
 			 file->rotational ? "hdd" : "ssd",
 			 major (file->dev), minor (file->dev));
 
+	/* Read in the block queue settings */
+	if (fread (&file->queue, sizeof file->queue, 1, fp) < 1) {
+		nih_debug ("Short read of queue settings");
+		goto error;
+	}
+
+	file->queue.scheduler[PACK_SCHEDULER_MAX] = '\0';
+
+	nih_log_message (dump ? NIH_LOG_MESSAGE : NIH_LOG_DEBUG,
+			 "read_ahead_kb %d, nr_requests %d, scheduler %s",
+			 file->queue.read_ahead_kb, file->queue.nr_requests,
+			 file->queue.scheduler[0] ? file->queue.scheduler : "unchanged");
+
+
+	/* Read in the filesystem type */
+	if (fread (&file->fs_type, sizeof file->fs_type, 1, fp) < 1) {
+		nih_debug ("Short read of filesystem type");
+		goto error;
+	}
 
 	/* Read in the number of group entries */
 	if (fread (&file->num_groups, sizeof file->num_groups, 1, fp) < 1) {
@@ -326,14 +674,28 @@ read_pack (const void *parent,
 		goto error;
 	}
 
-	file->groups = NIH_MUST (nih_alloc (file, sizeof (int) * file->num_groups));
+	file->groups = NIH_MUST (nih_alloc (file, sizeof (PackGroup) * file->num_groups));
 
 	/* Read in the group entries */
-	if (fread (file->groups, sizeof (int), file->num_groups, fp) < file->num_groups) {
+	if (fread (file->groups, sizeof (PackGroup), file->num_groups, fp) < file->num_groups) {
 		nih_debug ("Short read of group entries");
 		goto error;
 	}
 
+	/* Read in the number of metadata extent entries */
+	if (fread (&file->num_extents, sizeof file->num_extents, 1, fp) < 1) {
+		nih_debug ("Short read of number of extent entries");
+		goto error;
+	}
+
+	file->extents = NIH_MUST (nih_alloc (file, sizeof (PackExtent) * file->num_extents));
+
+	/* Read in the metadata extent entries */
+	if (fread (file->extents, sizeof (PackExtent), file->num_extents, fp) < file->num_extents) {
+		nih_debug ("Short read of extent entries");
+		goto error;
+	}
+
 	/* Read in the number of path entries */
 	if (fread (&file->num_paths, sizeof file->num_paths, 1, fp) < 1) {
 		nih_debug ("Short read of number of path entries");
@@ -373,6 +735,42 @@ read_pack (const void *parent,
 				 "%zu inode groups, %zu files, %zu blocks (%zu kB)",
 				 file->num_groups, file->num_paths, file->num_blocks,
 				 (size_t)bytes / 1024);
+
+		if (file->num_extents) {
+			bytes = 0;
+			for (size_t i = 0; i < file->num_extents; i++)
+				bytes += file->extents[i].length;
+
+			nih_log_message (dump ? NIH_LOG_MESSAGE : NIH_LOG_INFO,
+					 "%zu metadata extents (%zu kB)",
+					 file->num_extents, (size_t)bytes / 1024);
+		}
+
+		if (pack_critical (file)) {
+			size_t critical = 0;
+
+			for (size_t i = 0; i < file->num_paths; i++)
+				if (file->paths[i].flags & PACK_PATH_CRITICAL)
+					critical++;
+
+			nih_log_message (dump ? NIH_LOG_MESSAGE : NIH_LOG_INFO,
+					 "%zu critical files", critical);
+		}
+
+		if (dump) {
+			size_t sequential = 0;
+			size_t random = 0;
+
+			for (size_t i = 0; i < file->num_paths; i++) {
+				if (file->paths[i].flags & PACK_PATH_SEQUENTIAL)
+					sequential++;
+				if (file->paths[i].flags & PACK_PATH_RANDOM)
+					random++;
+			}
+
+			nih_message ("%zu sequential files, %zu random files",
+				     sequential, random);
+		}
 	}
 
 	/* Done */
@@ -423,7 +821,7 @@ write_pack (const char *filename,
 	hdr[1] = 'r';
 	hdr[2] = 'a';
 
-	hdr[3] = 2;
+	hdr[3] = PACK_VERSION;
 
 	hdr[4] = 0;
 	hdr[4] |= file->rotational ? PACK_ROTATIONAL : 0;
@@ -440,12 +838,28 @@ write_pack (const char *filename,
 	if (fwrite (&now, sizeof now, 1, fp) < 1)
 		goto error;
 
+	/* Write out the block queue settings */
+	if (fwrite (&file->queue, sizeof file->queue, 1, fp) < 1)
+		goto error;
+
+	/* Write out the filesystem type */
+	if (fwrite (&file->fs_type, sizeof file->fs_type, 1, fp) < 1)
+		goto error;
+
 	/* Write out the number of group entries */
 	if (fwrite (&file->num_groups, sizeof file->num_groups, 1, fp) < 1)
 		goto error;
 
 	/* Write out the group entries */
-	if (fwrite (file->groups, sizeof (int), file->num_groups, fp) < file->num_groups)
+	if (fwrite (file->groups, sizeof (PackGroup), file->num_groups, fp) < file->num_groups)
+		goto error;
+
+	/* Write out the number of metadata extent entries */
+	if (fwrite (&file->num_extents, sizeof file->num_extents, 1, fp) < 1)
+		goto error;
+
+	/* Write out the metadata extent entries */
+	if (fwrite (file->extents, sizeof (PackExtent), file->num_extents, fp) < file->num_extents)
 		goto error;
 
 	/* Write out the number of path entries */
@@ -516,6 +930,40 @@ print_time (const char *     message,
 	start->tv_nsec = end.tv_nsec;
 }
 
+static void
+print_warm_times (PackFile *       file,
+		  struct timespec *start,
+		  struct timespec *warmed)
+{
+	nih_assert (file != NULL);
+	nih_assert (start != NULL);
+	nih_assert (warmed != NULL);
+
+	if (nih_log_priority > NIH_LOG_DEBUG)
+		return;
+
+	/* Paths that had nothing to read, or couldn't be opened, never
+	 * get a time filled in.
+	 */
+	for (size_t i = 0; i < file->num_paths; i++) {
+		struct timespec span;
+
+		if (! warmed[i].tv_sec && ! warmed[i].tv_nsec)
+			continue;
+
+		span.tv_sec = warmed[i].tv_sec - start->tv_sec;
+		span.tv_nsec = warmed[i].tv_nsec - start->tv_nsec;
+
+		if (span.tv_nsec < 0) {
+			span.tv_sec--;
+			span.tv_nsec += 1000000000;
+		}
+
+		nih_debug ("%s: warm after %ld.%03lds", file->paths[i].path,
+			   span.tv_sec, span.tv_nsec / 1000000);
+	}
+}
+
 
 struct pack_sort {
 	size_t    idx;
@@ -640,9 +1088,15 @@ pack_dump (PackFile * file,
 			block_bytes += file->blocks[j].length;
 		}
 
-		nih_message ("%s (%zu kB), %zu blocks (%zu kB)",
+		nih_message ("%s (%zu kB), %zu blocks (%zu kB)%s%s",
 			     pack[i].path->path, (size_t)statbuf.st_size / 1024,
-			     block_count, (size_t)block_bytes / 1024);
+			     block_count, (size_t)block_bytes / 1024,
+			     (pack[i].path->flags & PACK_PATH_CRITICAL
+			      ? ", critical" : ""),
+			     (pack[i].path->flags & PACK_PATH_SEQUENTIAL
+			      ? ", sequential"
+			      : pack[i].path->flags & PACK_PATH_RANDOM
+			      ? ", random" : ""));
 
 		ptr = buf;
 		while (strlen (ptr) > 74) {
@@ -671,13 +1125,17 @@ pack_dump (PackFile * file,
 
 
 int
-do_readahead (PackFile *file,
-	      int       daemonise)
+do_readahead (PackFile *              file,
+	      int                     daemonise,
+	      const ReadaheadOptions *options)
 {
 	int             nr_open;
 	struct rlimit   nofile;
+	PackQueue       old_queue;
+	int             ret;
 
 	nih_assert (file != NULL);
+	nih_assert (options != NULL);
 
 	/* Increase our maximum file open count so that we can actually
 	 * open everything; if the file is larger than the kernel limit,
@@ -700,180 +1158,1272 @@ do_readahead (PackFile *file,
 	if (setrlimit (RLIMIT_NOFILE, &nofile) < 0)
 		nih_return_system_error (-1);
 
-	if (file->rotational) {
-		return do_readahead_hdd (file, daemonise);
+	if (options->keep_queue) {
+		memset (&old_queue, 0, sizeof (PackQueue));
 	} else {
-		return do_readahead_ssd (file, daemonise);
+		tune_queue (file, &old_queue);
 	}
-}
-
-static int
-do_readahead_hdd (PackFile *file,
-		  int       daemonise)
-{
-	struct timespec start;
-	const char *    devname;
-	ext2_filsys     fs = NULL;
-	nih_local int * fds = NULL;
-
-	nih_assert (file != NULL);
-
-	/* Adjust our CPU and I/O priority, we want to stay in the
-	 * foreground and hog all bandwidth to avoid jumping around the
-	 * disk.
-	 */
-	if (setpriority (PRIO_PROCESS, getpid (), -20))
-		nih_warn ("%s: %s", _("Failed to set CPU priority"),
-			  strerror (errno));
-
-	if (syscall (__NR_ioprio_set, IOPRIO_WHO_PROCESS, getpid (),
-		     IOPRIO_RT_HIGHEST) < 0)
-		nih_warn ("%s: %s", _("Failed to set I/O priority"),
-			  strerror (errno));
-
-	clock_gettime (CLOCK_MONOTONIC, &start);
-
-	/* Attempt to open the device as an ext2/3/4 filesystem,
-	 * and if successful do a bit of pre-loading of inode groups
-	 * to speed up opening files.
-	 */
-	devname = blkid_devno_to_devname (file->dev);
-	if (devname
-	    && (! ext2fs_open (devname, 0, 0, 0, unix_io_manager, &fs))) {
-		nih_assert (fs != NULL);
 
-		for (size_t i = 0; i < file->num_groups; i++)
-			preload_inode_group (fs, file->groups[i]);
+	max_length = readahead_length (file);
+	nih_info ("Reading in requests of up to %zu kB",
+		  (size_t)max_length / 1024);
 
-		ext2fs_close (fs);
+	if (file->rotational) {
+		ret = do_readahead_hdd (file, daemonise, options);
+	} else {
+		ret = do_readahead_ssd (file, daemonise, options);
 	}
 
-	print_time ("Preload ext2fs inodes", &start);
+	restore_queue (file, &old_queue);
 
-	/* Open all of the files */
-	fds = NIH_MUST (nih_alloc (NULL, sizeof (int) * file->num_paths));
-	for (size_t i = 0; i < file->num_paths; i++) {
-		fds[i] = open (file->paths[i].path, O_RDONLY | O_NOATIME);
-		if (fds[i] < 0)
-			nih_warn ("%s: %s", file->paths[i].path,
-				  strerror (errno));
-	}
+	if (ret < 0)
+		return ret;
 
-	print_time ("Open files", &start);
+	/* Let anyone waiting know that everything is now in memory */
+	if (options->ready_file) {
+		int fd;
 
-	/* Read in all of the blocks in a single pass for rotational
-	 * disks, otherwise we'll have a seek time penalty.  For SSD,
-	 * use a few threads to read in really fast.
-	 */
-	for (size_t i = 0; i < file->num_blocks; i++) {
-		if ((fds[file->blocks[i].pathidx] < 0)
-		    || (file->blocks[i].pathidx >= file->num_paths))
-			continue;
+		fd = open (options->ready_file,
+			   O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0644);
+		if (fd < 0)
+			nih_return_system_error (-1);
 
-		load_pages_in_core (fds[file->blocks[i].pathidx],
-				    file->blocks[i].offset,
-				    file->blocks[i].length);
+		if (close (fd) < 0)
+			nih_return_system_error (-1);
 	}
 
-	print_time ("Readahead", &start);
+	if (options->pin_limit > 0)
+		return pin_critical (file, daemonise,
+				     (off_t)options->pin_limit * 1024 * 1024);
 
 	return 0;
 }
 
 static void
-preload_inode_group (ext2_filsys fs,
-		     int         group)
+sig_release (int signum)
 {
-	ext2_inode_scan scan = NULL;
-
-	nih_assert (fs != NULL);
-
-	if (! ext2fs_open_inode_scan (fs, 0, &scan)) {
-		nih_assert (scan != NULL);
-
-		if (! ext2fs_inode_scan_goto_blockgroup (scan, group)) {
-			struct ext2_inode inode;
-			ext2_ino_t        ino = 0;
-
-			while ((! ext2fs_get_next_inode (scan, &ino, &inode))
-			       && (ext2fs_group_of_ino (fs, ino) == group))
-				;
-		}
-
-		ext2fs_close_inode_scan (scan);
-	}
 }
 
-
-struct thread_ctx {
-	PackFile *file;
-	size_t    idx;
-	int *     got;
-};
-
+/**
+ * pin_critical:
+ * @file: pack file that has been read,
+ * @daemonise: TRUE to detach before holding the pages,
+ * @limit: most bytes to pin.
+ *
+ * Maps and locks the blocks of the critical files in @file, in pack
+ * order, until @limit bytes are pinned; blocks that can't be locked are
+ * skipped.  On machines short of memory this stops the pages we've just
+ * read being evicted by the rest of boot before they're used.
+ *
+ * The pages are held until we receive SIGTERM, SIGINT or SIGUSR1; on
+ * systemd, ureadahead-stop.service sends the first once boot is
+ * complete.
+ *
+ * Returns: zero once released, negative value on error.
+ **/
 static int
-do_readahead_ssd (PackFile *file,
-		  int       daemonise)
+pin_critical (PackFile *file,
+	      int       daemonise,
+	      off_t     limit)
 {
-	struct timespec   start;
-	pthread_t         thread[NUM_THREADS];
-	struct thread_ctx ctx;
+	struct rlimit    memlock;
+	nih_local int *  fds = NULL;
+	int              page_size;
+	off_t            pinned = 0;
+	size_t           failed = 0;
+	struct sigaction act;
+	sigset_t         mask;
+	sigset_t         oldmask;
 
 	nih_assert (file != NULL);
 
-	/* Can only --daemon for SSD */
-	if (daemonise) {
+	page_size = sysconf (_SC_PAGESIZE);
+
+	/* Hold back the signals that release the pages until we're waiting
+	 * for them, so that one sent while we pin them isn't missed.
+	 */
+	sigemptyset (&mask);
+	sigaddset (&mask, SIGTERM);
+	sigaddset (&mask, SIGINT);
+	sigaddset (&mask, SIGUSR1);
+	sigprocmask (SIG_BLOCK, &mask, &oldmask);
+
+	/* Reading on a hard drive is done in the foreground, but there's
+	 * no reason to hold up boot while we just sit on the pages; detach
+	 * before pinning them, since a child doesn't inherit memory locks.
+	 */
+	if (daemonise && file->rotational) {
 		pid_t pid;
 
 		pid = fork ();
 		if (pid < 0) {
-			nih_return_system_error (-1);
+			nih_error_raise_system ();
+			sigprocmask (SIG_SETMASK, &oldmask, NULL);
+			return -1;
 		} else if (pid > 0) {
 			_exit (0);
 		}
 	}
 
-	if (syscall (__NR_ioprio_set, IOPRIO_WHO_PROCESS, getpid (),
-		     IOPRIO_IDLE_LOWEST) < 0)
-		nih_warn ("%s: %s", _("Failed to set I/O priority"),
+	/* Only the soft limit is raised, as far as the hard limit allows */
+	if (getrlimit (RLIMIT_MEMLOCK, &memlock) < 0) {
+		nih_warn ("%s: %s", _("Failed to raise locked memory limit"),
 			  strerror (errno));
+	} else if ((memlock.rlim_cur != RLIM_INFINITY)
+		   && (memlock.rlim_cur < (rlim_t)limit)) {
+		memlock.rlim_cur = limit;
+		if ((memlock.rlim_max != RLIM_INFINITY)
+		    && (memlock.rlim_cur > memlock.rlim_max))
+			memlock.rlim_cur = memlock.rlim_max;
+
+		if (setrlimit (RLIMIT_MEMLOCK, &memlock) < 0)
+			nih_warn ("%s: %s",
+				  _("Failed to raise locked memory limit"),
+				  strerror (errno));
+	}
 
-	clock_gettime (CLOCK_MONOTONIC, &start);
-
-	ctx.file = file;
-	ctx.idx = 0;
-	ctx.got = NIH_MUST (nih_alloc (NULL, sizeof (int) * file->num_paths));
-	memset (ctx.got, 0, sizeof (int) * file->num_paths);
-
-	for (int t = 0; t < NUM_THREADS; t++)
-		pthread_create (&thread[t], NULL, ra_thread, &ctx);
-	for (int t = 0; t < NUM_THREADS; t++)
-		pthread_join (thread[t], NULL);
-
-	print_time ("Readahead", &start);
+	fds = NIH_MUST (nih_alloc (NULL, sizeof (int) * file->num_paths));
+	for (size_t i = 0; i < file->num_paths; i++)
+		fds[i] = -1;
 
-	return 0;
-}
+	for (size_t i = 0; (i < file->num_blocks) && (pinned < limit); i++) {
+		size_t pathidx = file->blocks[i].pathidx;
+		off_t  start;
+		off_t  length;
+		void * buf;
 
-static void *
-ra_thread (void *ptr)
-{
-	struct thread_ctx *ctx = ptr;
+		if ((pathidx >= file->num_paths)
+		    || (! (file->paths[pathidx].flags & PACK_PATH_CRITICAL)))
+			continue;
 
-	for (;;) {
-		size_t i;
-		size_t pathidx;
-		int    fd;
+		if (fds[pathidx] < 0) {
+			fds[pathidx] = open (file->paths[pathidx].path,
+					     O_RDONLY | O_NOATIME);
+			if (fds[pathidx] < 0)
+				continue;
+		}
 
-		i = __sync_fetch_and_add (&ctx->idx, 1);
-		if (i >= ctx->file->num_blocks)
+		start = file->blocks[i].offset;
+		start -= start % page_size;
+		length = file->blocks[i].length + (file->blocks[i].offset - start);
+		length = nih_min (length, limit - pinned);
+		if (length <= 0)
 			break;
 
-		pathidx = ctx->file->blocks[i].pathidx;
-		if (pathidx > ctx->file->num_paths)
+		buf = mmap (NULL, length, PROT_READ, MAP_SHARED,
+			    fds[pathidx], start);
+		if (buf == MAP_FAILED)
 			continue;
 
-		if (! __sync_bool_compare_and_swap (&ctx->got[pathidx], 0, 1))
+		/* Other blocks may still fit where this one didn't */
+		if (mlock (buf, length) < 0) {
+			if (! failed++)
+				nih_warn ("%s: %s: %s",
+					  file->paths[pathidx].path,
+					  _("Failed to pin in memory"),
+					  strerror (errno));
+			munmap (buf, length);
+			continue;
+		}
+
+		pinned += length;
+	}
+
+	/* The mappings hold the files, we don't need the descriptors */
+	for (size_t i = 0; i < file->num_paths; i++)
+		if (fds[i] >= 0)
+			close (fds[i]);
+
+	nih_info ("Pinned %zu kB of critical files", (size_t)pinned / 1024);
+	if (failed)
+		nih_info ("Failed to pin %zu blocks", failed);
+
+	if (! pinned) {
+		sigprocmask (SIG_SETMASK, &oldmask, NULL);
+		return 0;
+	}
+
+	act.sa_handler = sig_release;
+	sigemptyset (&act.sa_mask);
+	act.sa_flags = 0;
+
+	sigaction (SIGTERM, &act, NULL);
+	sigaction (SIGINT, &act, NULL);
+	sigaction (SIGUSR1, &act, NULL);
+
+	/* Returns as soon as one of them is delivered, including one that
+	 * was sent while they were blocked.
+	 */
+	sigsuspend (&oldmask);
+	sigprocmask (SIG_SETMASK, &oldmask, NULL);
+
+	nih_info ("Released pinned pages");
+
+	return 0;
+}
+
+/**
+ * tune_queue:
+ * @file: pack file to be read,
+ * @old: settings to restore afterwards.
+ *
+ * Raises the block queue settings of the device of @file to those kept in
+ * the pack, leaving alone any that are already at least as high, and
+ * fills in @old with what restore_queue() should put back.
+ **/
+static void
+tune_queue (PackFile * file,
+	    PackQueue *old)
+{
+	int read_ahead_kb;
+	int nr_requests;
+
+	nih_assert (file != NULL);
+	nih_assert (old != NULL);
+
+	memset (old, 0, sizeof (PackQueue));
+
+	/* Note the settings to put back before changing the scheduler,
+	 * since doing so resets nr_requests; then change the scheduler
+	 * first so that it doesn't undo what we raise.
+	 */
+	read_ahead_kb = get_queue_value (file->dev, "read_ahead_kb");
+	nr_requests = get_queue_value (file->dev, "nr_requests");
+
+	if (file->queue.scheduler[0]) {
+		nih_local char *path = NULL;
+		char            buf[256];
+		char *          ptr;
+		char *          end;
+
+		/* The current scheduler is the one in brackets */
+		path = queue_value_path (NULL, file->dev, "scheduler");
+		if (get_string (AT_FDCWD, path, buf, sizeof buf) < 0) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_debug ("%s: %s", path, err->message);
+			nih_free (err);
+		} else if ((ptr = strchr (buf, '['))
+			   && (end = strchr (++ptr, ']'))
+			   && ((size_t)(end - ptr) <= PACK_SCHEDULER_MAX)) {
+			*end = '\0';
+
+			if (! strcmp (ptr, file->queue.scheduler)) {
+				/* Already in use */
+			} else if (set_string (AT_FDCWD, path,
+					       file->queue.scheduler) < 0) {
+				NihError *err;
+
+				err = nih_error_get ();
+				nih_debug ("%s: %s", path, err->message);
+				nih_free (err);
+			} else {
+				strcpy (old->scheduler, ptr);
+			}
+		}
+	}
+
+	if (raise_queue_value (file->dev, "read_ahead_kb",
+			       file->queue.read_ahead_kb))
+		old->read_ahead_kb = read_ahead_kb;
+
+	/* Once the scheduler is changed, nr_requests needs putting back
+	 * whether or not we raised it.
+	 */
+	if (raise_queue_value (file->dev, "nr_requests",
+			       file->queue.nr_requests)
+	    || old->scheduler[0])
+		old->nr_requests = nr_requests;
+}
+
+/**
+ * get_queue_value:
+ * @dev: block device,
+ * @name: name of queue attribute.
+ *
+ * Returns: current value of the queue attribute @name of @dev, or zero
+ * if it couldn't be read.
+ **/
+static int
+get_queue_value (dev_t       dev,
+		 const char *name)
+{
+	nih_local char *path = NULL;
+	int             value;
+
+	nih_assert (name != NULL);
+
+	path = queue_value_path (NULL, dev, name);
+	if (get_value (AT_FDCWD, path, &value) < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_debug ("%s: %s", path, err->message);
+		nih_free (err);
+
+		return 0;
+	}
+
+	return value;
+}
+
+/**
+ * raise_queue_value:
+ * @dev: block device,
+ * @name: name of queue attribute,
+ * @value: new value.
+ *
+ * Sets the queue attribute @name of @dev to @value if it's currently
+ * lower; the device may refuse, that's not worth more than a note in
+ * the log.
+ *
+ * Returns: previous value if it was changed, zero otherwise.
+ **/
+static int
+raise_queue_value (dev_t       dev,
+		   const char *name,
+		   int         value)
+{
+	nih_local char *path = NULL;
+	int             old;
+
+	nih_assert (name != NULL);
+
+	if (! value)
+		return 0;
+
+	path = queue_value_path (NULL, dev, name);
+	if (get_value (AT_FDCWD, path, &old) < 0)
+		goto error;
+
+	if (old >= value)
+		return 0;
+
+	if (set_value (AT_FDCWD, path, value, NULL) < 0)
+		goto error;
+
+	nih_debug ("%s: %d (was %d)", path, value, old);
+
+	return old;
+error:
+	{
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_debug ("%s: %s", path, err->message);
+		nih_free (err);
+	}
+
+	return 0;
+}
+
+/**
+ * restore_queue:
+ * @file: pack file that was read,
+ * @old: settings from tune_queue().
+ *
+ * Puts back the block queue settings changed by tune_queue(), the
+ * scheduler first since putting it back resets nr_requests again.
+ **/
+static void
+restore_queue (PackFile * file,
+	       PackQueue *old)
+{
+	nih_assert (file != NULL);
+	nih_assert (old != NULL);
+
+	if (old->scheduler[0]) {
+		nih_local char *path = NULL;
+
+		path = queue_value_path (NULL, file->dev, "scheduler");
+		if (set_string (AT_FDCWD, path, old->scheduler) < 0) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_warn ("%s: %s", path, err->message);
+			nih_free (err);
+		}
+	}
+
+	if (old->read_ahead_kb) {
+		nih_local char *path = NULL;
+
+		path = queue_value_path (NULL, file->dev, "read_ahead_kb");
+		if (set_value (AT_FDCWD, path, old->read_ahead_kb, NULL) < 0) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_warn ("%s: %s", path, err->message);
+			nih_free (err);
+		}
+	}
+
+	if (old->nr_requests) {
+		nih_local char *path = NULL;
+
+		path = queue_value_path (NULL, file->dev, "nr_requests");
+		if (set_value (AT_FDCWD, path, old->nr_requests, NULL) < 0) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_warn ("%s: %s", path, err->message);
+			nih_free (err);
+		}
+	}
+}
+
+struct sweep_ctx {
+	PackFile *       file;
+	int *            fds;
+	int *            got;
+	size_t           idx;
+	int              threads;
+	int              critical;
+	int              ioprio;
+	int              warm;
+	struct timespec *warmed;
+	size_t *         failed;
+};
+
+static int
+do_readahead_hdd (PackFile *              file,
+		  int                     daemonise,
+		  const ReadaheadOptions *options)
+{
+	struct timespec             start;
+	struct timespec             warm_start;
+	const MetaPlugin *          plugin;
+	int                         device_read;
+	nih_local int *             fds = NULL;
+	nih_local int *             got = NULL;
+	nih_local struct timespec * warmed = NULL;
+	struct sweep_ctx            sweep;
+	nih_local int *             selected = NULL;
+	int                         seek_us;
+	off_t                       preloaded;
+	size_t                      misses = 0;
+	size_t                      failed = 0;
+	struct timespec             opened;
+	long                        open_us;
+
+	nih_assert (file != NULL);
+	nih_assert (options != NULL);
+
+	/* Adjust our CPU and I/O priority, we want to stay in the
+	 * foreground and hog all bandwidth to avoid jumping around the
+	 * disk.
+	 */
+	if (setpriority (PRIO_PROCESS, getpid (), -20))
+		nih_warn ("%s: %s", _("Failed to set CPU priority"),
+			  strerror (errno));
+
+	if (syscall (__NR_ioprio_set, IOPRIO_WHO_PROCESS, getpid (),
+		     IOPRIO_RT_HIGHEST) < 0)
+		nih_warn ("%s: %s", _("Failed to set I/O priority"),
+			  strerror (errno));
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+
+	/* Weigh up which inode groups are worth preloading, using the cost
+	 * of opening a file from a group that isn't as measured on previous
+	 * boots.
+	 */
+	seek_us = hdd_seek_cost (options->stats_file);
+
+	selected = NIH_MUST (nih_alloc (NULL, sizeof (int) * file->num_groups));
+	preloaded = select_groups (file, seek_us, HDD_TRANSFER_KBS, selected);
+
+	/* Read the inode tables of those groups, and the directory and
+	 * mapping blocks recorded in the pack, straight from the block
+	 * device, where the filesystem will find them when opening files;
+	 * then let the filesystem's plugin warm anything else it can, or
+	 * load the inodes itself if the device couldn't be read.
+	 */
+	device_read = (preload_extents (file, selected) == 0);
+
+	plugin = meta_plugin (file->fs_type);
+	if (plugin && plugin->preload)
+		plugin->preload (file, selected, device_read);
+
+	print_time ("Preload metadata", &start);
+
+	/* Open all of the files, counting those whose inodes weren't
+	 * preloaded.
+	 */
+	fds = NIH_MUST (nih_alloc (NULL, sizeof (int) * file->num_paths));
+	for (size_t i = 0; i < file->num_paths; i++) {
+		PackGroup *group;
+
+		group = bsearch (&file->paths[i].group, file->groups,
+				 file->num_groups, sizeof (PackGroup),
+				 group_compar);
+		if (group && (! selected[group - file->groups]))
+			misses++;
+
+		fds[i] = open (file->paths[i].path, O_RDONLY | O_NOATIME);
+		if (fds[i] < 0) {
+			nih_warn ("%s: %s", file->paths[i].path,
+				  strerror (errno));
+			continue;
+		}
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &opened);
+	open_us = ((opened.tv_sec - start.tv_sec) * 1000000
+		   + (opened.tv_nsec - start.tv_nsec) / 1000);
+
+	hdd_write_stats (options->stats_file, seek_us, open_us, misses,
+			 preloaded);
+
+	print_time ("Open files", &start);
+
+	/* Read in all of the blocks in a single pass for rotational
+	 * disks, otherwise we'll have a seek time penalty.  For SSD,
+	 * use a few threads to read in really fast.
+	 */
+	got = NIH_MUST (nih_alloc (NULL, sizeof (int) * file->num_paths));
+	memset (got, 0, sizeof (int) * file->num_paths);
+
+	sweep.file = file;
+	sweep.fds = fds;
+	sweep.got = got;
+	sweep.idx = 0;
+	sweep.threads = 1;
+	sweep.critical = -1;
+	sweep.ioprio = 0;
+	sweep.warm = options->warm;
+	sweep.warmed = NULL;
+	sweep.failed = &failed;
+
+	if (options->warm || (options->queue_depth > 1)) {
+		warmed = NIH_MUST (nih_alloc (NULL, (sizeof (struct timespec)
+						     * file->num_paths)));
+		memset (warmed, 0, sizeof (struct timespec) * file->num_paths);
+		sweep.warmed = warmed;
+	}
+
+	/* Keeping a few synchronous reads of neighbouring blocks in flight
+	 * lets the drive reorder them, while the sweep as a whole still
+	 * moves in one direction across the disk.
+	 */
+	if (options->queue_depth > 1) {
+		sweep.threads = nih_min (options->queue_depth, HDD_QUEUE_DEPTH_MAX);
+		sweep.warm = TRUE;
+
+		nih_info ("Reading with queue depth %d", sweep.threads);
+	}
+
+	warm_start = start;
+
+	if (pack_critical (file)) {
+		struct sweep_ctx deferred;
+		pthread_t        thread;
+
+		/* Sweep the deferred blocks at the same time, but from an
+		 * idle class thread, so that they only get the disk when
+		 * the critical sweep doesn't want it.
+		 */
+		deferred = sweep;
+		deferred.critical = FALSE;
+		deferred.ioprio = IOPRIO_IDLE_LOWEST;
+		pthread_create (&thread, NULL, hdd_sweep, &deferred);
+
+		sweep.critical = TRUE;
+		hdd_sweep (&sweep);
+
+		print_time (sweep.warm ? "Warm critical" : "Readahead critical",
+			    &start);
+
+		pthread_join (thread, NULL);
+
+		print_time (sweep.warm ? "Warm deferred" : "Readahead deferred",
+			    &start);
+	} else {
+		hdd_sweep (&sweep);
+
+		print_time (sweep.warm ? "Warm" : "Readahead", &start);
+	}
+
+	if (warmed)
+		print_warm_times (file, &warm_start, warmed);
+
+	for (size_t i = 0; i < file->num_paths; i++)
+		if (fds[i] >= 0)
+			close (fds[i]);
+
+	return readahead_failed (failed);
+}
+
+static void *
+hdd_sweep (void *ptr)
+{
+	struct sweep_ctx *ctx = ptr;
+	pthread_t         thread[HDD_QUEUE_DEPTH_MAX];
+
+	for (int t = 1; t < ctx->threads; t++)
+		pthread_create (&thread[t], NULL, hdd_thread, ctx);
+
+	hdd_thread (ctx);
+
+	for (int t = 1; t < ctx->threads; t++)
+		pthread_join (thread[t], NULL);
+
+	return NULL;
+}
+
+static void *
+hdd_thread (void *ptr)
+{
+	static pthread_mutex_t warmed_lock = PTHREAD_MUTEX_INITIALIZER;
+	struct sweep_ctx *     ctx = ptr;
+
+	if (ctx->ioprio)
+		set_thread_ioprio (ctx->ioprio);
+
+	for (;;) {
+		size_t          i;
+		size_t          pathidx;
+		int             ret;
+		struct timespec now;
+
+		/* Blocks are taken strictly in order, so those in flight
+		 * are always neighbours on disk.
+		 */
+		i = __sync_fetch_and_add (&ctx->idx, 1);
+		if (i >= ctx->file->num_blocks)
+			break;
+
+		pathidx = ctx->file->blocks[i].pathidx;
+		if ((pathidx >= ctx->file->num_paths)
+		    || (ctx->fds[pathidx] < 0))
+			continue;
+
+		if ((ctx->critical >= 0)
+		    && (ctx->critical
+			!= !! (ctx->file->paths[pathidx].flags & PACK_PATH_CRITICAL)))
+			continue;
+
+		/* A file read through in full is read whole when the sweep
+		 * reaches its first block, and its other blocks skipped.
+		 */
+		if (ctx->file->paths[pathidx].flags & PACK_PATH_SEQUENTIAL) {
+			if (! __sync_bool_compare_and_swap (&ctx->got[pathidx],
+							    0, 1))
+				continue;
+
+			ret = read_whole (ctx->fds[pathidx], ctx->warm);
+		} else {
+			ret = read_block (ctx->fds[pathidx],
+					  &ctx->file->blocks[i], ctx->warm);
+		}
+
+		/* Only a warm read knows the pages made it into memory */
+		if ((ret < 0) && ctx->warm)
+			__sync_fetch_and_add (ctx->failed, 1);
+
+		if (! ctx->warm)
+			continue;
+
+		/* Other threads may be finishing blocks of the same file */
+		clock_gettime (CLOCK_MONOTONIC, &now);
+
+		pthread_mutex_lock (&warmed_lock);
+		if ((now.tv_sec > ctx->warmed[pathidx].tv_sec)
+		    || ((now.tv_sec == ctx->warmed[pathidx].tv_sec)
+			&& (now.tv_nsec > ctx->warmed[pathidx].tv_nsec)))
+			ctx->warmed[pathidx] = now;
+		pthread_mutex_unlock (&warmed_lock);
+	}
+
+	return NULL;
+}
+
+
+/**
+ * hdd_seek_cost:
+ * @stats_file: file the cost was kept in, or NULL.
+ *
+ * Returns: cost in microseconds of opening a file whose inode wasn't
+ * preloaded, as measured on previous boots, or HDD_SEEK_US.
+ **/
+static int
+hdd_seek_cost (const char *stats_file)
+{
+	FILE *fp;
+	char *line;
+	int   seek_us = HDD_SEEK_US;
+
+	if (! stats_file)
+		return seek_us;
+
+	fp = fopen (stats_file, "r");
+	if (! fp)
+		return seek_us;
+
+	while ((line = fgets_alloc (NULL, fp)) != NULL) {
+		int value;
+
+		if ((sscanf (line, "seek_us %d", &value) == 1) && (value > 0))
+			seek_us = value;
+
+		nih_free (line);
+	}
+
+	fclose (fp);
+
+	return seek_us;
+}
+
+/**
+ * hdd_write_stats:
+ * @stats_file: file to keep the cost in, or NULL,
+ * @seek_us: cost the groups were selected with,
+ * @open_us: time taken to open all of the files,
+ * @misses: number of files whose inodes weren't preloaded,
+ * @preloaded: bytes of inode tables preloaded.
+ *
+ * Records how long the open pass took, and refines the cost of opening
+ * a file whose inode wasn't preloaded from it for the next boot: the time
+ * beyond that needed to transfer the preloaded inode tables is put down
+ * to those files.
+ **/
+static void
+hdd_write_stats (const char *stats_file,
+		 int         seek_us,
+		 long        open_us,
+		 size_t      misses,
+		 off_t       preloaded)
+{
+	long  transfer_us;
+	FILE *fp;
+
+	nih_info ("Opened files in %ld.%03lds, %zu without preloaded inodes",
+		  open_us / 1000000, (open_us / 1000) % 1000, misses);
+
+	if (! stats_file)
+		return;
+
+	/* Time the preloaded groups took to transfer, in microseconds as
+	 * in select_groups(), is taken off what opening the files took.
+	 */
+	transfer_us = (long)(preloaded / 1024 * 1000000 / HDD_TRANSFER_KBS);
+	if ((misses >= HDD_SEEK_SAMPLES_MIN) && (open_us > transfer_us)) {
+		long measured = (open_us - transfer_us) / misses;
+
+		seek_us = (int)((seek_us * 3L + measured) / 4);
+		seek_us = nih_max (seek_us, 100);
+		seek_us = nih_min (seek_us, 100000);
+	}
+
+	fp = fopen (stats_file, "w");
+	if (! fp) {
+		nih_warn ("%s: %s", stats_file, strerror (errno));
+		return;
+	}
+
+	fprintf (fp, "seek_us %d\n", seek_us);
+	fprintf (fp, "open_us %ld\n", open_us);
+	fprintf (fp, "misses %zu\n", misses);
+	fprintf (fp, "preloaded_kb %zu\n", (size_t)preloaded / 1024);
+
+	if (fclose (fp) < 0)
+		nih_warn ("%s: %s", stats_file, strerror (errno));
+}
+
+/**
+ * select_groups:
+ * @file: pack file,
+ * @seek_us: cost of opening a file whose inode wasn't preloaded,
+ * @transfer_kbs: rate at which inode tables can be read,
+ * @selected: array to mark the selected groups in.
+ *
+ * Preloading a group's inode table costs a seek to it and the time to
+ * transfer it, while not preloading it costs a seek for each of the
+ * files opened from it; groups are selected when the former is lower.
+ *
+ * Returns: bytes of inode tables selected.
+ **/
+static off_t
+select_groups (PackFile *file,
+	       int       seek_us,
+	       int       transfer_kbs,
+	       int *     selected)
+{
+	off_t  bytes = 0;
+	size_t num_selected = 0;
+
+	nih_assert (file != NULL);
+	nih_assert (selected != NULL);
+
+	for (size_t i = 0; i < file->num_groups; i++) {
+		PackGroup *group = &file->groups[i];
+		long       preload_us;
+		long       miss_us;
+
+		/* Worked out in microseconds throughout; a group's inode
+		 * table takes well under a millisecond to transfer, and
+		 * rounding that down to whole milliseconds would make it free.
+		 */
+		preload_us = (seek_us
+			      + (long)(group->length / 1024 * 1000000
+				       / transfer_kbs));
+		miss_us = (long)group->hits * seek_us;
+
+		selected[i] = (miss_us > preload_us);
+		if (selected[i]) {
+			bytes += group->length;
+			num_selected++;
+		}
+	}
+
+	nih_info ("Preloading %zu of %zu inode groups (%zu kB)",
+		  num_selected, file->num_groups, (size_t)bytes / 1024);
+
+	return bytes;
+}
+
+static int
+group_compar (const void *key,
+	      const void *member)
+{
+	const int *      group_key = key;
+	const PackGroup *group = member;
+
+	nih_assert (group_key != NULL);
+	nih_assert (group != NULL);
+
+	if (*group_key < group->group) {
+		return -1;
+	} else if (*group_key > group->group) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+static int
+extent_compar (const void *a,
+	       const void *b)
+{
+	const PackExtent *extent_a = a;
+	const PackExtent *extent_b = b;
+
+	nih_assert (extent_a != NULL);
+	nih_assert (extent_b != NULL);
+
+	if (extent_a->physical < extent_b->physical) {
+		return -1;
+	} else if (extent_a->physical > extent_b->physical) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+/**
+ * merge_extents:
+ * @file: pack file,
+ * @selected: groups to include the inode tables of,
+ * @chunk: length to split extents into, or zero,
+ * @extents: set to newly allocated array of extents.
+ *
+ * Gathers the inode tables of the @selected groups and the metadata
+ * extents of @file, in order and merged where they touch.  With flex_bg
+ * the tables of neighbouring groups are contiguous, and become one.
+ *
+ * Returns: number of extents in @extents.
+ **/
+static size_t
+merge_extents (PackFile *   file,
+	       const int *  selected,
+	       off_t        chunk,
+	       PackExtent **extents)
+{
+	size_t num_extents = 0;
+	size_t num_merged = 1;
+	size_t num_chunks = 0;
+
+	nih_assert (file != NULL);
+	nih_assert (selected != NULL);
+	nih_assert (extents != NULL);
+
+	*extents = NIH_MUST (nih_alloc (NULL, (sizeof (PackExtent)
+					       * (file->num_groups
+						  + file->num_extents + 1))));
+
+	for (size_t i = 0; i < file->num_groups; i++) {
+		if ((! selected[i]) || (! file->groups[i].physical))
+			continue;
+
+		(*extents)[num_extents].physical = file->groups[i].physical;
+		(*extents)[num_extents].length = file->groups[i].length;
+		num_extents++;
+	}
+
+	for (size_t i = 0; i < file->num_extents; i++)
+		(*extents)[num_extents++] = file->extents[i];
+
+	if (! num_extents)
+		return 0;
+
+	qsort (*extents, num_extents, sizeof (PackExtent), extent_compar);
+
+	for (size_t i = 1; i < num_extents; i++) {
+		PackExtent *last = &(*extents)[num_merged - 1];
+
+		if ((*extents)[i].physical <= last->physical + last->length) {
+			last->length = nih_max (last->length,
+						((*extents)[i].physical
+						 + (*extents)[i].length
+						 - last->physical));
+		} else {
+			(*extents)[num_merged++] = (*extents)[i];
+		}
+	}
+
+	if (! chunk)
+		return num_merged;
+
+	/* Split into pieces of no more than @chunk */
+	for (size_t i = 0; i < num_merged; i++)
+		num_chunks += ((*extents)[i].length + chunk - 1) / chunk;
+
+	if (num_chunks > num_merged) {
+		PackExtent *chunks;
+		size_t      n = 0;
+
+		chunks = NIH_MUST (nih_alloc (NULL, sizeof (PackExtent) * num_chunks));
+
+		for (size_t i = 0; i < num_merged; i++) {
+			for (off_t offset = 0; offset < (*extents)[i].length;
+			     offset += chunk) {
+				chunks[n].physical = (*extents)[i].physical + offset;
+				chunks[n].length = nih_min (chunk, ((*extents)[i].length
+								    - offset));
+				n++;
+			}
+		}
+
+		nih_free (*extents);
+		*extents = chunks;
+	}
+
+	return num_chunks;
+}
+
+/**
+ * open_device:
+ * @file: pack file.
+ *
+ * The device node is looked up by blkid, since early in boot udev may not
+ * have created the /dev/block links yet, which are tried as well.  When
+ * the filesystem's plugin can load the metadata itself, failing to open
+ * the device isn't worth a warning.
+ *
+ * Returns: open block device of @file, or negative value.
+ **/
+static int
+open_device (PackFile *file)
+{
+	char *            blkid_name;
+	char              devname[64];
+	int               fd;
+	const MetaPlugin *plugin;
+
+	nih_assert (file != NULL);
+
+	blkid_name = blkid_devno_to_devname (file->dev);
+	if (blkid_name) {
+		fd = open (blkid_name, O_RDONLY | O_NOATIME);
+		if (fd < 0)
+			nih_debug ("%s: %s", blkid_name, strerror (errno));
+
+		free (blkid_name);
+		if (fd >= 0)
+			return fd;
+	}
+
+	sprintf (devname, "/dev/block/%d:%d",
+		 major (file->dev), minor (file->dev));
+
+	fd = open (devname, O_RDONLY | O_NOATIME);
+	if (fd < 0) {
+		plugin = meta_plugin (file->fs_type);
+		if (plugin && plugin->preload) {
+			nih_debug ("%s: %s", devname, strerror (errno));
+		} else {
+			nih_warn ("%s: %s", devname, strerror (errno));
+		}
+	}
+
+	return fd;
+}
+
+/**
+ * preload_extents:
+ * @file: pack file,
+ * @selected: groups to preload the inode tables of.
+ *
+ * Reads the inode tables of the @selected groups, and the metadata
+ * extents, of @file from the block device in a single sweep, without
+ * parsing the filesystem at all.
+ *
+ * Returns: zero on success, negative value if @file has nothing to read
+ * or the device couldn't be opened.
+ **/
+static int
+preload_extents (PackFile * file,
+		 const int *selected)
+{
+	nih_local PackExtent *extents = NULL;
+	size_t                num_extents;
+	int                   fd;
+
+	nih_assert (file != NULL);
+	nih_assert (selected != NULL);
+
+	num_extents = merge_extents (file, selected, 0, &extents);
+	if (! num_extents)
+		return -1;
+
+	fd = open_device (file);
+	if (fd < 0)
+		return -1;
+
+	for (size_t i = 0; i < num_extents; i++)
+		load_pages_in_core (fd, extents[i].physical,
+				    extents[i].length);
+
+	close (fd);
+
+	return 0;
+}
+
+
+struct meta_ctx {
+	int         fd;
+	PackExtent *extents;
+	size_t      num_extents;
+	size_t      idx;
+	int         ioprio;
+};
+
+/**
+ * warm_metadata:
+ * @file: pack file,
+ * @ioprio: I/O priority to read at, or zero.
+ *
+ * Reads the inode tables worth preloading, and the metadata extents, of
+ * @file from the block device using several threads at once, since
+ * solid-state disks do best with many reads in flight; then lets the
+ * filesystem's plugin warm anything else it can.
+ *
+ * Returns: zero on success, negative value if the device wasn't read.
+ **/
+static int
+warm_metadata (PackFile *file,
+	       int       ioprio)
+{
+	nih_local int *       selected = NULL;
+	nih_local PackExtent *extents = NULL;
+	const MetaPlugin *    plugin;
+	struct meta_ctx       ctx;
+	pthread_t             thread[NUM_THREADS];
+	int                   device_read = FALSE;
+
+	nih_assert (file != NULL);
+
+	selected = NIH_MUST (nih_alloc (NULL, (sizeof (int)
+					       * (file->num_groups + 1))));
+	select_groups (file, SSD_READ_US, SSD_TRANSFER_KBS, selected);
+
+	ctx.num_extents = merge_extents (file, selected, META_CHUNK_LENGTH,
+					 &extents);
+	ctx.extents = extents;
+	ctx.idx = 0;
+	ctx.ioprio = ioprio;
+	ctx.fd = ctx.num_extents ? open_device (file) : -1;
+
+	if (ctx.fd >= 0) {
+		for (int t = 0; t < NUM_THREADS; t++)
+			pthread_create (&thread[t], NULL, meta_thread, &ctx);
+		for (int t = 0; t < NUM_THREADS; t++)
+			pthread_join (thread[t], NULL);
+
+		close (ctx.fd);
+		device_read = TRUE;
+	}
+
+	plugin = meta_plugin (file->fs_type);
+	if (plugin && plugin->preload)
+		plugin->preload (file, selected, device_read);
+
+	return device_read ? 0 : -1;
+}
+
+static void *
+meta_thread (void *ptr)
+{
+	struct meta_ctx *ctx = ptr;
+
+	if (ctx->ioprio)
+		set_thread_ioprio (ctx->ioprio);
+
+	for (;;) {
+		size_t i;
+
+		i = __sync_fetch_and_add (&ctx->idx, 1);
+		if (i >= ctx->num_extents)
+			break;
+
+		load_pages_in_core (ctx->fd, ctx->extents[i].physical,
+				    ctx->extents[i].length);
+	}
+
+	return NULL;
+}
+
+
+struct thread_ctx {
+	PackFile *       file;
+	size_t           idx;
+	int *            got;
+	int              critical;
+	int              ioprio;
+	int              warm;
+	struct timespec *warmed;
+	size_t *         failed;
+};
+
+static int
+do_readahead_ssd (PackFile *              file,
+		  int                     daemonise,
+		  const ReadaheadOptions *options)
+{
+	struct timespec   start;
+	struct timespec   warm_start;
+	pthread_t         thread[NUM_THREADS * 2];
+	struct thread_ctx ctx[2];
+	int               num_ctx;
+	nih_local int *   got = NULL;
+	nih_local struct timespec *warmed = NULL;
+	size_t            failed = 0;
+
+	nih_assert (file != NULL);
+	nih_assert (options != NULL);
+
+	/* Can only --daemon for SSD */
+	if (daemonise) {
+		pid_t pid;
+
+		pid = fork ();
+		if (pid < 0) {
+			nih_return_system_error (-1);
+		} else if (pid > 0) {
+			_exit (0);
+		}
+	}
+
+	if (syscall (__NR_ioprio_set, IOPRIO_WHO_PROCESS, getpid (),
+		     IOPRIO_IDLE_LOWEST) < 0)
+		nih_warn ("%s: %s", _("Failed to set I/O priority"),
+			  strerror (errno));
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+
+	got = NIH_MUST (nih_alloc (NULL, sizeof (int) * file->num_paths));
+	memset (got, 0, sizeof (int) * file->num_paths);
+
+	if (options->warm) {
+		warmed = NIH_MUST (nih_alloc (NULL, (sizeof (struct timespec)
+						     * file->num_paths)));
+		memset (warmed, 0, sizeof (struct timespec) * file->num_paths);
+	}
+
+	for (int c = 0; c < 2; c++) {
+		ctx[c].file = file;
+		ctx[c].idx = 0;
+		ctx[c].got = got;
+		ctx[c].critical = -1;
+		ctx[c].ioprio = 0;
+		ctx[c].warm = options->warm;
+		ctx[c].warmed = warmed;
+		ctx[c].failed = &failed;
+	}
+
+	/* When the pack marks the files needed early, those get their own
+	 * threads at the highest best-effort priority so they aren't held
+	 * up behind everything else at idle priority.
+	 */
+	if (pack_critical (file)) {
+		ctx[0].critical = TRUE;
+		ctx[0].ioprio = IOPRIO_BE_HIGHEST;
+		ctx[1].critical = FALSE;
+		num_ctx = 2;
+	} else {
+		num_ctx = 1;
+	}
+
+	/* Everything needs the metadata to open its files, so queue the
+	 * reads of it first, at the priority of the earliest files.
+	 */
+	warm_metadata (file, ctx[0].ioprio);
+
+	print_time ("Warm metadata", &start);
+
+	warm_start = start;
+
+	for (int t = 0; t < NUM_THREADS * num_ctx; t++)
+		pthread_create (&thread[t], NULL, ra_thread, &ctx[t / NUM_THREADS]);
+	for (int t = 0; t < NUM_THREADS * num_ctx; t++) {
+		pthread_join (thread[t], NULL);
+
+		if ((num_ctx > 1) && (t == NUM_THREADS - 1))
+			print_time (options->warm ? "Warm critical"
+				    : "Readahead critical", &start);
+	}
+
+	if (num_ctx > 1) {
+		print_time (options->warm ? "Warm deferred" : "Readahead deferred",
+			    &start);
+	} else {
+		print_time (options->warm ? "Warm" : "Readahead", &start);
+	}
+
+	if (options->warm)
+		print_warm_times (file, &warm_start, warmed);
+
+	return readahead_failed (failed);
+}
+
+static void *
+ra_thread (void *ptr)
+{
+	struct thread_ctx *ctx = ptr;
+
+	if (ctx->ioprio)
+		set_thread_ioprio (ctx->ioprio);
+
+	for (;;) {
+		size_t i;
+		size_t pathidx;
+		int    fd;
+
+		i = __sync_fetch_and_add (&ctx->idx, 1);
+		if (i >= ctx->file->num_blocks)
+			break;
+
+		pathidx = ctx->file->blocks[i].pathidx;
+		if (pathidx > ctx->file->num_paths)
+			continue;
+
+		if ((ctx->critical >= 0)
+		    && (ctx->critical
+			!= !! (ctx->file->paths[pathidx].flags & PACK_PATH_CRITICAL)))
+			continue;
+
+		if (! __sync_bool_compare_and_swap (&ctx->got[pathidx], 0, 1))
 			continue;
 
 		fd = open (ctx->file->paths[pathidx].path,
@@ -884,13 +2434,140 @@ ra_thread (void *ptr)
 			continue;
 		}
 
-		do {
-			load_pages_in_core (fd,
-					    ctx->file->blocks[i].offset,
-					    ctx->file->blocks[i].length);
-		} while ((++i < ctx->file->num_blocks)
-			 && (ctx->file->blocks[i].pathidx == pathidx));
+		/* Only a warm read knows the pages made it into memory */
+		if (ctx->file->paths[pathidx].flags & PACK_PATH_SEQUENTIAL) {
+			if ((read_whole (fd, ctx->warm) < 0) && ctx->warm)
+				__sync_fetch_and_add (ctx->failed, 1);
+		} else {
+			do {
+				if ((read_block (fd, &ctx->file->blocks[i],
+						 ctx->warm) < 0)
+				    && ctx->warm)
+					__sync_fetch_and_add (ctx->failed, 1);
+			} while ((++i < ctx->file->num_blocks)
+				 && (ctx->file->blocks[i].pathidx == pathidx));
+		}
+
+		if (ctx->warm)
+			clock_gettime (CLOCK_MONOTONIC, &ctx->warmed[pathidx]);
+
+		close (fd);
 	}
 
 	return NULL;
 }
+
+
+/**
+ * readahead_failed:
+ * @failed: number of blocks or files that couldn't be read.
+ *
+ * The threads can't raise errors themselves, so they only count what they
+ * couldn't read; anything waiting for the ready file mustn't be told that
+ * everything is in memory when it isn't.
+ *
+ * Returns: zero if @failed is zero, otherwise negative value on raised
+ * error.
+ **/
+static int
+readahead_failed (size_t failed)
+{
+	if (! failed)
+		return 0;
+
+	nih_info ("Failed to read %zu blocks", failed);
+
+	nih_error_raise (PACK_NOT_READ, _(PACK_NOT_READ_STR));
+	return -1;
+}
+
+/**
+ * pack_critical:
+ * @file: pack file.
+ *
+ * Returns: TRUE if any path in @file is marked as critical, in which case
+ * the critical and deferred paths are read at different priorities.
+ **/
+static int
+pack_critical (PackFile *file)
+{
+	nih_assert (file != NULL);
+
+	for (size_t i = 0; i < file->num_paths; i++)
+		if (file->paths[i].flags & PACK_PATH_CRITICAL)
+			return TRUE;
+
+	return FALSE;
+}
+
+/**
+ * set_thread_ioprio:
+ * @ioprio: I/O priority.
+ *
+ * Sets the I/O priority of the calling thread alone, the kernel treats
+ * the thread id passed with IOPRIO_WHO_PROCESS as a single task.
+ **/
+static void
+set_thread_ioprio (int ioprio)
+{
+	if (syscall (__NR_ioprio_set, IOPRIO_WHO_PROCESS,
+		     (pid_t)syscall (__NR_gettid), ioprio) < 0)
+		nih_warn ("%s: %s", _("Failed to set I/O priority"),
+			  strerror (errno));
+}
+
+/**
+ * read_block:
+ * @fd: open file,
+ * @block: block of the file to read,
+ * @warm: TRUE to wait until the block is in the page cache.
+ *
+ * Reads @block of the file open as @fd; files read through in full are
+ * read with read_whole() instead.
+ *
+ * Returns: zero on success, negative value on error.
+ **/
+static int
+read_block (int              fd,
+	    const PackBlock *block,
+	    int              warm)
+{
+	nih_assert (fd >= 0);
+	nih_assert (block != NULL);
+
+	if (warm)
+		return warm_pages_in_core (fd, block->offset, block->length);
+
+	return load_pages_in_core (fd, block->offset, block->length);
+}
+
+/**
+ * read_whole:
+ * @fd: open file,
+ * @warm: TRUE to wait until the file is in the page cache.
+ *
+ * Reads all of the file open as @fd, for those read through more or less
+ * in full while tracing; one long range costs less than the blocks that
+ * were recorded for it, and covers the pages the trace missed.
+ *
+ * Returns: zero on success, negative value on error.
+ **/
+static int
+read_whole (int fd,
+	    int warm)
+{
+	struct stat statbuf;
+
+	nih_assert (fd >= 0);
+
+	if (fstat (fd, &statbuf) < 0)
+		return -1;
+
+	if (! statbuf.st_size)
+		return 0;
+
+	if (warm)
+		return warm_pages_in_core (fd, 0, statbuf.st_size);
+
+	return load_pages_in_core (fd, 0, statbuf.st_size);
+}
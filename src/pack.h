@@ -39,8 +39,25 @@
 #define PACK_PATH_MAX 255
 
 
+/**
+ * PackPathFlags:
+ *
+ * PACK_PATH_CRITICAL marks paths opened early enough in the traced boot
+ * to be read at a high I/O priority, the rest are read at idle priority.
+ *
+ * PACK_PATH_SEQUENTIAL marks files that were read through more or less
+ * in full, and PACK_PATH_RANDOM large files of which only a few scattered
+ * pages were read; the former are read whole rather than block by block.
+ **/
+typedef enum pack_path_flags {
+	PACK_PATH_CRITICAL   = 0x01,
+	PACK_PATH_SEQUENTIAL = 0x02,
+	PACK_PATH_RANDOM     = 0x04,
+} PackPathFlags;
+
 typedef struct pack_path {
 	int   group;
+	int   flags;
 	ino_t ino;
 	char  path[PACK_PATH_MAX+1];
 } PackPath;
@@ -52,18 +69,100 @@ typedef struct pack_block {
 	off_t  physical;
 } PackBlock;
 
+/**
+ * PackGroup:
+ * @group: inode group number,
+ * @hits: number of files in the pack whose inodes are in the group,
+ * @physical: byte offset of the group's inode table on the device,
+ * @length: length of the group's inode table in bytes.
+ *
+ * Inode group that files in the pack were opened from, kept in order of
+ * @group; which of these are worth preloading before opening the files
+ * is decided when the pack is read.
+ **/
+typedef struct pack_group {
+	int   group;
+	int   hits;
+	off_t physical;
+	off_t length;
+} PackGroup;
+
+/**
+ * PackExtent:
+ * @physical: byte offset on the device,
+ * @length: length in bytes.
+ *
+ * Range of the device holding filesystem metadata, such as the inode
+ * tables of the groups most files were opened from, that's read from
+ * the block device itself.
+ **/
+typedef struct pack_extent {
+	off_t physical;
+	off_t length;
+} PackExtent;
+
+/**
+ * PACK_SCHEDULER_MAX:
+ *
+ * Longest I/O scheduler name we keep in the pack.
+ **/
+#define PACK_SCHEDULER_MAX 31
+
+/**
+ * PackQueue:
+ * @read_ahead_kb: value for queue/read_ahead_kb, or zero,
+ * @nr_requests: value for queue/nr_requests, or zero,
+ * @scheduler: value for queue/scheduler, or empty.
+ *
+ * Block queue settings of the device raised for as long as the pack is
+ * being read; zero or empty values are left alone.
+ **/
+typedef struct pack_queue {
+	int  read_ahead_kb;
+	int  nr_requests;
+	char scheduler[PACK_SCHEDULER_MAX+1];
+} PackQueue;
+
 typedef struct pack_file {
-	dev_t      dev;
-	int        rotational;
-	size_t     num_groups;
-	int *      groups;
-	size_t     num_paths;
-	PackPath * paths;
-	size_t     num_blocks;
-	PackBlock *blocks;
+	dev_t       dev;
+	int         rotational;
+	PackQueue   queue;
+	long        fs_type;
+	size_t      num_groups;
+	PackGroup * groups;
+	size_t      num_extents;
+	PackExtent *extents;
+	size_t      num_paths;
+	PackPath *  paths;
+	size_t      num_blocks;
+	PackBlock * blocks;
 } PackFile;
 
 
+/**
+ * ReadaheadOptions:
+ * @warm: wait for each range to be read into memory rather than only
+ * queueing it with readahead(),
+ * @ready_file: file to create once every range has been read,
+ * @queue_depth: number of reads to keep in flight on rotational disks,
+ * @pin_limit: megabytes of critical files to lock in memory afterwards,
+ * @stats_file: file in which the measured cost of opening files on
+ * rotational disks is kept between boots, or NULL,
+ * @keep_queue: TRUE to leave the block queue settings of the device as
+ * they are, rather than raising them to those kept in the pack.
+ *
+ * Options that alter how the pack is read.
+ **/
+typedef struct readahead_options {
+	int   warm;
+	char *ready_file;
+	int   queue_depth;
+	int   pin_limit;
+	char *stats_file;
+	int   keep_queue;
+} ReadaheadOptions;
+
+
 typedef enum sort_option {
 	SORT_OPEN,
 	SORT_PATH,
@@ -84,7 +183,10 @@ int       write_pack                (const char *filename, PackFile *file);
 
 void      pack_dump                 (PackFile *file, SortOption sort);
 
-int       do_readahead              (PackFile *file, int daemonise);
+int       do_readahead              (PackFile *file, int daemonise,
+				     const ReadaheadOptions *options);
+int       load_pages_in_core        (int fd, off_t offset, off_t length);
+int       warm_pages_in_core        (int fd, off_t offset, off_t length);
 
 NIH_END_EXTERN
 
@@ -0,0 +1,1318 @@
+/* ureadahead
+ *
+ * rawtrace.c - binary trace buffer reading
+ *
+ * Copyright © 2009 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "rawtrace.h"
+#include "file.h"
+
+
+/* From kernel/trace/ring_buffer.c */
+#define RINGBUF_TYPE_DATA_TYPE_LEN_MAX 28
+#define RINGBUF_TYPE_PADDING           29
+#define RINGBUF_TYPE_TIME_EXTEND       30
+#define RINGBUF_TYPE_TIME_STAMP        31
+
+#define TS_SHIFT 27
+
+#define RB_MISSED_FLAGS ((1UL << 31) | (1UL << 30))
+
+
+/**
+ * RawKind:
+ *
+ * RAW_OPEN events give a file that was opened, RAW_ENTER events a file
+ * that a system call is about to open and RAW_EXIT events the result of
+ * that system call; the file is only opened if that isn't negative.
+ * RAW_PAGE events give pages of a file added to the page cache.
+ **/
+typedef enum raw_kind {
+	RAW_OPEN,
+	RAW_ENTER,
+	RAW_EXIT,
+	RAW_PAGE,
+} RawKind;
+
+/**
+ * raw_events:
+ *
+ * Events we decode, with the filename field of RAW_OPEN and RAW_ENTER
+ * events, the ret field of RAW_EXIT events and the s_dev, i_ino, index
+ * and, where there is one, order fields of RAW_PAGE events.  The syscall events are
+ * those added by trace_add_probes() where the fs events aren't in the
+ * kernel.
+ **/
+static const struct {
+	const char *name;
+	RawKind     kind;
+} raw_events[] = {
+	{ "fs/do_sys_open",              RAW_OPEN  },
+	{ "fs/open_exec",                RAW_OPEN  },
+	{ "fs/uselib",                   RAW_OPEN  },
+	{ "ureadahead/openat",           RAW_ENTER },
+	{ "ureadahead/openat2",          RAW_ENTER },
+	{ "ureadahead/execve",           RAW_ENTER },
+	{ "ureadahead/execveat",         RAW_ENTER },
+	{ "ureadahead/io_openat",        RAW_OPEN  },
+	{ "syscalls/sys_exit_openat",    RAW_EXIT  },
+	{ "syscalls/sys_exit_openat2",   RAW_EXIT  },
+	{ "syscalls/sys_exit_execve",    RAW_EXIT  },
+	{ "syscalls/sys_exit_execveat",  RAW_EXIT  },
+	{ "filemap/mm_filemap_add_to_page_cache", RAW_PAGE },
+};
+
+/**
+ * RAW_NUM_EVENTS:
+ *
+ * Number of entries in raw_events.
+ **/
+#define RAW_NUM_EVENTS (sizeof raw_events / sizeof raw_events[0])
+
+
+/**
+ * RawField:
+ * @offset: offset of the field,
+ * @size: size of the field.
+ **/
+typedef struct raw_field {
+	ssize_t offset;
+	ssize_t size;
+} RawField;
+
+/**
+ * RawFormat:
+ * @id: event type, or -1 if the event isn't available,
+ * @kind: kind of event,
+ * @pid: common_pid field,
+ * @value: filename, ret or s_dev field,
+ * @ino: i_ino field,
+ * @index: index field,
+ * @order: order field, with a negative offset if there isn't one,
+ * @data_loc: TRUE if @value is a __data_loc reference to the string
+ * rather than the string itself.
+ *
+ * Layout of an event, from its format file.
+ **/
+typedef struct raw_format {
+	int      id;
+	RawKind  kind;
+	RawField pid;
+	RawField value;
+	RawField ino;
+	RawField index;
+	RawField order;
+	int      data_loc;
+} RawFormat;
+
+/**
+ * RawPage:
+ * @size: size of each page read,
+ * @timestamp: page timestamp field,
+ * @commit: page commit field, giving the length of data,
+ * @data: page data field.
+ *
+ * Layout of the pages of the ring buffer, from header_page.
+ **/
+typedef struct raw_page {
+	size_t   size;
+	RawField timestamp;
+	RawField commit;
+	RawField data;
+} RawPage;
+
+/**
+ * RawRecord:
+ * @event: event, with a NULL path for RAW_EXIT events,
+ * @kind: kind of event,
+ * @ret: result of RAW_EXIT events.
+ *
+ * Event as read from a buffer, before the system calls are paired up.
+ **/
+typedef struct raw_record {
+	RawEvent event;
+	RawKind  kind;
+	long     ret;
+} RawRecord;
+
+/**
+ * RawCpu:
+ * @fd: trace_pipe_raw of the CPU,
+ * @page: page layout,
+ * @formats: event layouts,
+ * @records: events read,
+ * @num_records: number of entries in @records,
+ * @max_records: number of entries allocated in @records,
+ * @faults: pages read,
+ * @num_faults: number of entries in @faults,
+ * @max_faults: number of entries allocated in @faults,
+ * @cpu_ns: CPU time spent reading the buffer.
+ *
+ * State of the thread reading each CPU's buffer.
+ **/
+typedef struct raw_cpu {
+	int                fd;
+	const RawPage *    page;
+	const RawFormat *  formats;
+	RawRecord *        records;
+	size_t             num_records;
+	size_t             max_records;
+	RawFault *         faults;
+	size_t             num_faults;
+	size_t             max_faults;
+	unsigned long long cpu_ns;
+} RawCpu;
+
+/**
+ * RawTrace:
+ * @dfd: tracing directory,
+ * @page: page layout,
+ * @formats: event layouts,
+ * @cpus: buffer of each CPU,
+ * @num_cpus: number of entries in @cpus.
+ *
+ * Binary trace buffers being read.
+ **/
+struct raw_trace {
+	int       dfd;
+	RawPage   page;
+	RawFormat formats[RAW_NUM_EVENTS];
+	RawCpu *  cpus;
+	size_t    num_cpus;
+};
+
+
+/* Prototypes for static functions */
+static int   raw_trace_destroy (RawTrace *trace);
+static int   raw_read_fields   (int dfd, const char *path, int *id,
+				const char **names, RawField *fields,
+				char **types, size_t num_fields);
+static int   raw_read_page_format (int dfd, const char *path,
+				   RawFormat *format);
+static void *raw_cpu_thread    (void *ptr);
+static void  raw_decode_page   (RawCpu *cpu, const char *page);
+static void  raw_decode_event  (RawCpu *cpu, const char *data, size_t len,
+				unsigned long long timestamp);
+static void  raw_decode_page_event (RawCpu *cpu, const RawFormat *format,
+				    const char *data, size_t len,
+				    unsigned long long timestamp);
+static int   raw_record_compar (const void *a, const void *b);
+static int   raw_call_compar   (const void *a, const void *b);
+static int   raw_fault_compar  (const void *a, const void *b);
+static NihHash *raw_read_saved (int dfd, const char *name);
+static const char *raw_saved   (NihHash *saved, pid_t pid);
+static pid_t raw_tgid          (NihHash *tgids, pid_t pid);
+
+
+/**
+ * raw_trace_open:
+ * @parent: parent of the returned object,
+ * @dfd: tracing directory.
+ *
+ * Prepares to read the files opened from the binary per-CPU trace
+ * buffers rather than having the kernel format them as text for us to
+ * parse back, working out the layouts of the buffer pages and events
+ * from their format files.
+ *
+ * Every buffer is opened, but none read, so on error the text trace may
+ * still be read instead.
+ *
+ * Returns: newly allocated trace or NULL on raised error.
+ **/
+RawTrace *
+raw_trace_open (const void *parent,
+		int         dfd)
+{
+	nih_local RawTrace *trace = NULL;
+	const char *        page_names[] = { "timestamp", "commit", "data" };
+	RawField            page_fields[3];
+	int                 available = 0;
+	int                 cpus_fd;
+	DIR *               dir;
+	struct dirent *     ent;
+
+	trace = NIH_MUST (nih_new (NULL, RawTrace));
+	trace->dfd = dfd;
+	trace->cpus = NULL;
+	trace->num_cpus = 0;
+
+	nih_alloc_set_destructor (trace, raw_trace_destroy);
+
+	/* Work out the layout of the ring buffer pages */
+	if (raw_read_fields (dfd, "events/header_page", NULL, page_names,
+			     page_fields, NULL, 3) < 0)
+		return NULL;
+
+	trace->page.timestamp = page_fields[0];
+	trace->page.commit = page_fields[1];
+	trace->page.data = page_fields[2];
+	trace->page.size = trace->page.data.offset + trace->page.data.size;
+
+	if ((trace->page.timestamp.size != 8)
+	    || ((trace->page.commit.size != 4) && (trace->page.commit.size != 8))
+	    || (trace->page.size <= (size_t)trace->page.data.offset)) {
+		nih_return_error (NULL, EINVAL,
+				  _("Unexpected trace page layout"));
+	}
+
+	/* And of each event we want */
+	for (size_t i = 0; i < RAW_NUM_EVENTS; i++) {
+		RawFormat *     format = &trace->formats[i];
+		nih_local char *path = NULL;
+		const char *    names[] = { "common_pid", "filename" };
+		RawField        fields[2];
+		char *          types[2] = { NULL, NULL };
+
+		path = NIH_MUST (nih_sprintf (NULL, "events/%s/format",
+					      raw_events[i].name));
+
+		format->id = -1;
+		format->kind = raw_events[i].kind;
+		if (format->kind == RAW_EXIT)
+			names[1] = "ret";
+
+		if (format->kind == RAW_PAGE) {
+			if (raw_read_page_format (dfd, path, format) < 0) {
+				NihError *err;
+
+				err = nih_error_get ();
+				nih_debug ("%s: %s", path, err->message);
+				nih_free (err);
+			}
+			continue;
+		}
+
+		if (raw_read_fields (dfd, path, &format->id, names, fields,
+				     types, 2) < 0) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_debug ("%s: %s", path, err->message);
+			nih_free (err);
+			continue;
+		}
+
+		format->pid = fields[0];
+		format->value = fields[1];
+		format->data_loc = (strstr (types[1], "__data_loc") != NULL);
+
+		if ((format->pid.size != sizeof (int))
+		    || (format->data_loc && (format->value.size != 4))
+		    || ((format->kind == RAW_EXIT)
+			&& (format->value.size != sizeof (long))))
+			format->id = -1;
+
+		nih_free (types[0]);
+		nih_free (types[1]);
+
+		if ((format->id >= 0) && (format->kind != RAW_EXIT))
+			available++;
+	}
+
+	if (! available)
+		nih_return_error (NULL, ENOENT, _("No open events to read"));
+
+	/* Open every CPU's buffer before reading any of them */
+	cpus_fd = openat (dfd, "per_cpu", O_RDONLY | O_DIRECTORY);
+	if (cpus_fd < 0)
+		nih_return_system_error (NULL);
+
+	dir = fdopendir (cpus_fd);
+	if (! dir) {
+		nih_error_raise_system ();
+		close (cpus_fd);
+		return NULL;
+	}
+
+	while ((ent = readdir (dir)) != NULL) {
+		nih_local char *path = NULL;
+		RawCpu *        cpu;
+		int             fd;
+
+		if (strncmp (ent->d_name, "cpu", 3))
+			continue;
+
+		path = NIH_MUST (nih_sprintf (NULL, "%s/trace_pipe_raw",
+					      ent->d_name));
+
+		fd = openat (cpus_fd, path, O_RDONLY | O_NONBLOCK);
+		if (fd < 0)
+			continue;
+
+		trace->cpus = NIH_MUST (nih_realloc (trace->cpus, trace,
+						     (sizeof (RawCpu)
+						      * (trace->num_cpus + 1))));
+		cpu = &trace->cpus[trace->num_cpus++];
+		memset (cpu, 0, sizeof (RawCpu));
+		cpu->fd = fd;
+		cpu->page = &trace->page;
+		cpu->formats = trace->formats;
+	}
+
+	closedir (dir);
+
+	if (! trace->num_cpus)
+		nih_return_error (NULL, ENOENT, _("No trace buffers to read"));
+
+	nih_ref (trace, parent);
+
+	return trace;
+}
+
+static int
+raw_trace_destroy (RawTrace *trace)
+{
+	nih_assert (trace != NULL);
+
+	for (size_t i = 0; i < trace->num_cpus; i++) {
+		close (trace->cpus[i].fd);
+
+		if (trace->cpus[i].records)
+			nih_free (trace->cpus[i].records);
+		if (trace->cpus[i].faults)
+			nih_free (trace->cpus[i].faults);
+	}
+
+	return 0;
+}
+
+/**
+ * raw_trace_drain:
+ * @trace: trace being read.
+ *
+ * Reads and decodes whatever is in the buffers so far, emptying them;
+ * each CPU's buffer is read by its own thread.  This may be called while
+ * tracing, so that the buffers don't have to hold the whole trace.
+ **/
+void
+raw_trace_drain (RawTrace *trace)
+{
+	nih_local pthread_t *threads = NULL;
+
+	nih_assert (trace != NULL);
+
+	threads = NIH_MUST (nih_alloc (NULL, (sizeof (pthread_t)
+					      * trace->num_cpus)));
+	for (size_t i = 0; i < trace->num_cpus; i++)
+		pthread_create (&threads[i], NULL, raw_cpu_thread,
+				&trace->cpus[i]);
+
+	for (size_t i = 0; i < trace->num_cpus; i++)
+		pthread_join (threads[i], NULL);
+}
+
+/**
+ * raw_trace_events:
+ * @parent: parent of @events and @faults,
+ * @trace: trace being read,
+ * @events: set to newly allocated array of events,
+ * @num_events: set to number of entries in @events,
+ * @faults: set to newly allocated array of pages read, or NULL,
+ * @num_faults: set to number of entries in @faults.
+ *
+ * Reads what is left in the buffers, and returns every file opened in
+ * them in the order they happened; files that system calls were about
+ * to open are only included where the call succeeded.  Pages added to
+ * the page cache are returned, in the order they were, in @faults.
+ **/
+void
+raw_trace_events (const void *parent,
+		  RawTrace *  trace,
+		  RawEvent ** events,
+		  size_t *    num_events,
+		  RawFault ** faults,
+		  size_t *    num_faults)
+{
+	nih_local RawRecord * records = NULL;
+	size_t                num_records = 0;
+	nih_local RawRecord **calls = NULL;
+	nih_local NihHash *   comms = NULL;
+	nih_local NihHash *   tgids = NULL;
+
+	nih_assert (trace != NULL);
+	nih_assert (events != NULL);
+	nih_assert (num_events != NULL);
+
+	raw_trace_drain (trace);
+
+	/* Merge them back into a single timeline */
+	for (size_t i = 0; i < trace->num_cpus; i++)
+		num_records += trace->cpus[i].num_records;
+
+	records = NIH_MUST (nih_alloc (NULL, (sizeof (RawRecord)
+					      * (num_records + 1))));
+	num_records = 0;
+	for (size_t i = 0; i < trace->num_cpus; i++) {
+		RawCpu *cpu = &trace->cpus[i];
+
+		for (size_t j = 0; j < cpu->num_records; j++) {
+			records[num_records] = cpu->records[j];
+			if (records[num_records].event.path)
+				nih_ref (records[num_records].event.path,
+					 records);
+			num_records++;
+		}
+
+		if (cpu->records)
+			nih_free (cpu->records);
+		cpu->records = NULL;
+		cpu->num_records = cpu->max_records = 0;
+	}
+
+	qsort (records, num_records, sizeof (RawRecord), raw_record_compar);
+
+	/* A system call's exit follows its entry in the same process, so
+	 * ordered by process those are next to each other; only entries
+	 * whose call succeeded are kept.
+	 */
+	calls = NIH_MUST (nih_alloc (NULL, (sizeof (RawRecord *)
+					    * (num_records + 1))));
+	for (size_t i = 0; i < num_records; i++)
+		calls[i] = &records[i];
+
+	qsort (calls, num_records, sizeof (RawRecord *), raw_call_compar);
+
+	for (size_t i = 0; i < num_records; i++) {
+		if (calls[i]->kind != RAW_ENTER)
+			continue;
+
+		if ((i + 1 < num_records)
+		    && (calls[i + 1]->kind == RAW_EXIT)
+		    && (calls[i + 1]->event.pid == calls[i]->event.pid)
+		    && (calls[i + 1]->ret >= 0))
+			calls[i]->kind = RAW_OPEN;
+	}
+
+	*events = NIH_MUST (nih_alloc (parent, (sizeof (RawEvent)
+						* (num_records + 1))));
+	*num_events = 0;
+	for (size_t i = 0; i < num_records; i++) {
+		if (records[i].kind != RAW_OPEN)
+			continue;
+
+		(*events)[*num_events] = records[i].event;
+		nih_ref ((*events)[*num_events].path, *events);
+		(*num_events)++;
+	}
+
+	/* And the pages, with their own timeline */
+	if (faults) {
+		nih_assert (num_faults != NULL);
+
+		*num_faults = 0;
+		for (size_t i = 0; i < trace->num_cpus; i++)
+			*num_faults += trace->cpus[i].num_faults;
+
+		*faults = NIH_MUST (nih_alloc (parent, (sizeof (RawFault)
+							* (*num_faults + 1))));
+		*num_faults = 0;
+	}
+
+	for (size_t i = 0; i < trace->num_cpus; i++) {
+		RawCpu *cpu = &trace->cpus[i];
+
+		if (faults) {
+			memcpy (&(*faults)[*num_faults], cpu->faults,
+				sizeof (RawFault) * cpu->num_faults);
+			*num_faults += cpu->num_faults;
+		}
+
+		if (cpu->faults)
+			nih_free (cpu->faults);
+		cpu->faults = NULL;
+		cpu->num_faults = cpu->max_faults = 0;
+	}
+
+	if (faults)
+		qsort (*faults, *num_faults, sizeof (RawFault),
+		       raw_fault_compar);
+
+	/* Binary events only carry the pid, so look up the name of each
+	 * process in the names the kernel saved while tracing; the names
+	 * are shared by both arrays.
+	 */
+	comms = raw_read_saved (trace->dfd, "saved_cmdlines");
+	if (comms) {
+		nih_ref (comms, *events);
+		for (size_t i = 0; i < *num_events; i++)
+			(*events)[i].comm = raw_saved (comms, (*events)[i].pid);
+
+		if (faults) {
+			nih_ref (comms, *faults);
+			for (size_t i = 0; i < *num_faults; i++)
+				(*faults)[i].comm = raw_saved (comms,
+							       (*faults)[i].pid);
+		}
+	}
+
+	/* Names are only kept for the last few processes seen, whereas
+	 * the process each thread belongs to is kept for every pid, when
+	 * the kernel was asked to record them.
+	 */
+	tgids = raw_read_saved (trace->dfd, "saved_tgids");
+	if (tgids) {
+		for (size_t i = 0; i < *num_events; i++)
+			(*events)[i].tgid = raw_tgid (tgids, (*events)[i].pid);
+
+		if (faults)
+			for (size_t i = 0; i < *num_faults; i++)
+				(*faults)[i].tgid = raw_tgid (tgids,
+							      (*faults)[i].pid);
+	}
+
+	nih_info ("Read %zu events from %zu trace buffers", *num_events,
+		  trace->num_cpus);
+}
+
+/**
+ * raw_trace_cpu_time:
+ * @trace: trace being read.
+ *
+ * Returns: CPU time, in nanoseconds, the threads reading the buffers
+ * have used.
+ **/
+unsigned long long
+raw_trace_cpu_time (RawTrace *trace)
+{
+	unsigned long long cpu_ns = 0;
+
+	nih_assert (trace != NULL);
+
+	for (size_t i = 0; i < trace->num_cpus; i++)
+		cpu_ns += trace->cpus[i].cpu_ns;
+
+	return cpu_ns;
+}
+
+/**
+ * raw_trace_read:
+ * @parent: parent of @events,
+ * @dfd: tracing directory,
+ * @events: set to newly allocated array of events,
+ * @num_events: set to number of entries in @events.
+ *
+ * Reads every event from the binary trace buffers at once; see
+ * raw_trace_open().
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+raw_trace_read (const void *parent,
+		int         dfd,
+		RawEvent ** events,
+		size_t *    num_events)
+{
+	nih_local RawTrace *trace = NULL;
+
+	trace = raw_trace_open (NULL, dfd);
+	if (! trace)
+		return -1;
+
+	raw_trace_events (parent, trace, events, num_events, NULL, NULL);
+
+	return 0;
+}
+
+/**
+ * raw_trace_overruns:
+ * @dfd: tracing directory.
+ *
+ * Adds up the events each CPU's buffer has lost, whether overwritten
+ * before they were read or dropped because the buffer was full.
+ *
+ * Returns: number of events lost.
+ **/
+unsigned long
+raw_trace_overruns (int dfd)
+{
+	int            cpus_fd;
+	DIR *          dir;
+	struct dirent *ent;
+	unsigned long  overruns = 0;
+
+	cpus_fd = openat (dfd, "per_cpu", O_RDONLY | O_DIRECTORY);
+	if (cpus_fd < 0)
+		return 0;
+
+	dir = fdopendir (cpus_fd);
+	if (! dir) {
+		close (cpus_fd);
+		return 0;
+	}
+
+	while ((ent = readdir (dir)) != NULL) {
+		nih_local char *path = NULL;
+		int             fd;
+		FILE *          fp;
+		char *          line;
+
+		if (strncmp (ent->d_name, "cpu", 3))
+			continue;
+
+		path = NIH_MUST (nih_sprintf (NULL, "%s/stats", ent->d_name));
+
+		fd = openat (cpus_fd, path, O_RDONLY);
+		if (fd < 0)
+			continue;
+
+		fp = fdopen (fd, "r");
+		if (! fp) {
+			close (fd);
+			continue;
+		}
+
+		while ((line = fgets_alloc (NULL, fp)) != NULL) {
+			unsigned long value;
+
+			if ((sscanf (line, "overrun: %lu", &value) == 1)
+			    || (sscanf (line, "dropped events: %lu", &value) == 1))
+				overruns += value;
+
+			nih_free (line);
+		}
+
+		fclose (fp);
+	}
+
+	closedir (dir);
+
+	return overruns;
+}
+
+
+/**
+ * raw_read_fields:
+ * @dfd: tracing directory,
+ * @path: format file relative to @dfd,
+ * @id: set to the event ID, or NULL,
+ * @names: names of the fields to find,
+ * @fields: set to offset and size of each field,
+ * @types: set to newly allocated type of each field, or NULL,
+ * @num_fields: number of entries in @names.
+ *
+ * Format files describe each field on a line of its own, such as:
+ *
+ *   field:__data_loc char[] filename;	offset:8;	size:4;	signed:0;
+ *
+ * Returns: zero if every field was found, negative value on raised error.
+ **/
+static int
+raw_read_fields (int          dfd,
+		 const char * path,
+		 int *        id,
+		 const char **names,
+		 RawField *   fields,
+		 char **      types,
+		 size_t       num_fields)
+{
+	int    fd;
+	FILE * fp;
+	char * line;
+	size_t found = 0;
+
+	nih_assert (path != NULL);
+	nih_assert (names != NULL);
+	nih_assert (fields != NULL);
+
+	fd = openat (dfd, path, O_RDONLY);
+	if (fd < 0)
+		nih_return_system_error (-1);
+
+	fp = fdopen (fd, "r");
+	if (! fp) {
+		nih_error_raise_system ();
+		close (fd);
+		return -1;
+	}
+
+	for (size_t i = 0; i < num_fields; i++)
+		fields[i].offset = fields[i].size = -1;
+
+	while ((line = fgets_alloc (NULL, fp)) != NULL) {
+		char *decl;
+		char *end;
+		char *name;
+		char *ptr;
+
+		if (id && (! strncmp (line, "ID:", 3)))
+			*id = atoi (line + 3);
+
+		decl = strstr (line, "field:");
+		end = decl ? strchr (decl, ';') : NULL;
+		if (! end) {
+			nih_free (line);
+			continue;
+		}
+
+		decl += 6;
+		*end = '\0';
+
+		/* The name is the last word of the declaration, less any
+		 * array size.
+		 */
+		ptr = strchr (decl, '[');
+		if (ptr && (! strchr (ptr, ' ')))
+			*ptr = '\0';
+
+		name = strrchr (decl, ' ');
+		name = name ? name + 1 : decl;
+
+		for (size_t i = 0; i < num_fields; i++) {
+			if (strcmp (name, names[i]) || (fields[i].offset >= 0))
+				continue;
+
+			ptr = strstr (end + 1, "offset:");
+			if (ptr)
+				fields[i].offset = atoi (ptr + 7);
+			ptr = strstr (end + 1, "size:");
+			if (ptr)
+				fields[i].size = atoi (ptr + 5);
+
+			if (types)
+				types[i] = NIH_MUST (nih_strndup (NULL, decl,
+								  name - decl));
+
+			if ((fields[i].offset >= 0) && (fields[i].size > 0))
+				found++;
+		}
+
+		nih_free (line);
+	}
+
+	fclose (fp);
+
+	if ((found < num_fields) || (id && (*id < 0))) {
+		if (types)
+			for (size_t i = 0; i < num_fields; i++)
+				if (types[i])
+					nih_free (types[i]);
+
+		nih_return_error (-1, EINVAL, _("Unexpected trace format"));
+	}
+
+	return 0;
+}
+
+/**
+ * raw_read_page_format:
+ * @dfd: tracing directory,
+ * @path: format file relative to @dfd,
+ * @format: format to fill in.
+ *
+ * Page cache events give the device and inode of the file and the index
+ * of the page; newer kernels add whole folios at once, and give their
+ * order too.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+raw_read_page_format (int         dfd,
+		      const char *path,
+		      RawFormat * format)
+{
+	const char *names[] = { "common_pid", "s_dev", "i_ino", "index" };
+	const char *order_names[] = { "order" };
+	RawField    fields[4];
+
+	nih_assert (path != NULL);
+	nih_assert (format != NULL);
+
+	if (raw_read_fields (dfd, path, &format->id, names, fields,
+			     NULL, 4) < 0)
+		return -1;
+
+	format->pid = fields[0];
+	format->value = fields[1];
+	format->ino = fields[2];
+	format->index = fields[3];
+	format->data_loc = FALSE;
+
+	if (raw_read_fields (dfd, path, NULL, order_names, &format->order,
+			     NULL, 1) < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_free (err);
+
+		format->order.offset = format->order.size = -1;
+	}
+
+	if ((format->pid.size != sizeof (int))
+	    || (format->value.size != 4)
+	    || (format->ino.size != sizeof (unsigned long))
+	    || (format->index.size != sizeof (unsigned long))
+	    || ((format->order.offset >= 0) && (format->order.size != 1))) {
+		format->id = -1;
+		nih_return_error (-1, EINVAL, _("Unexpected trace format"));
+	}
+
+	return 0;
+}
+
+static void *
+raw_cpu_thread (void *ptr)
+{
+	RawCpu *        cpu = ptr;
+	nih_local char *page = NULL;
+	struct timespec used;
+
+	page = NIH_MUST (nih_alloc (NULL, cpu->page->size));
+
+	/* Reading gives a page at a time, until the buffer is empty */
+	for (;;) {
+		ssize_t len;
+
+		len = read (cpu->fd, page, cpu->page->size);
+		if ((len < 0) && (errno == EINTR))
+			continue;
+		if (len <= 0)
+			break;
+
+		if (len < cpu->page->data.offset)
+			continue;
+
+		memset (page + len, 0, cpu->page->size - len);
+		raw_decode_page (cpu, page);
+	}
+
+	if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &used) == 0)
+		cpu->cpu_ns += ((unsigned long long)used.tv_sec * 1000000000ULL
+				+ used.tv_nsec);
+
+	return NULL;
+}
+
+/**
+ * raw_decode_page:
+ * @cpu: CPU the page is from,
+ * @page: page of the ring buffer.
+ *
+ * Each event has a 32-bit header of a 5-bit type or length, and a 27-bit
+ * time delta from the previous event, in the layout of
+ * struct ring_buffer_event.
+ **/
+static void
+raw_decode_page (RawCpu *    cpu,
+		 const char *page)
+{
+	const RawPage *    layout = cpu->page;
+	unsigned long long timestamp;
+	unsigned long long commit;
+	const char *       ptr;
+	const char *       end;
+
+	memcpy (&timestamp, page + layout->timestamp.offset, sizeof timestamp);
+
+	if (layout->commit.size == 8) {
+		memcpy (&commit, page + layout->commit.offset, 8);
+	} else {
+		uint32_t commit32;
+
+		memcpy (&commit32, page + layout->commit.offset, 4);
+		commit = commit32;
+	}
+
+	commit &= ~RB_MISSED_FLAGS;
+	commit = nih_min (commit, (unsigned long long)layout->data.size);
+
+	ptr = page + layout->data.offset;
+	end = ptr + commit;
+
+	while (ptr + 4 <= end) {
+		uint32_t header;
+		uint32_t type_len;
+		uint32_t delta;
+		uint32_t array0 = 0;
+
+		memcpy (&header, ptr, 4);
+		type_len = header & ((1 << 5) - 1);
+		delta = header >> 5;
+
+		if (ptr + 8 <= end)
+			memcpy (&array0, ptr + 4, 4);
+
+		switch (type_len) {
+		case RINGBUF_TYPE_PADDING:
+			/* Without a delta it fills the rest of the page */
+			if (! delta)
+				return;
+
+			timestamp += delta;
+			ptr += 4 + array0;
+			break;
+		case RINGBUF_TYPE_TIME_EXTEND:
+			timestamp += ((unsigned long long)array0 << TS_SHIFT) + delta;
+			ptr += 8;
+			break;
+		case RINGBUF_TYPE_TIME_STAMP:
+			timestamp = ((((unsigned long long)array0 << TS_SHIFT) + delta)
+				     | (timestamp & ~((1ULL << 59) - 1)));
+			ptr += 8;
+			break;
+		case 0:
+			/* Length, including itself, is in the first word */
+			timestamp += delta;
+			if ((array0 < 4) || (ptr + 4 + array0 > end))
+				return;
+
+			raw_decode_event (cpu, ptr + 8, array0 - 4, timestamp);
+			ptr += 4 + array0;
+			break;
+		default:
+			timestamp += delta;
+			if (ptr + 4 + type_len * 4 > end)
+				return;
+
+			raw_decode_event (cpu, ptr + 4, type_len * 4, timestamp);
+			ptr += 4 + type_len * 4;
+			break;
+		}
+	}
+}
+
+static void
+raw_decode_event (RawCpu *           cpu,
+		  const char *       data,
+		  size_t             len,
+		  unsigned long long timestamp)
+{
+	const RawFormat *format = NULL;
+	uint16_t         type;
+	int              pid;
+	const char *     path;
+	size_t           path_len;
+	RawRecord *      record;
+
+	if (len < sizeof type)
+		return;
+
+	/* Every event starts with its common_type */
+	memcpy (&type, data, sizeof type);
+
+	for (size_t i = 0; i < RAW_NUM_EVENTS; i++)
+		if (cpu->formats[i].id == type)
+			format = &cpu->formats[i];
+
+	if (format && (format->kind == RAW_PAGE)) {
+		raw_decode_page_event (cpu, format, data, len, timestamp);
+		return;
+	}
+
+	if ((! format)
+	    || ((size_t)(format->pid.offset + format->pid.size) > len)
+	    || ((size_t)(format->value.offset + format->value.size) > len))
+		return;
+
+	memcpy (&pid, data + format->pid.offset, sizeof pid);
+
+	if (cpu->num_records == cpu->max_records) {
+		cpu->max_records = nih_max (cpu->max_records * 2, 256U);
+		cpu->records = NIH_MUST (nih_realloc (cpu->records, NULL,
+						      (sizeof (RawRecord)
+						       * cpu->max_records)));
+	}
+
+	record = &cpu->records[cpu->num_records++];
+	record->event.timestamp = timestamp;
+	record->event.pid = pid;
+	record->event.tgid = 0;
+	record->event.comm = NULL;
+	record->event.path = NULL;
+	record->kind = format->kind;
+	record->ret = 0;
+
+	if (format->kind == RAW_EXIT) {
+		memcpy (&record->ret, data + format->value.offset,
+			sizeof record->ret);
+		return;
+	}
+
+	if (format->data_loc) {
+		uint32_t loc;
+
+		memcpy (&loc, data + format->value.offset, sizeof loc);
+		if ((loc & 0xffff) + (loc >> 16) > len)
+			loc = 0;
+
+		path = data + (loc & 0xffff);
+		path_len = loc >> 16;
+	} else {
+		path = data + format->value.offset;
+		path_len = format->value.size;
+	}
+
+	path_len = strnlen (path, path_len);
+
+	record->event.path = NIH_MUST (nih_strndup (cpu->records, path,
+						    path_len));
+}
+
+/**
+ * raw_decode_page_event:
+ * @cpu: CPU the event is from,
+ * @format: layout of the event,
+ * @data: event data,
+ * @len: length of @data,
+ * @timestamp: time of the event in nanoseconds.
+ *
+ * The device is given as the kernel's own dev_t, with a 20-bit minor.
+ **/
+static void
+raw_decode_page_event (RawCpu *           cpu,
+		       const RawFormat *  format,
+		       const char *       data,
+		       size_t             len,
+		       unsigned long long timestamp)
+{
+	RawFault *    fault;
+	uint32_t      dev;
+	unsigned long ino;
+	unsigned long index;
+	uint8_t       order = 0;
+
+	if (((size_t)(format->pid.offset + format->pid.size) > len)
+	    || ((size_t)(format->value.offset + format->value.size) > len)
+	    || ((size_t)(format->ino.offset + format->ino.size) > len)
+	    || ((size_t)(format->index.offset + format->index.size) > len)
+	    || ((format->order.offset >= 0)
+		&& ((size_t)(format->order.offset + format->order.size) > len)))
+		return;
+
+	if (cpu->num_faults == cpu->max_faults) {
+		cpu->max_faults = nih_max (cpu->max_faults * 2, 1024U);
+		cpu->faults = NIH_MUST (nih_realloc (cpu->faults, NULL,
+						     (sizeof (RawFault)
+						      * cpu->max_faults)));
+	}
+
+	fault = &cpu->faults[cpu->num_faults++];
+
+	memcpy (&fault->pid, data + format->pid.offset, sizeof fault->pid);
+	memcpy (&dev, data + format->value.offset, sizeof dev);
+	memcpy (&ino, data + format->ino.offset, sizeof ino);
+	memcpy (&index, data + format->index.offset, sizeof index);
+	if (format->order.offset >= 0)
+		memcpy (&order, data + format->order.offset, sizeof order);
+
+	fault->timestamp = timestamp;
+	fault->tgid = 0;
+	fault->comm = NULL;
+	fault->dev = makedev (dev >> 20, dev & ((1U << 20) - 1));
+	fault->ino = ino;
+	fault->index = index;
+	fault->pages = 1UL << order;
+}
+
+static int
+raw_record_compar (const void *a,
+		   const void *b)
+{
+	const RawRecord *record_a = a;
+	const RawRecord *record_b = b;
+
+	nih_assert (record_a != NULL);
+	nih_assert (record_b != NULL);
+
+	if (record_a->event.timestamp < record_b->event.timestamp) {
+		return -1;
+	} else if (record_a->event.timestamp > record_b->event.timestamp) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+static int
+raw_call_compar (const void *a,
+		 const void *b)
+{
+	const RawRecord *const *record_a = a;
+	const RawRecord *const *record_b = b;
+
+	nih_assert (record_a != NULL);
+	nih_assert (record_b != NULL);
+
+	/* Records are already in time order, so keep it for each pid */
+	if ((*record_a)->event.pid < (*record_b)->event.pid) {
+		return -1;
+	} else if ((*record_a)->event.pid > (*record_b)->event.pid) {
+		return 1;
+	} else if (*record_a < *record_b) {
+		return -1;
+	} else if (*record_a > *record_b) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+static int
+raw_fault_compar (const void *a,
+		  const void *b)
+{
+	const RawFault *fault_a = a;
+	const RawFault *fault_b = b;
+
+	nih_assert (fault_a != NULL);
+	nih_assert (fault_b != NULL);
+
+	if (fault_a->timestamp < fault_b->timestamp) {
+		return -1;
+	} else if (fault_a->timestamp > fault_b->timestamp) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+/**
+ * raw_read_saved:
+ * @dfd: tracing directory or instance,
+ * @name: saved_cmdlines or saved_tgids.
+ *
+ * Reads the names of processes, or the processes that threads belong to,
+ * that the kernel saved while tracing.
+ *
+ * Returns: newly allocated hash of values keyed by pid, or NULL if they
+ * couldn't be read.
+ **/
+static NihHash *
+raw_read_saved (int         dfd,
+		const char *name)
+{
+	nih_local char *top = NULL;
+	NihHash *       saved;
+	int             fd;
+	FILE *          fp;
+	char *          line;
+
+	nih_assert (name != NULL);
+
+	/* Instances share those saved by the top level */
+	fd = openat (dfd, name, O_RDONLY);
+	if ((fd < 0) && (errno == ENOENT)) {
+		top = NIH_MUST (nih_sprintf (NULL, "../../%s", name));
+		fd = openat (dfd, top, O_RDONLY);
+	}
+	if (fd < 0)
+		return NULL;
+
+	fp = fdopen (fd, "r");
+	if (! fp) {
+		close (fd);
+		return NULL;
+	}
+
+	saved = NIH_MUST (nih_hash_string_new (NULL, 1000));
+
+	/* Each line is the pid and value */
+	while ((line = fgets_alloc (NULL, fp)) != NULL) {
+		NihListEntry *entry;
+		char *        value;
+
+		value = strchr (line, ' ');
+		if (value) {
+			*(value++) = '\0';
+
+			entry = NIH_MUST (nih_list_entry_new (saved));
+			entry->str = NIH_MUST (nih_sprintf (entry, "%s %s",
+							    line, value));
+			entry->str[strlen (line)] = '\0';
+			nih_hash_add (saved, &entry->entry);
+		}
+
+		nih_free (line);
+	}
+
+	fclose (fp);
+
+	return saved;
+}
+
+/**
+ * raw_saved:
+ * @saved: values read by raw_read_saved(),
+ * @pid: process.
+ *
+ * Returns: value saved for @pid, owned by @saved, or NULL if not known.
+ **/
+static const char *
+raw_saved (NihHash *saved,
+	   pid_t    pid)
+{
+	NihListEntry *entry;
+	char          key[32];
+
+	nih_assert (saved != NULL);
+
+	snprintf (key, sizeof key, "%d", pid);
+
+	entry = (NihListEntry *)nih_hash_lookup (saved, key);
+	if (! entry)
+		return NULL;
+
+	return entry->str + strlen (entry->str) + 1;
+}
+
+/**
+ * raw_tgid:
+ * @tgids: processes read by raw_read_saved() from saved_tgids,
+ * @pid: thread.
+ *
+ * Returns: process that @pid belongs to, or zero if not known.
+ **/
+static pid_t
+raw_tgid (NihHash *tgids,
+	  pid_t    pid)
+{
+	const char *tgid;
+
+	nih_assert (tgids != NULL);
+
+	tgid = raw_saved (tgids, pid);
+	if (! tgid)
+		return 0;
+
+	return (pid_t)strtol (tgid, NULL, 10);
+}
@@ -0,0 +1,88 @@
+/* ureadahead
+ *
+ * Copyright © 2009 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef UREADAHEAD_RAWTRACE_H
+#define UREADAHEAD_RAWTRACE_H
+
+#include <sys/types.h>
+
+#include <nih/macros.h>
+
+
+/**
+ * RawEvent:
+ * @timestamp: time of the event in nanoseconds,
+ * @pid: process that opened the file,
+ * @tgid: process that @pid is a thread of, or zero if not known,
+ * @comm: name of that process, or NULL if not known,
+ * @path: path opened.
+ *
+ * File opened, as decoded from the binary trace buffer.
+ **/
+typedef struct raw_event {
+	unsigned long long timestamp;
+	pid_t              pid;
+	pid_t              tgid;
+	const char *       comm;
+	char *             path;
+} RawEvent;
+
+/**
+ * RawFault:
+ * @timestamp: time of the event in nanoseconds,
+ * @pid: process that read the pages,
+ * @tgid: process that @pid is a thread of, or zero if not known,
+ * @comm: name of that process, or NULL if not known,
+ * @dev: device of the file,
+ * @ino: inode of the file,
+ * @index: first page read,
+ * @pages: number of pages read.
+ *
+ * Pages of a file added to the page cache, as decoded from the binary
+ * trace buffer.
+ **/
+typedef struct raw_fault {
+	unsigned long long timestamp;
+	pid_t              pid;
+	pid_t              tgid;
+	const char *       comm;
+	dev_t              dev;
+	ino_t              ino;
+	off_t              index;
+	size_t             pages;
+} RawFault;
+
+typedef struct raw_trace RawTrace;
+
+
+NIH_BEGIN_EXTERN
+
+RawTrace *         raw_trace_open     (const void *parent, int dfd);
+void               raw_trace_drain    (RawTrace *trace);
+void               raw_trace_events   (const void *parent, RawTrace *trace,
+				       RawEvent **events, size_t *num_events,
+				       RawFault **faults, size_t *num_faults);
+unsigned long long raw_trace_cpu_time (RawTrace *trace);
+int                raw_trace_read     (const void *parent, int dfd,
+				       RawEvent **events, size_t *num_events);
+
+unsigned long      raw_trace_overruns (int dfd);
+
+NIH_END_EXTERN
+
+#endif /* UREADAHEAD_RAWTRACE_H */
@@ -0,0 +1,379 @@
+/* ureadahead
+ *
+ * rewarm.c - re-reading the pack after memory pressure
+ *
+ * Copyright © 2009 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "rewarm.h"
+#include "pack.h"
+#include "file.h"
+
+
+/**
+ * PATH_VMSTAT:
+ *
+ * Path to the kernel's virtual memory statistics.
+ **/
+#define PATH_VMSTAT "/proc/vmstat"
+
+/**
+ * PATH_PRESSURE_MEMORY:
+ *
+ * Path to the memory pressure stall information, present on kernels
+ * since 4.20 built with CONFIG_PSI.
+ **/
+#define PATH_PRESSURE_MEMORY "/proc/pressure/memory"
+
+/**
+ * REWARM_INTERVAL:
+ *
+ * Number of seconds between looks at the memory statistics.
+ **/
+#define REWARM_INTERVAL 10
+
+/**
+ * REWARM_REFAULT_THRESHOLD:
+ *
+ * Number of file pages refaulted within an interval for us to consider
+ * that memory pressure has evicted part of the working set.
+ **/
+#define REWARM_REFAULT_THRESHOLD 1024
+
+/**
+ * REWARM_PRESSURE_LOW:
+ *
+ * Percentage of time over the last ten seconds that some task stalled on
+ * memory, below which we consider the pressure to have subsided.
+ **/
+#define REWARM_PRESSURE_LOW 1.0
+
+
+/* Prototypes for static functions */
+static int    read_refaults  (unsigned long long *refaults);
+static double read_pressure  (void);
+static off_t  rewarm_pack    (PackFile *file, off_t budget);
+static off_t  rewarm_block   (int fd, PackBlock *block, off_t budget);
+
+
+/**
+ * do_rewarm:
+ * @file: pack file to re-read,
+ * @daemonise: TRUE to detach first,
+ * @budget: most megabytes to re-read each time.
+ *
+ * Watches the number of file pages refaulted, which is how often pages
+ * evicted from the page cache are found to have been needed again.  When
+ * that jumps, something has pushed the working set out; once memory
+ * pressure has since subsided, the most valuable blocks of @file that
+ * are no longer in memory are read back in, up to @budget megabytes.
+ *
+ * Critical files are the most valuable, then the others in pack order.
+ *
+ * Only returns on error.
+ *
+ * Returns: negative value on error.
+ **/
+int
+do_rewarm (PackFile *file,
+	   int       daemonise,
+	   int       budget)
+{
+	unsigned long long last;
+	int                evicted = FALSE;
+
+	nih_assert (file != NULL);
+	nih_assert (budget > 0);
+
+	if (read_refaults (&last) < 0)
+		return -1;
+
+	if (daemonise) {
+		pid_t pid;
+
+		pid = fork ();
+		if (pid < 0) {
+			nih_return_system_error (-1);
+		} else if (pid > 0) {
+			_exit (0);
+		}
+	}
+
+	for (;;) {
+		struct timeval     tv;
+		unsigned long long refaults;
+		double             pressure;
+
+		tv.tv_sec = REWARM_INTERVAL;
+		tv.tv_usec = 0;
+
+		select (0, NULL, NULL, NULL, &tv);
+
+		if (read_refaults (&refaults) < 0)
+			return -1;
+
+		/* Without pressure stall information, we wait for the
+		 * refaults to calm down instead.
+		 */
+		pressure = read_pressure ();
+		if (pressure < 0.0)
+			pressure = (refaults - last > REWARM_REFAULT_THRESHOLD
+				    ? 100.0 : 0.0);
+
+		if (refaults - last > REWARM_REFAULT_THRESHOLD) {
+			if (! evicted)
+				nih_info ("%llu pages refaulted, waiting for pressure to subside",
+					  refaults - last);
+			evicted = TRUE;
+		}
+
+		last = refaults;
+
+		if (evicted && (pressure < REWARM_PRESSURE_LOW)) {
+			off_t bytes;
+
+			bytes = rewarm_pack (file, (off_t)budget * 1024 * 1024);
+			nih_info ("Re-read %zu kB", (size_t)bytes / 1024);
+
+			evicted = FALSE;
+
+			/* Don't count our own reads as the next eviction */
+			if (read_refaults (&last) < 0)
+				return -1;
+		}
+	}
+}
+
+
+/**
+ * read_refaults:
+ * @refaults: set to number of refaulted file pages.
+ *
+ * Kernels since 5.9 count file and anonymous refaults separately, before
+ * that only file pages were counted.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+static int
+read_refaults (unsigned long long *refaults)
+{
+	FILE *fp;
+	char *line;
+	int   found = FALSE;
+
+	nih_assert (refaults != NULL);
+
+	fp = fopen (PATH_VMSTAT, "r");
+	if (! fp)
+		nih_return_system_error (-1);
+
+	while ((line = fgets_alloc (NULL, fp)) != NULL) {
+		unsigned long long value;
+
+		if ((sscanf (line, "workingset_refault_file %llu", &value) == 1)
+		    || (sscanf (line, "workingset_refault %llu", &value) == 1)) {
+			*refaults = value;
+			found = TRUE;
+		}
+
+		nih_free (line);
+	}
+
+	if (fclose (fp) < 0)
+		nih_return_system_error (-1);
+
+	if (! found) {
+		errno = ENOENT;
+		nih_return_system_error (-1);
+	}
+
+	return 0;
+}
+
+/**
+ * read_pressure:
+ *
+ * Returns: percentage of the last ten seconds in which some task stalled
+ * on memory, or negative value if not known.
+ **/
+static double
+read_pressure (void)
+{
+	FILE * fp;
+	double avg10 = -1.0;
+
+	fp = fopen (PATH_PRESSURE_MEMORY, "r");
+	if (! fp)
+		return -1.0;
+
+	if (fscanf (fp, "some avg10=%lf", &avg10) < 1)
+		avg10 = -1.0;
+
+	fclose (fp);
+
+	return avg10;
+}
+
+
+/**
+ * rewarm_pack:
+ * @file: pack file,
+ * @budget: most bytes to read.
+ *
+ * Reads back in the parts of the blocks of @file that aren't in memory,
+ * those of critical files first and then the rest, in pack order, until
+ * @budget is spent.
+ *
+ * Returns: number of bytes read.
+ **/
+static off_t
+rewarm_pack (PackFile *file,
+	     off_t     budget)
+{
+	off_t spent = 0;
+
+	nih_assert (file != NULL);
+
+	for (int pass = 0; pass < 2; pass++) {
+		size_t pathidx = (size_t)-1;
+		int    fd = -1;
+
+		for (size_t i = 0; (i < file->num_blocks) && (spent < budget); i++) {
+			int critical;
+
+			if (file->blocks[i].pathidx >= file->num_paths)
+				continue;
+
+			critical = (file->paths[file->blocks[i].pathidx].flags
+				    & PACK_PATH_CRITICAL) ? TRUE : FALSE;
+			if (critical != (pass == 0))
+				continue;
+
+			/* Blocks of a file are usually together, so we only
+			 * need to open each one again when that changes.
+			 */
+			if (file->blocks[i].pathidx != pathidx) {
+				if (fd >= 0)
+					close (fd);
+
+				pathidx = file->blocks[i].pathidx;
+				fd = open (file->paths[pathidx].path,
+					   O_RDONLY | O_NOATIME);
+			}
+
+			if (fd < 0)
+				continue;
+
+			spent += rewarm_block (fd, &file->blocks[i],
+					       budget - spent);
+		}
+
+		if (fd >= 0)
+			close (fd);
+	}
+
+	return spent;
+}
+
+/**
+ * rewarm_block:
+ * @fd: open file,
+ * @block: block of file,
+ * @budget: most bytes to read.
+ *
+ * Reads in the pages of @block that aren't in memory.
+ *
+ * Returns: number of bytes read.
+ **/
+static off_t
+rewarm_block (int        fd,
+	      PackBlock *block,
+	      off_t      budget)
+{
+	static int               page_size = -1;
+	off_t                    start;
+	off_t                    length;
+	off_t                    num_pages;
+	void *                   buf;
+	nih_local unsigned char *vec = NULL;
+	off_t                    spent = 0;
+
+	nih_assert (fd >= 0);
+	nih_assert (block != NULL);
+
+	if (page_size < 0)
+		page_size = sysconf (_SC_PAGESIZE);
+
+	start = block->offset - (block->offset % page_size);
+	length = block->length + (block->offset - start);
+	if (length <= 0)
+		return 0;
+
+	buf = mmap (NULL, length, PROT_READ, MAP_SHARED, fd, start);
+	if (buf == MAP_FAILED)
+		return 0;
+
+	num_pages = (length - 1) / page_size + 1;
+	vec = NIH_MUST (nih_alloc (NULL, num_pages));
+
+	if (mincore (buf, length, vec) < 0) {
+		munmap (buf, length);
+		return 0;
+	}
+
+	munmap (buf, length);
+
+	/* Read in each run of pages that has gone */
+	for (off_t i = 0; (i < num_pages) && (spent < budget); i++) {
+		off_t run;
+
+		if (vec[i] & 1)
+			continue;
+
+		for (run = 1; (i + run < num_pages) && ! (vec[i + run] & 1); run++)
+			;
+
+		run = nih_min (run * page_size, budget - spent);
+		load_pages_in_core (fd, start + i * page_size, run);
+
+		spent += run;
+		i += run / page_size;
+	}
+
+	return spent;
+}
@@ -0,0 +1,1152 @@
+/* ureadahead
+ *
+ * server.c - prefetching on request
+ *
+ * Copyright © 2009 Canonical Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
+#include <nih/list.h>
+#include <nih/hash.h>
+#include <nih/logging.h>
+#include <nih/error.h>
+
+#include "server.h"
+#include "pack.h"
+
+
+/**
+ * SERVER_MAX_CLIENTS:
+ *
+ * Number of clients that may be connected at once.
+ **/
+#define SERVER_MAX_CLIENTS 64
+
+/**
+ * SERVER_REQUEST_MAX:
+ *
+ * Longest request line we accept.
+ **/
+#define SERVER_REQUEST_MAX (PATH_MAX + 16)
+
+/**
+ * SERVER_THREADS:
+ *
+ * Number of threads reading on behalf of clients, so that a long request
+ * doesn't hold up the others or the answering of them.
+ **/
+#define SERVER_THREADS 4
+
+
+/**
+ * ServerPack:
+ * @entry: list header,
+ * @filename: path of pack file,
+ * @file: parsed pack,
+ * @mtime: modification time of @filename when parsed,
+ * @critical: TRUE if @file marks any paths as critical,
+ * @reading: TRUE for each phase while a thread is reading it,
+ * @waiters: requests waiting for the phases being read to be answered,
+ * @jobs: number of requests queued, being read or waiting that use @file,
+ * @stale: TRUE once @filename has changed and the last of @jobs is to
+ * free the pack.
+ *
+ * Parsed pack files are kept, by filename, until the file changes.
+ **/
+typedef struct server_pack {
+	NihList   entry;
+	char *    filename;
+	PackFile *file;
+	time_t    mtime;
+	int       critical;
+	int       reading[2];
+	NihList   waiters;
+	int       jobs;
+	int       stale;
+} ServerPack;
+
+/**
+ * ServerClient:
+ * @fd: connected socket, or -1,
+ * @buf: partial request,
+ * @len: length of @buf,
+ * @reply: reply not yet sent, or NULL,
+ * @sent: length of @reply already sent,
+ * @busy: TRUE while a request is being read by a thread,
+ * @serial: incremented whenever the client is closed, so that the answer
+ * to a request of the previous client of the slot is dropped.
+ *
+ * Requests of each client are answered in order, the next one only being
+ * looked at once the answer to the last has been sent.
+ **/
+typedef struct server_client {
+	int          fd;
+	char         buf[SERVER_REQUEST_MAX];
+	size_t       len;
+	char *       reply;
+	size_t       sent;
+	int          busy;
+	unsigned int serial;
+} ServerClient;
+
+/**
+ * ServerJob:
+ * @entry: list header,
+ * @client: client that made the request,
+ * @serial: serial of @client when it made the request,
+ * @pack: pack to read, or NULL,
+ * @phases: bitmask of the phases of @pack to read,
+ * @waiting: bitmask of the phases of @pack being read for other requests,
+ * which this one is answered after,
+ * @path: file to read when @pack is NULL,
+ * @bytes: number of bytes read.
+ *
+ * Request handed to the reading threads, and back again once read; one
+ * with nothing of its own to read waits on the @waiters of its pack.
+ **/
+typedef struct server_job {
+	NihList       entry;
+	ServerClient *client;
+	unsigned int  serial;
+	ServerPack *  pack;
+	int           phases;
+	int           waiting;
+	char *        path;
+	off_t         bytes;
+} ServerJob;
+
+
+/* Prototypes for static functions */
+static void        server_accept   (int sock, ServerClient *clients);
+static int         server_input    (ServerClient *client,
+				    const char *default_pack);
+static int         server_output   (ServerClient *client);
+static void        server_close    (ServerClient *client);
+static char *      server_request  (const void *parent, char *line,
+				    const char *default_pack,
+				    ServerClient *client);
+static ServerPack *server_pack     (const char *filename);
+static void        server_queue    (ServerJob *job);
+static void        server_finish   (void);
+static int         server_waiting  (ServerJob *job);
+static void        server_answer   (ServerJob *job);
+static void *      server_thread   (void *ptr);
+static off_t       prefetch_phase  (ServerPack *pack, int phase);
+static off_t       prefetch_path   (const char *path);
+static int         prefetch_open   (const char *path, off_t *size,
+				    int *slot);
+static void        prefetch_close  (int fd, int slot);
+static off_t       prefetch_range  (int fd, off_t size, off_t offset,
+				    off_t length);
+
+
+/**
+ * packs:
+ *
+ * Parsed pack files, by filename.
+ **/
+static NihHash *packs = NULL;
+
+/**
+ * jobs:
+ *
+ * Requests waiting for a thread to read them, and @done those read and
+ * waiting to be answered; both are protected by @jobs_lock, and @jobs_cond
+ * signalled when a request is queued.
+ **/
+static NihList *        jobs = NULL;
+static NihList *        done = NULL;
+static pthread_mutex_t  jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   jobs_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * wake:
+ *
+ * Pipe written to by the threads when they've put a request on @done,
+ * so that the main loop's select() returns to answer it.
+ **/
+static int wake[2] = { -1, -1 };
+
+/**
+ * reading:
+ *
+ * Device and inode number of the file each thread is reading, with a
+ * zero inode number for a free slot; protected by @reading_lock.  A file
+ * being read by one thread is skipped by the others.
+ **/
+static struct {
+	dev_t dev;
+	ino_t ino;
+} reading[SERVER_THREADS];
+static pthread_mutex_t reading_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * page_size:
+ *
+ * Size of pages, for the threads to check which are in memory.
+ **/
+static long page_size = 0;
+
+
+/**
+ * do_server:
+ * @socket_path: path of control socket,
+ * @default_pack: pack used by requests that don't name one,
+ * @daemonise: TRUE to detach once listening.
+ *
+ * Listens on the Unix socket @socket_path for requests to prefetch,
+ * one per line:
+ *
+ *   pack [PACK]      read all of PACK,
+ *   phase N [PACK]   read the critical (0) or deferred (1) files of PACK,
+ *   path PATH        read all of PATH.
+ *
+ * Each request is answered with "ok KB", the amount read, or "error"
+ * and a message, once what was asked for is in memory.  Packs are kept
+ * parsed in memory; the reading is done by a few threads, and a pack
+ * phase or file that one of them is already reading, or pages already in
+ * memory, aren't read again; a request for a phase already being read is
+ * answered once that read is done.
+ *
+ * Only returns on error.
+ *
+ * Returns: negative value on error.
+ **/
+int
+do_server (const char *socket_path,
+	   const char *default_pack,
+	   int         daemonise)
+{
+	struct sockaddr_un addr;
+	int                sock;
+	ServerClient *     clients;
+
+	nih_assert (socket_path != NULL);
+	nih_assert (default_pack != NULL);
+
+	if (strlen (socket_path) >= sizeof addr.sun_path) {
+		errno = ENAMETOOLONG;
+		nih_return_system_error (-1);
+	}
+
+	memset (&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, socket_path);
+
+	sock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (sock < 0)
+		nih_return_system_error (-1);
+
+	unlink (socket_path);
+
+	if ((bind (sock, (struct sockaddr *)&addr, sizeof addr) < 0)
+	    || (chmod (socket_path, 0600) < 0)
+	    || (listen (sock, SERVER_MAX_CLIENTS) < 0)) {
+		nih_error_raise_system ();
+		close (sock);
+		return -1;
+	}
+
+	/* Detach only once we're listening, so the socket is there as soon
+	 * as we return.
+	 */
+	if (daemonise) {
+		pid_t pid;
+
+		pid = fork ();
+		if (pid < 0) {
+			nih_error_raise_system ();
+			close (sock);
+			return -1;
+		} else if (pid > 0) {
+			_exit (0);
+		}
+	}
+
+	if (pipe2 (wake, O_CLOEXEC | O_NONBLOCK) < 0) {
+		nih_error_raise_system ();
+		close (sock);
+		return -1;
+	}
+
+	page_size = sysconf (_SC_PAGESIZE);
+
+	packs = NIH_MUST (nih_hash_string_new (NULL, 16));
+	jobs = NIH_MUST (nih_list_new (NULL));
+	done = NIH_MUST (nih_list_new (NULL));
+
+	/* Started after any fork, which only the calling thread survives */
+	for (int t = 0; t < SERVER_THREADS; t++) {
+		pthread_t thread;
+		int       ret;
+
+		ret = pthread_create (&thread, NULL, server_thread, NULL);
+		if (ret) {
+			errno = ret;
+			nih_error_raise_system ();
+			close (sock);
+			return -1;
+		}
+
+		pthread_detach (thread);
+	}
+
+	clients = NIH_MUST (nih_alloc (NULL, (sizeof (ServerClient)
+					      * SERVER_MAX_CLIENTS)));
+	for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+		clients[i].fd = -1;
+		clients[i].reply = NULL;
+		clients[i].serial = 0;
+	}
+
+	nih_info ("Listening on %s", socket_path);
+
+	for (;;) {
+		fd_set readfds;
+		fd_set writefds;
+		int    nfds;
+
+		FD_ZERO (&readfds);
+		FD_ZERO (&writefds);
+		FD_SET (sock, &readfds);
+		FD_SET (wake[0], &readfds);
+		nfds = nih_max (sock, wake[0]) + 1;
+
+		/* Clients waiting for an answer aren't read from until
+		 * it's been sent.
+		 */
+		for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+			if (clients[i].fd < 0)
+				continue;
+
+			if (clients[i].reply) {
+				FD_SET (clients[i].fd, &writefds);
+			} else if (! clients[i].busy) {
+				FD_SET (clients[i].fd, &readfds);
+			} else {
+				continue;
+			}
+
+			nfds = nih_max (nfds, clients[i].fd + 1);
+		}
+
+		if (select (nfds, &readfds, &writefds, NULL, NULL) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			nih_return_system_error (-1);
+		}
+
+		if (FD_ISSET (wake[0], &readfds)) {
+			char buf[64];
+
+			while (read (wake[0], buf, sizeof buf) > 0)
+				;
+
+			server_finish ();
+		}
+
+		if (FD_ISSET (sock, &readfds))
+			server_accept (sock, clients);
+
+		for (int i = 0; i < SERVER_MAX_CLIENTS; i++) {
+			ServerClient *client = &clients[i];
+
+			if (client->fd < 0)
+				continue;
+
+			if (FD_ISSET (client->fd, &writefds)
+			    && (server_output (client) < 0)) {
+				server_close (client);
+				continue;
+			}
+
+			if (FD_ISSET (client->fd, &readfds)) {
+				ssize_t len;
+
+				len = read (client->fd, client->buf + client->len,
+					    sizeof client->buf - client->len);
+				if ((len < 0)
+				    && ((errno == EAGAIN) || (errno == EINTR))) {
+					/* Nothing after all */
+				} else if (len <= 0) {
+					server_close (client);
+					continue;
+				} else {
+					client->len += len;
+				}
+			}
+
+			/* Lines may be waiting for the answer to the last */
+			if (server_input (client, default_pack) < 0)
+				server_close (client);
+		}
+	}
+}
+
+
+/**
+ * server_accept:
+ * @sock: listening socket,
+ * @clients: clients.
+ *
+ * Accepts a new client into a free slot of @clients.
+ **/
+static void
+server_accept (int           sock,
+	       ServerClient *clients)
+{
+	int fd;
+	int i;
+
+	nih_assert (clients != NULL);
+
+	fd = accept4 (sock, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0)
+		return;
+
+	for (i = 0; i < SERVER_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0)
+			continue;
+
+		clients[i].fd = fd;
+		clients[i].len = 0;
+		clients[i].sent = 0;
+		clients[i].busy = FALSE;
+		return;
+	}
+
+	nih_warn (_("Too many clients"));
+	close (fd);
+}
+
+/**
+ * server_input:
+ * @client: client,
+ * @default_pack: pack used by requests that don't name one.
+ *
+ * Handles the complete request lines @client has sent, until one has
+ * been handed to a thread or its answer can't be sent straight away.
+ *
+ * Returns: zero on success, negative value if @client should be closed.
+ **/
+static int
+server_input (ServerClient *client,
+	      const char *  default_pack)
+{
+	char *line;
+	char *end;
+
+	nih_assert (client != NULL);
+	nih_assert (default_pack != NULL);
+
+	line = client->buf;
+	while ((! client->busy) && (! client->reply)
+	       && (end = memchr (line, '\n',
+				 client->len - (line - client->buf)))) {
+		*end = '\0';
+
+		client->reply = server_request (NULL, line, default_pack,
+						client);
+		client->sent = 0;
+
+		line = end + 1;
+
+		if (client->reply && (server_output (client) < 0))
+			return -1;
+	}
+
+	client->len -= line - client->buf;
+	memmove (client->buf, line, client->len);
+
+	if ((! client->busy) && (! client->reply)
+	    && (client->len == sizeof client->buf)) {
+		nih_warn (_("Request too long"));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * server_output:
+ * @client: client.
+ *
+ * Sends as much of the answer waiting for @client as its socket will
+ * take without blocking.
+ *
+ * Returns: zero on success, negative value if @client should be closed.
+ **/
+static int
+server_output (ServerClient *client)
+{
+	size_t  len;
+	ssize_t ret;
+
+	nih_assert (client != NULL);
+	nih_assert (client->reply != NULL);
+
+	len = strlen (client->reply);
+
+	ret = send (client->fd, client->reply + client->sent,
+		    len - client->sent, MSG_NOSIGNAL);
+	if (ret < 0)
+		return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+
+	client->sent += ret;
+	if (client->sent == len) {
+		nih_free (client->reply);
+		client->reply = NULL;
+	}
+
+	return 0;
+}
+
+/**
+ * server_close:
+ * @client: client.
+ *
+ * Closes the connection to @client; the answer to any request of it that
+ * a thread is still reading is dropped.
+ **/
+static void
+server_close (ServerClient *client)
+{
+	nih_assert (client != NULL);
+
+	close (client->fd);
+	client->fd = -1;
+	client->busy = FALSE;
+	client->serial++;
+
+	if (client->reply) {
+		nih_free (client->reply);
+		client->reply = NULL;
+	}
+}
+
+
+/**
+ * server_request:
+ * @parent: parent of returned string,
+ * @line: request,
+ * @default_pack: pack used by requests that don't name one,
+ * @client: client making the request.
+ *
+ * Requests to read are handed to the threads, and answered once they're
+ * done; the others, and errors, are answered straight away.
+ *
+ * Returns: newly allocated reply, including the newline, or NULL if the
+ * request has been queued.
+ **/
+static char *
+server_request (const void *  parent,
+		char *        line,
+		const char *  default_pack,
+		ServerClient *client)
+{
+	char *      arg;
+	ServerPack *pack;
+	ServerJob * job;
+	long        phase;
+
+	nih_assert (line != NULL);
+	nih_assert (default_pack != NULL);
+	nih_assert (client != NULL);
+
+	arg = strchr (line, ' ');
+	if (arg)
+		*(arg++) = '\0';
+
+	job = NIH_MUST (nih_new (NULL, ServerJob));
+	nih_list_init (&job->entry);
+
+	job->client = client;
+	job->serial = client->serial;
+	job->pack = NULL;
+	job->phases = 0;
+	job->waiting = 0;
+	job->path = NULL;
+	job->bytes = 0;
+
+	if (! strcmp (line, "path")) {
+		if ((! arg) || (arg[0] != '/')) {
+			nih_free (job);
+			return NIH_MUST (nih_strdup (parent, "error path must be absolute\n"));
+		}
+
+		job->path = NIH_MUST (nih_strdup (job, arg));
+	} else if (! strcmp (line, "pack")) {
+		pack = server_pack (arg && *arg ? arg : default_pack);
+		if (! pack)
+			goto error;
+
+		job->pack = pack;
+		job->phases = 0x03;
+	} else if (! strcmp (line, "phase")) {
+		char *end = NULL;
+
+		phase = arg ? strtol (arg, &end, 10) : -1;
+		if ((! end) || (end == arg) || (phase < 0) || (phase > 1)) {
+			nih_free (job);
+			return NIH_MUST (nih_strdup (parent, "error phase must be 0 or 1\n"));
+		}
+
+		end += strspn (end, " ");
+		pack = server_pack (*end ? end : default_pack);
+		if (! pack)
+			goto error;
+
+		job->pack = pack;
+		job->phases = 1 << phase;
+	} else {
+		nih_free (job);
+		return NIH_MUST (nih_strdup (parent, "error unknown request\n"));
+	}
+
+	/* Phases already being read for another request aren't read again,
+	 * the request is answered once they have been.
+	 */
+	if (job->pack) {
+		for (int p = 0; p < 2; p++) {
+			if ((job->phases & (1 << p)) && job->pack->reading[p]) {
+				job->phases &= ~(1 << p);
+				job->waiting |= 1 << p;
+			}
+		}
+	}
+
+	server_queue (job);
+
+	return NULL;
+
+error:
+	{
+		NihError *err;
+		char *    reply;
+
+		nih_free (job);
+
+		err = nih_error_get ();
+		reply = NIH_MUST (nih_sprintf (parent, "error %s\n", err->message));
+		nih_free (err);
+
+		return reply;
+	}
+}
+
+/**
+ * server_pack:
+ * @filename: path of pack file.
+ *
+ * Looks up the parsed pack for @filename, reading it first if we don't
+ * have it or the file has changed since.
+ *
+ * Returns: pack, or NULL on raised error.
+ **/
+static ServerPack *
+server_pack (const char *filename)
+{
+	ServerPack *pack;
+	struct stat statbuf;
+
+	nih_assert (filename != NULL);
+
+	if (stat (filename, &statbuf) < 0)
+		nih_return_system_error (NULL);
+
+	pack = (ServerPack *)nih_hash_lookup (packs, filename);
+	if (pack && (pack->mtime == statbuf.st_mtime))
+		return pack;
+
+	/* Threads may still be reading the old one, the last of them
+	 * frees it.
+	 */
+	if (pack && pack->jobs) {
+		nih_list_remove (&pack->entry);
+		pack->stale = TRUE;
+	} else if (pack) {
+		nih_free (pack);
+	}
+
+	pack = NIH_MUST (nih_new (packs, ServerPack));
+	nih_list_init (&pack->entry);
+	nih_alloc_set_destructor (pack, nih_list_destroy);
+
+	pack->filename = NIH_MUST (nih_strdup (pack, filename));
+	pack->mtime = statbuf.st_mtime;
+	pack->reading[0] = pack->reading[1] = FALSE;
+	nih_list_init (&pack->waiters);
+	pack->jobs = 0;
+	pack->stale = FALSE;
+
+	pack->file = read_pack (pack, filename, FALSE);
+	if (! pack->file) {
+		nih_free (pack);
+		return NULL;
+	}
+
+	pack->critical = FALSE;
+	for (size_t i = 0; i < pack->file->num_paths; i++)
+		if (pack->file->paths[i].flags & PACK_PATH_CRITICAL)
+			pack->critical = TRUE;
+
+	nih_hash_add (packs, &pack->entry);
+
+	return pack;
+}
+
+/**
+ * server_queue:
+ * @job: request to read.
+ *
+ * Marks what @job reads as being read, and hands it to the threads; if
+ * it has nothing to read of its own, it waits for the phases it asked
+ * for to be read for other requests instead.
+ **/
+static void
+server_queue (ServerJob *job)
+{
+	nih_assert (job != NULL);
+
+	if (job->pack) {
+		for (int p = 0; p < 2; p++)
+			if (job->phases & (1 << p))
+				job->pack->reading[p] = TRUE;
+
+		job->pack->jobs++;
+	}
+
+	job->client->busy = TRUE;
+
+	if (job->pack && (! job->phases)) {
+		nih_list_add (&job->pack->waiters, &job->entry);
+		return;
+	}
+
+	pthread_mutex_lock (&jobs_lock);
+	nih_list_add (jobs, &job->entry);
+	pthread_cond_signal (&jobs_cond);
+	pthread_mutex_unlock (&jobs_lock);
+}
+
+/**
+ * server_finish:
+ *
+ * Answers the requests the threads have finished reading, and marks what
+ * they read as no longer being read.
+ **/
+static void
+server_finish (void)
+{
+	NihList finished;
+
+	nih_list_init (&finished);
+
+	pthread_mutex_lock (&jobs_lock);
+	NIH_LIST_FOREACH_SAFE (done, iter)
+		nih_list_add (&finished, iter);
+	pthread_mutex_unlock (&jobs_lock);
+
+	NIH_LIST_FOREACH_SAFE (&finished, iter) {
+		ServerJob *job = (ServerJob *)iter;
+
+		if (job->pack) {
+			for (int p = 0; p < 2; p++)
+				if (job->phases & (1 << p))
+					job->pack->reading[p] = FALSE;
+
+			/* Answer the requests that were waiting for these
+			 * phases; this one still counts towards the pack,
+			 * so it can't be freed under us.
+			 */
+			NIH_LIST_FOREACH_SAFE (&job->pack->waiters, witer) {
+				ServerJob *waiter = (ServerJob *)witer;
+
+				if (! server_waiting (waiter))
+					server_answer (waiter);
+			}
+
+			/* Phases another request is reading may not be
+			 * done yet.
+			 */
+			if (server_waiting (job)) {
+				nih_list_add (&job->pack->waiters, &job->entry);
+				continue;
+			}
+		}
+
+		server_answer (job);
+	}
+}
+
+/**
+ * server_waiting:
+ * @job: request.
+ *
+ * Returns: TRUE if any of the phases @job is waiting for are still being
+ * read for other requests.
+ **/
+static int
+server_waiting (ServerJob *job)
+{
+	nih_assert (job != NULL);
+	nih_assert (job->pack != NULL);
+
+	for (int p = 0; p < 2; p++)
+		if ((job->waiting & (1 << p)) && (! job->pack->reading[p]))
+			job->waiting &= ~(1 << p);
+
+	return job->waiting != 0;
+}
+
+/**
+ * server_answer:
+ * @job: request that has been read.
+ *
+ * Answers @job, unless its client has gone, and frees it along with its
+ * pack if that was the last request using a pack that has changed.
+ **/
+static void
+server_answer (ServerJob *job)
+{
+	nih_assert (job != NULL);
+
+	if (job->pack && (! --job->pack->jobs) && job->pack->stale)
+		nih_free (job->pack);
+
+	/* The client may have gone, and its slot been reused */
+	if ((job->client->fd >= 0)
+	    && (job->client->serial == job->serial)) {
+		job->client->busy = FALSE;
+		job->client->reply = NIH_MUST (nih_sprintf (
+			NULL, "ok %zu\n", (size_t)job->bytes / 1024));
+		job->client->sent = 0;
+	}
+
+	nih_list_remove (&job->entry);
+	nih_free (job);
+}
+
+/**
+ * server_thread:
+ * @ptr: unused.
+ *
+ * Reads the requests queued by server_queue(), handing each back on
+ * @done.  Threads never raise errors, since libnih's aren't thread safe;
+ * files that can't be read are skipped.
+ **/
+static void *
+server_thread (void *ptr)
+{
+	for (;;) {
+		ServerJob *job;
+
+		pthread_mutex_lock (&jobs_lock);
+		while (NIH_LIST_EMPTY (jobs))
+			pthread_cond_wait (&jobs_cond, &jobs_lock);
+
+		job = (ServerJob *)jobs->next;
+		nih_list_remove (&job->entry);
+		pthread_mutex_unlock (&jobs_lock);
+
+		if (job->pack) {
+			for (int p = 0; p < 2; p++)
+				if (job->phases & (1 << p))
+					job->bytes += prefetch_phase (job->pack, p);
+		} else {
+			job->bytes = prefetch_path (job->path);
+		}
+
+		pthread_mutex_lock (&jobs_lock);
+		nih_list_add (done, &job->entry);
+		pthread_mutex_unlock (&jobs_lock);
+
+		if (write (wake[1], "", 1) < 0) {
+			/* A full pipe will wake the main loop anyway */
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * prefetch_phase:
+ * @pack: pack,
+ * @phase: 0 for critical files, 1 for the rest.
+ *
+ * Packs without critical files have all of them in the first phase.
+ *
+ * Returns: number of bytes read.
+ **/
+static off_t
+prefetch_phase (ServerPack *pack,
+		int         phase)
+{
+	PackFile *file;
+	size_t    pathidx = (size_t)-1;
+	int       fd = -1;
+	int       slot = -1;
+	off_t     size = 0;
+	off_t     bytes = 0;
+
+	nih_assert (pack != NULL);
+	nih_assert ((phase == 0) || (phase == 1));
+
+	file = pack->file;
+	for (size_t i = 0; i < file->num_blocks; i++) {
+		int critical;
+
+		if (file->blocks[i].pathidx >= file->num_paths)
+			continue;
+
+		critical = ((! pack->critical)
+			    || (file->paths[file->blocks[i].pathidx].flags
+				& PACK_PATH_CRITICAL));
+		if (critical != (phase == 0))
+			continue;
+
+		if (file->blocks[i].pathidx != pathidx) {
+			if (fd >= 0)
+				prefetch_close (fd, slot);
+
+			pathidx = file->blocks[i].pathidx;
+			fd = prefetch_open (file->paths[pathidx].path,
+					    &size, &slot);
+		}
+
+		if (fd < 0)
+			continue;
+
+		bytes += prefetch_range (fd, size, file->blocks[i].offset,
+					 file->blocks[i].length);
+	}
+
+	if (fd >= 0)
+		prefetch_close (fd, slot);
+
+	return bytes;
+}
+
+/**
+ * prefetch_path:
+ * @path: file to read.
+ *
+ * Reads all of @path that isn't already in memory, unless another thread
+ * is reading it.
+ *
+ * Returns: number of bytes read.
+ **/
+static off_t
+prefetch_path (const char *path)
+{
+	int   fd;
+	int   slot;
+	off_t size;
+	off_t bytes;
+
+	nih_assert (path != NULL);
+
+	fd = prefetch_open (path, &size, &slot);
+	if (fd < 0)
+		return 0;
+
+	bytes = prefetch_range (fd, size, 0, size);
+
+	prefetch_close (fd, slot);
+
+	return bytes;
+}
+
+/**
+ * prefetch_open:
+ * @path: file to read,
+ * @size: set to size of @path,
+ * @slot: set to entry of reading claimed for it.
+ *
+ * Opens @path for the calling thread to read, unless it isn't a regular
+ * file with something in it, or another thread is reading it; the same
+ * file may be asked for by different names, so it's known by its device
+ * and inode number.
+ *
+ * Returns: open file descriptor, to be closed with prefetch_close(), or
+ * -1 if @path isn't to be read.
+ **/
+static int
+prefetch_open (const char *path,
+	       off_t *     size,
+	       int *       slot)
+{
+	struct stat statbuf;
+	int         fd;
+
+	nih_assert (path != NULL);
+	nih_assert (size != NULL);
+	nih_assert (slot != NULL);
+
+	fd = open (path, O_RDONLY | O_NOATIME);
+	if (fd < 0)
+		return -1;
+
+	if ((fstat (fd, &statbuf) < 0)
+	    || (! S_ISREG (statbuf.st_mode))
+	    || (! statbuf.st_size)) {
+		close (fd);
+		return -1;
+	}
+
+	*size = statbuf.st_size;
+	*slot = -1;
+
+	pthread_mutex_lock (&reading_lock);
+	for (int i = 0; i < SERVER_THREADS; i++) {
+		if ((reading[i].dev == statbuf.st_dev)
+		    && (reading[i].ino == statbuf.st_ino)) {
+			*slot = -1;
+			break;
+		} else if ((*slot < 0) && (! reading[i].ino)) {
+			*slot = i;
+		}
+	}
+	if (*slot >= 0) {
+		reading[*slot].dev = statbuf.st_dev;
+		reading[*slot].ino = statbuf.st_ino;
+	}
+	pthread_mutex_unlock (&reading_lock);
+
+	if (*slot < 0) {
+		close (fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * prefetch_close:
+ * @fd: file descriptor from prefetch_open(),
+ * @slot: entry of reading it claimed.
+ *
+ * Closes @fd, letting other threads read the file again.
+ **/
+static void
+prefetch_close (int fd,
+		int slot)
+{
+	nih_assert (fd >= 0);
+	nih_assert ((slot >= 0) && (slot < SERVER_THREADS));
+
+	pthread_mutex_lock (&reading_lock);
+	reading[slot].dev = 0;
+	reading[slot].ino = 0;
+	pthread_mutex_unlock (&reading_lock);
+
+	close (fd);
+}
+
+/**
+ * prefetch_range:
+ * @fd: file to read,
+ * @size: size of file,
+ * @offset: offset of range,
+ * @length: length of range.
+ *
+ * Reads the pages of the range that aren't already in memory, as found
+ * by mincore() on a temporary mapping of it; if it can't be mapped, all
+ * of it is read.  The reads are waited for, so that the request is only
+ * answered, and a later one only finds the pages in memory, once they
+ * really are.
+ *
+ * Returns: number of bytes read.
+ **/
+static off_t
+prefetch_range (int   fd,
+		off_t size,
+		off_t offset,
+		off_t length)
+{
+	off_t                    start;
+	off_t                    end;
+	off_t                    num_pages;
+	void *                   buf;
+	nih_local unsigned char *vec = NULL;
+	off_t                    bytes = 0;
+	int                      ret;
+
+	start = offset - (offset % page_size);
+	end = nih_min (offset + length, size);
+	if (end <= start)
+		return 0;
+
+	buf = mmap (NULL, end - start, PROT_READ, MAP_SHARED, fd, start);
+	if (buf == MAP_FAILED) {
+		warm_pages_in_core (fd, start, end - start);
+		return end - start;
+	}
+
+	num_pages = (end - start - 1) / page_size + 1;
+	vec = NIH_MUST (nih_alloc (NULL, num_pages));
+
+	ret = mincore (buf, end - start, vec);
+	munmap (buf, end - start);
+
+	if (ret < 0) {
+		warm_pages_in_core (fd, start, end - start);
+		return end - start;
+	}
+
+	for (off_t i = 0; i < num_pages; i++) {
+		off_t run_start;
+		off_t run_end;
+
+		if (vec[i] & 1)
+			continue;
+
+		run_start = start + i * page_size;
+		while (((i + 1) < num_pages) && (! (vec[i + 1] & 1)))
+			i++;
+		run_end = nih_min (start + (i + 1) * page_size, end);
+
+		warm_pages_in_core (fd, run_start, run_end - run_start);
+		bytes += run_end - run_start;
+	}
+
+	return bytes;
+}
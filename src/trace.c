@@ -32,20 +32,21 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
 #include <sys/param.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-#include <blkid.h>
-#define NO_INLINE_FUNCS
-#include <ext2fs.h>
-
 #include <linux/fs.h>
 #include <linux/fiemap.h>
 
@@ -62,6 +63,10 @@
 #include "pack.h"
 #include "values.h"
 #include "file.h"
+#include "model.h"
+#include "meta.h"
+#include "rawtrace.h"
+#include "fantrace.h"
 
 
 /**
@@ -87,11 +92,306 @@
 #define PATH_TRACEFS     "/sys/kernel/tracing"
 
 /**
- * INODE_GROUP_PRELOAD_THRESHOLD:
+ * TRACE_INSTANCE:
+ *
+ * Tracing instance, relative to the tracing directory, that we trace in
+ * so as to leave the settings and buffer of the top level to others.
+ **/
+#define TRACE_INSTANCE "instances/ureadahead"
+
+/**
+ * REPLAY_COMM:
+ *
+ * Process name given to the process reading the old pack while we trace,
+ * so that its opens can be told apart from those of the boot.
+ **/
+#define REPLAY_COMM "ureadahead-ra"
+
+/**
+ * PATH_TRACE_STATS:
+ *
+ * File in which the trace buffer size to use, and the number of events
+ * the last trace lost, are kept between traces.
+ **/
+#define PATH_TRACE_STATS "/var/lib/ureadahead/trace.stats"
+
+/**
+ * TRACE_BUFFER_KB:
+ *
+ * Total size of the trace buffers of all CPUs when we've no better idea.
+ **/
+#define TRACE_BUFFER_KB 8192
+
+/**
+ * TRACE_BUFFER_MAX_KB:
+ *
+ * Largest size of each CPU's trace buffer we'll grow to after events are
+ * lost.
+ **/
+#define TRACE_BUFFER_MAX_KB 65536
+
+/**
+ * TRACE_DRAIN_INTERVAL:
+ *
+ * Milliseconds between reads of the trace buffers while tracing.
+ **/
+#define TRACE_DRAIN_INTERVAL 250
+
+/**
+ * TraceProbe:
+ * @name: name of the event in the ureadahead group,
+ * @definition: dynamic event definition,
+ * @exit: exit event of the system call, or NULL.
+ *
+ * Events added where the kernel lacks the fs open events: eprobes on
+ * the entry of the system calls that open files, copying the filename
+ * from user memory, paired with their exit events so that only files
+ * that were actually opened end up in the pack.
+ *
+ * Files opened through io_uring are caught with a kprobe on the
+ * preparation of its openat requests; that needs the symbol to exist,
+ * and whether the open succeeds isn't known.
+ **/
+typedef struct trace_probe {
+	const char *name;
+	const char *definition;
+	const char *exit;
+} TraceProbe;
+
+static const TraceProbe trace_probes[] = {
+	{ "openat",
+	  "e:ureadahead/openat syscalls/sys_enter_openat"
+	  " filename=+0($filename):ustring",
+	  "events/syscalls/sys_exit_openat/enable" },
+	{ "openat2",
+	  "e:ureadahead/openat2 syscalls/sys_enter_openat2"
+	  " filename=+0($filename):ustring",
+	  "events/syscalls/sys_exit_openat2/enable" },
+	{ "execve",
+	  "e:ureadahead/execve syscalls/sys_enter_execve"
+	  " filename=+0($filename):ustring",
+	  "events/syscalls/sys_exit_execve/enable" },
+	{ "execveat",
+	  "e:ureadahead/execveat syscalls/sys_enter_execveat"
+	  " filename=+0($filename):ustring",
+	  "events/syscalls/sys_exit_execveat/enable" },
+	{ "io_openat",
+	  "p:ureadahead/io_openat io_openat_prep"
+	  " filename=+0(+16($arg2)):ustring",
+	  NULL },
+};
+
+/**
+ * TRACE_NUM_PROBES:
+ *
+ * Number of entries in trace_probes.
+ **/
+#define TRACE_NUM_PROBES (sizeof trace_probes / sizeof trace_probes[0])
+
+/**
+ * trace_open_events:
+ *
+ * Events that report the name of a file opened, all in a field named
+ * filename, when the fs events are used.
+ **/
+static const char *trace_open_events[] = {
+	"do_sys_open",
+	"open_exec",
+	"uselib",
+};
+
+/**
+ * ignore_prefixes:
+ *
+ * Files under these directories are never put in the pack.
+ **/
+static const char *ignore_prefixes[] = {
+	"/proc/",
+	"/sys/",
+	"/dev/",
+	"/tmp/",
+	"/run/",
+	"/var/run/",
+	"/var/log/",
+	"/var/lock/",
+};
+
+/**
+ * TraceFaults:
+ * @faults: pages added to the page cache while tracing, in order of
+ * device and inode and then of time,
+ * @num_faults: number of entries in @faults.
+ *
+ * Pages read while tracing, when those are what's put in the pack rather
+ * than the pages in memory once tracing stops.
+ **/
+typedef struct trace_faults {
+	RawFault *faults;
+	size_t    num_faults;
+} TraceFaults;
+
+/**
+ * TRACE_READ_SIZE:
+ *
+ * Size of the blocks the text trace is read in.
+ **/
+#define TRACE_READ_SIZE (256 * 1024)
+
+/**
+ * TRACE_BENCHMARK_RUNS:
+ *
+ * Number of times trace_benchmark() parses the trace, taking the best.
+ **/
+#define TRACE_BENCHMARK_RUNS 5
+
+/**
+ * TraceTextHandler:
+ * @data: data pointer given to trace_parse_text(),
+ * @path: path of file opened, which may be modified,
+ * @timestamp: time of the open in seconds, if asked for.
+ **/
+typedef void (*TraceTextHandler) (void *data, char *path, double timestamp);
+
+/**
+ * TRACE_NUM_THREADS:
+ *
+ * Number of threads looking up the files opened once tracing has stopped;
+ * they spend most of their time waiting on the filesystem.
+ **/
+#define TRACE_NUM_THREADS 8
+
+/**
+ * TRACE_BATCH_SIZE:
+ *
+ * Number of paths, in order of path, each of those threads takes at a
+ * time, so that paths in the same directory mostly go to the same one.
+ **/
+#define TRACE_BATCH_SIZE 32
+
+/**
+ * TracePath:
+ * @entry: list header for the hash of paths queued,
+ * @path: path as traced,
+ * @critical: TRUE if first opened within the critical time,
+ * @resolved: path to record, which may have been rewritten with the path
+ * prefix,
+ * @add: TRUE if the path is to be added to a pack,
+ * @message: untranslated warning about the path, or NULL,
+ * @errnum: error behind @message, or zero,
+ * @dev: device the file is on,
+ * @ino: inode of the file,
+ * @fs_type: statfs() type of its filesystem, or zero if unknown,
+ * @flags: PACK_PATH_SEQUENTIAL or PACK_PATH_RANDOM, as it was read,
+ * @blocks: blocks of the file to read, their path index not yet set,
+ * @num_blocks: number of entries in @blocks.
+ *
+ * A unique path opened while tracing, and what a thread found out when
+ * looking it up; the threads touch nothing else, so their results can be
+ * merged into the packs in the order the paths were first opened.
+ **/
+typedef struct trace_path {
+	NihList     entry;
+	char *      path;
+	int         critical;
+	const char *resolved;
+	int         add;
+	const char *message;
+	int         errnum;
+	dev_t       dev;
+	ino_t       ino;
+	long        fs_type;
+	int         flags;
+	PackBlock * blocks;
+	size_t      num_blocks;
+} TracePath;
+
+/**
+ * TraceQueue:
+ * @paths: hash of paths queued,
+ * @items: each path, in the order first opened,
+ * @num_items: number of entries in @items,
+ * @max_items: number of entries allocated in @items,
+ * @events: path of each open, in order,
+ * @num_events: number of entries in @events,
+ * @max_events: number of entries allocated in @events.
+ *
+ * Paths opened, gathered as a trace is read to be looked up together by
+ * trace_resolve() once it has been.
+ **/
+typedef struct trace_queue {
+	NihHash *    paths;
+	TracePath ** items;
+	size_t       num_items;
+	size_t       max_items;
+	TracePath ** events;
+	size_t       num_events;
+	size_t       max_events;
+} TraceQueue;
+
+/**
+ * TraceResolveCtx:
+ * @order: paths to look up, in order of path,
+ * @num_paths: number of entries in @order,
+ * @idx: next entry of @order to be taken,
+ * @path_prefix: path prefix to prepend,
+ * @force_ssd_mode: TRUE to force SSD mode,
+ * @faults: pages read while tracing, or NULL.
+ **/
+typedef struct trace_resolve_ctx {
+	TracePath **            order;
+	size_t                  num_paths;
+	size_t                  idx;
+	const PathPrefixOption *path_prefix;
+	int                     force_ssd_mode;
+	const TraceFaults *     faults;
+} TraceResolveCtx;
+
+/**
+ * TraceTextCtx:
+ * @queue: queue to add paths to,
+ * @path_prefix_filter: path prefix that files must match,
+ * @critical_time: seconds from the first open for files to be critical,
+ * @first: time of the first open.
+ *
+ * What read_trace() passes to trace_event() for each open in the text
+ * trace.
+ **/
+typedef struct trace_text_ctx {
+	TraceQueue *queue;
+	const char *path_prefix_filter;
+	int         critical_time;
+	double      first;
+} TraceTextCtx;
+
+/**
+ * RANDOM_MIN_SIZE:
  *
- * Number of inodes in a group before we preload that inode's blocks.
+ * Files smaller than this are never considered to be read at random,
+ * since reading all of them costs little more than reading part.
  **/
-#define INODE_GROUP_PRELOAD_THRESHOLD 8
+#define RANDOM_MIN_SIZE (1024 * 1024)
+
+/**
+ * RANDOM_RUN_PAGES:
+ *
+ * Average length, in pages, of the runs of a file read at random.
+ **/
+#define RANDOM_RUN_PAGES 4
+
+/**
+ * QUEUE_READ_AHEAD_KB_MAX:
+ *
+ * Largest read_ahead_kb we'll ask for while the pack is read, there's
+ * no point going past the largest request load_pages_in_core() makes.
+ **/
+#define QUEUE_READ_AHEAD_KB_MAX 2048
+
+/**
+ * QUEUE_NR_REQUESTS_MAX:
+ *
+ * Largest nr_requests we'll ask for while the pack is read.
+ **/
+#define QUEUE_NR_REQUESTS_MAX 1024
 
 
 /* Prototypes for static functions */
@@ -99,25 +399,156 @@ static int       read_trace        (const void *parent,
 				    int dfd, const char *path,
 				    const char *path_prefix_filter,
 				    const PathPrefixOption *path_prefix,
-				    PackFile **files, size_t *num_files, int force_ssd_mode);
+				    PackFile **files, size_t *num_files, int force_ssd_mode,
+				    int critical_time, Model *model);
+static void      read_raw_trace    (const void *parent, RawTrace *raw,
+				    pid_t replay_pid,
+				    const char *path_prefix_filter,
+				    const PathPrefixOption *path_prefix,
+				    PackFile **files, size_t *num_files, int force_ssd_mode,
+				    int critical_time, Model *model, int trace_pages);
+static void      read_fan_trace    (const void *parent, FanTrace *fan,
+				    pid_t replay_pid,
+				    const char *path_prefix_filter,
+				    const PathPrefixOption *path_prefix,
+				    PackFile **files, size_t *num_files, int force_ssd_mode,
+				    int critical_time, Model *model);
+static void      trace_event       (TraceQueue *queue, char *path,
+				    double timestamp, double *first,
+				    const char *path_prefix_filter,
+				    int critical_time);
+static int       trace_replayed    (pid_t replay_pid, pid_t tgid,
+				    const char *comm);
+static int       trace_fault_compar (const void *a, const void *b);
+static int       trace_open_instance (int root_dfd);
+static void      trace_remove_instance (int root_dfd);
+static char *    trace_filter      (const void *parent,
+				    const char *path_prefix_filter);
+static void      trace_set_filters (int dfd, const char *path_prefix_filter,
+				    int probes);
+static int       trace_add_probes  (int root_dfd, int dfd,
+				    int *old_exit_enabled);
+static void      trace_remove_probes (int root_dfd, int dfd,
+				      const int *old_exit_enabled);
+static void      trace_start_thread (pthread_t *thread,
+				     void *(*func) (void *), void *arg);
+static void *    trace_drain       (void *ptr);
+static void *    trace_fan         (void *ptr);
+static unsigned long long trace_cpu_time (void);
+static void      trace_report_overhead (void);
+static int       trace_buffer_size (size_t num_cpus);
+static void      trace_write_buffer_size (int buffer_size_kb,
+					  unsigned long overruns);
+static void      read_trace_event  (void *data, char *path, double timestamp);
+static ssize_t   trace_parse_text  (int fd, int timestamps,
+				    TraceTextHandler handler, void *data);
+static void      trace_parse_line  (char *line, char *end, int timestamps,
+				    TraceTextHandler handler, void *data);
+static void      trace_benchmark_event (void *data, char *path,
+					double timestamp);
+static double    trace_timestamp   (const char *line, const char *event);
 static void      fix_path          (char *pathname);
-static int       trace_add_path    (const void *parent, const char *pathname,
-				    PackFile **files, size_t *num_files, int force_ssd_mode);
+static TraceQueue *trace_queue_new (const void *parent);
+static void      trace_queue_path  (TraceQueue *queue, const char *pathname,
+				    int critical);
+static void      trace_resolve     (const void *parent, TraceQueue *queue,
+				    const PathPrefixOption *path_prefix,
+				    PackFile **files, size_t *num_files, int force_ssd_mode,
+				    Model *model, const TraceFaults *faults);
+static int       trace_path_compar (const void *a, const void *b);
+static void *    trace_resolve_thread (void *ptr);
+static void      trace_resolve_path (TraceResolveCtx *ctx, TracePath *item,
+				     int *dfd, char *dirname);
+static void      trace_add_path    (const void *parent, TracePath *item,
+				    PackFile **files, size_t *num_files, int force_ssd_mode,
+				    NihHash *path_hash, NihHash *inode_hash);
 static int       ignore_path       (const char *pathname);
+static int       trace_rotational  (dev_t dev, int force_ssd_mode);
 static PackFile *trace_file        (const void *parent, dev_t dev,
 				    PackFile **files, size_t *num_files, int force_ssd_mode);
-static int       trace_add_chunks  (const void *parent,
-				    PackFile *file, PackPath *path,
-				    int fd, off_t size);
-static int       trace_add_extents (const void *parent,
-				    PackFile *file, PackPath *path,
-				    int fd, off_t size,
+static int       trace_add_chunks  (TracePath *item, int rotational,
+				    int fd, off_t size, const TraceFaults *faults);
+static int       trace_mincore     (TracePath *item, int fd, off_t size,
+				    unsigned char *vec);
+static void      trace_add_chunk   (TracePath *item, int rotational, int fd,
 				    off_t offset, off_t length);
-static int       trace_add_groups  (const void *parent, PackFile *file);
+static int       trace_add_extents (TracePath *item, int fd,
+				    off_t offset, off_t length);
+static struct fiemap *trace_fiemap (const void *parent, int fd,
+				    off_t offset, off_t length);
+static void      trace_add_directories (const void *parent, PackFile *file);
+static void      trace_tune_queue  (PackFile *file, const char *scheduler);
 static int       trace_sort_blocks (const void *parent, PackFile *file);
 static int       trace_sort_paths  (const void *parent, PackFile *file);
 
 
+/**
+ * drain_stop:
+ *
+ * Set to stop the thread reading the trace buffers while tracing.
+ **/
+static volatile int drain_stop = FALSE;
+
+/**
+ * TraceOverhead:
+ * @measured: TRUE if the tracer's cost was measured,
+ * @events: number of opens it reported,
+ * @cpu_ns: CPU time we spent reading and resolving them, in nanoseconds.
+ *
+ * What each tracer cost us, so they can be compared when both are used;
+ * the time the kernel spends generating the events isn't included.
+ **/
+typedef struct trace_overhead {
+	int                measured;
+	size_t             events;
+	unsigned long long cpu_ns;
+} TraceOverhead;
+
+static TraceOverhead tracefs_overhead;
+static TraceOverhead fanotify_overhead;
+
+
+/**
+ * trace_open_tracefs:
+ * @unmount: set to TRUE if debugfs was mounted to get at it.
+ *
+ * Returns: open tracing directory or negative value on raised error.
+ **/
+static int
+trace_open_tracefs (int *unmount)
+{
+	int dfd;
+
+	nih_assert (unmount != NULL);
+
+	dfd = open (PATH_TRACEFS, O_NOFOLLOW | O_RDONLY | O_NOATIME);
+	if (dfd < 0) {
+		if (errno != ENOENT)
+			nih_return_system_error (-1);
+
+		/* Mount debugfs (and implicitly tracefs) if not already mounted */
+		dfd = open (PATH_DEBUGFS "/tracing", O_NOFOLLOW | O_RDONLY | O_NOATIME);
+	}
+	if (dfd < 0) {
+		if (errno != ENOENT)
+			nih_return_system_error (-1);
+
+		if (mount ("none", PATH_DEBUGFS_TMP, "debugfs", 0, NULL) < 0)
+			nih_return_system_error (-1);
+
+		dfd = open (PATH_DEBUGFS_TMP "/tracing", O_NOFOLLOW | O_RDONLY | O_NOATIME);
+		if (dfd < 0) {
+			nih_error_raise_system ();
+			umount (PATH_DEBUGFS_TMP);
+			return -1;
+		}
+
+		*unmount = TRUE;
+	}
+
+	return dfd;
+}
+
 static void
 sig_interrupt (int signum)
 {
@@ -131,16 +562,26 @@ trace (int daemonise,
        const char *path_prefix_filter,
        const PathPrefixOption *path_prefix,
        int use_existing_trace_events,
-       int force_ssd_mode)
+       int force_ssd_mode,
+       int critical_time,
+       const char *queue_scheduler,
+       PackFile *replay,
+       const ReadaheadOptions *replay_options,
+       int learn,
+       int trace_pages,
+       TracerOption tracer)
 {
-	int                 dfd;
+	int                 root_dfd = -1;
+	int                 dfd = -1;
 	FILE                *fp;
 	int                 unmount = FALSE;
 	int                 old_sys_open_enabled = 0;
 	int                 old_open_exec_enabled = 0;
 	int                 old_uselib_enabled = 0;
+	int                 old_filemap_enabled = -1;
 	int                 old_tracing_enabled = 0;
 	int                 old_buffer_size_kb = 0;
+	int                 old_record_tgid = -1;
 	struct sigaction    act;
 	struct sigaction    old_sigterm;
 	struct sigaction    old_sigint;
@@ -148,78 +589,142 @@ trace (int daemonise,
 	nih_local PackFile *files = NULL;
 	size_t              num_files = 0;
 	size_t              num_cpus = 0;
+	pid_t               replay_pid = 0;
+	nih_local Model *   model = NULL;
+	nih_local RawTrace *raw = NULL;
+	pthread_t           drain_thread;
+	nih_local FanTrace *fan = NULL;
+	pthread_t           fan_thread;
+	int                 buffer_size_kb;
+	unsigned long       overruns;
+	int                 probes = FALSE;
+	int                 old_exit_enabled[TRACE_NUM_PROBES];
+
+	/* Pages read are only reported by a trace event */
+	if (trace_pages && (tracer == TRACER_FANOTIFY)) {
+		nih_warn ("%s", _("Unable to trace pages read without tracefs"));
+		trace_pages = FALSE;
+	}
 
-	dfd = open (PATH_TRACEFS, O_NOFOLLOW | O_RDONLY | O_NOATIME);
-	if (dfd < 0) {
-		if (errno != ENOENT)
-			nih_return_system_error (-1);
+	/* Opens are traced with the kernel's trace events, with fanotify,
+	 * or with both to compare them.
+	 */
+	if (tracer != TRACER_FANOTIFY) {
+		root_dfd = trace_open_tracefs (&unmount);
+		if (root_dfd < 0)
+			return -1;
 
-		/* Mount debugfs (and implicitly tracefs) if not already mounted */
-		dfd = open (PATH_DEBUGFS "/tracing", O_NOFOLLOW | O_RDONLY | O_NOATIME);
+		/* Trace in an instance of our own where we can, unless
+		 * we're to use the events already enabled at the top level.
+		 */
+		if (! use_existing_trace_events)
+			dfd = trace_open_instance (root_dfd);
+		if (dfd < 0)
+			dfd = root_dfd;
 	}
-	if (dfd < 0) {
-		if (errno != ENOENT)
-			nih_return_system_error (-1);
-
-		if (mount ("none", PATH_DEBUGFS_TMP, "debugfs", 0, NULL) < 0)
-			nih_return_system_error (-1);
 
-		dfd = open (PATH_DEBUGFS_TMP "/tracing", O_NOFOLLOW | O_RDONLY | O_NOATIME);
-		if (dfd < 0) {
-			nih_error_raise_system ();
-			umount (PATH_DEBUGFS_TMP);
-			return -1;
+	if (dfd >= 0) {
+		/*
+		 * Count the number of CPUs, default to 1 on error. 
+		 */
+		fp = fopen("/proc/cpuinfo", "r");
+		if (fp) {
+			int line_size=1024;
+			char *processor="processor";
+			char *line = malloc(line_size);
+			if (line) {
+				num_cpus = 0;
+				while (fgets(line,line_size,fp) != NULL) {
+					if (!strncmp(line,processor,strlen(processor)))
+						num_cpus++;
+				}
+				free(line);
+				nih_message("Counted %zu CPUs\n",num_cpus);
+			}
+			fclose(fp);
 		}
+		if (!num_cpus)
+			num_cpus = 1;
 
-		unmount = TRUE;
-	}
+		if (! use_existing_trace_events) {
+			/* Enable tracing of open() syscalls, with our own events
+			 * on kernels without the fs ones.
+			 */
+			if (set_value (dfd, "events/fs/do_sys_open/enable",
+				       TRUE, &old_sys_open_enabled) < 0) {
+				NihError *err;
 
-	/*
-	 * Count the number of CPUs, default to 1 on error. 
-	 */
-	fp = fopen("/proc/cpuinfo", "r");
-	if (fp) {
-		int line_size=1024;
-		char *processor="processor";
-		char *line = malloc(line_size);
-		if (line) {
-			num_cpus = 0;
-			while (fgets(line,line_size,fp) != NULL) {
-				if (!strncmp(line,processor,strlen(processor)))
-					num_cpus++;
+				err = nih_error_get ();
+				if (err->number != ENOENT) {
+					nih_error_raise_error (err);
+					goto error;
+				}
+				nih_free (err);
+
+				if (trace_add_probes (root_dfd, dfd,
+						      old_exit_enabled) < 0)
+					goto error;
+
+				probes = TRUE;
+			} else if (set_value (dfd, "events/fs/open_exec/enable",
+					      TRUE, &old_open_exec_enabled) < 0) {
+				goto error;
+			} else if (set_value (dfd, "events/fs/uselib/enable",
+					      TRUE, &old_uselib_enabled) < 0) {
+				NihError *err;
+
+				err = nih_error_get ();
+				nih_debug ("Missing uselib tracing: %s", err->message);
+				nih_free (err);
+
+				old_uselib_enabled = -1;
 			}
-			free(line);
-			nih_message("Counted %zu CPUs\n",num_cpus);
+
+			/* Filters in our own instance affect nobody else */
+			if (dfd != root_dfd)
+				trace_set_filters (dfd, path_prefix_filter, probes);
 		}
-		fclose(fp);
-	}
-	if (!num_cpus)
-		num_cpus = 1;
+		/* Capture the pages read as well, rather than taking those in
+		 * memory once we stop.
+		 */
+		if (trace_pages && (! use_existing_trace_events)
+		    && (set_value (dfd, "events/filemap/mm_filemap_add_to_page_cache/enable",
+				   TRUE, &old_filemap_enabled) < 0)) {
+			NihError *err;
 
-	if (! use_existing_trace_events) {
-		/* Enable tracing of open() syscalls */
-		if (set_value (dfd, "events/fs/do_sys_open/enable",
-			       TRUE, &old_sys_open_enabled) < 0)
-			goto error;
- 		if (set_value (dfd, "events/fs/open_exec/enable",
-			       TRUE, &old_open_exec_enabled) < 0)
-			goto error;
- 		if (set_value (dfd, "events/fs/uselib/enable",
-			       TRUE, &old_uselib_enabled) < 0) {
+			err = nih_error_get ();
+			nih_warn ("%s: %s", _("Unable to trace pages read"),
+				  err->message);
+			nih_free (err);
+
+			old_filemap_enabled = -1;
+			trace_pages = FALSE;
+		}
+
+		/* The threads of our replay are told apart by the process
+		 * they belong to, which the kernel only keeps when asked to;
+		 * it only keeps the names of the last few processes.
+		 */
+		if (replay
+		    && (set_value (root_dfd, "options/record-tgid",
+				   TRUE, &old_record_tgid) < 0)) {
 			NihError *err;
 
 			err = nih_error_get ();
-			nih_debug ("Missing uselib tracing: %s", err->message);
+			nih_debug ("Missing thread group recording: %s",
+				   err->message);
 			nih_free (err);
 
-			old_uselib_enabled = -1;
+			old_record_tgid = -1;
 		}
+
+		buffer_size_kb = trace_buffer_size (num_cpus);
+		if (set_value (dfd, "buffer_size_kb", buffer_size_kb, &old_buffer_size_kb) < 0)
+			goto error;
+		if (set_value (dfd, "tracing_on",
+			       TRUE, &old_tracing_enabled) < 0)
+			goto error;
 	}
-	if (set_value (dfd, "buffer_size_kb", 8192/num_cpus, &old_buffer_size_kb) < 0)
-		goto error;
-	if (set_value (dfd, "tracing_on",
-		       TRUE, &old_tracing_enabled) < 0)
-		goto error;
 
 	if (daemonise) {
 		pid_t pid;
@@ -233,6 +738,83 @@ trace (int daemonise,
 		}
 	}
 
+	/* Read the old pack while we trace, from a separate process with
+	 * a name we can recognise and ignore in the trace.
+	 */
+	if (replay) {
+		replay_pid = fork ();
+		if (replay_pid < 0) {
+			nih_warn ("%s: %s", _("Unable to read pack while tracing"),
+				  strerror (errno));
+			replay_pid = 0;
+		} else if (replay_pid == 0) {
+			ReadaheadOptions options;
+
+			prctl (PR_SET_NAME, REPLAY_COMM, 0, 0, 0);
+
+			/* We kill the replay when we stop tracing, before
+			 * it could put back any queue settings it changed.
+			 */
+			options = *replay_options;
+			options.keep_queue = TRUE;
+
+			if (do_readahead (replay, FALSE, &options) < 0) {
+				NihError *err;
+
+				err = nih_error_get ();
+				nih_warn ("%s: %s", _("Error while reading"),
+					  err->message);
+				nih_free (err);
+
+				_exit (1);
+			}
+
+			_exit (0);
+		}
+	}
+
+	/* Read the trace while we wait, so the buffers needn't hold all of
+	 * it.
+	 */
+	raw = (dfd >= 0) ? raw_trace_open (NULL, dfd) : NULL;
+	if (raw) {
+		drain_stop = FALSE;
+		trace_start_thread (&drain_thread, trace_drain, raw);
+	} else if (dfd >= 0) {
+		NihError *err;
+
+		/* Our own events need pairing up, and page events
+		 * decoding, which only the binary reader does.
+		 */
+		err = nih_error_get ();
+		if (probes || trace_pages) {
+			nih_warn ("%s: %s", _("Unable to read binary trace"),
+				  err->message);
+		} else {
+			nih_debug ("Reading binary trace: %s", err->message);
+		}
+		nih_free (err);
+	}
+
+	/* fanotify reports the opens on each mounted filesystem without
+	 * any tracefs, and is read by a thread of its own.
+	 */
+	if (tracer != TRACER_TRACEFS) {
+		fan = fan_trace_open (NULL);
+		if (fan) {
+			trace_start_thread (&fan_thread, trace_fan, fan);
+		} else if (tracer == TRACER_FANOTIFY) {
+			goto error;
+		} else {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_warn ("%s: %s", _("Unable to trace with fanotify"),
+				  err->message);
+			nih_free (err);
+		}
+	}
+
 	/* Sleep until we get signals */
 	act.sa_handler = sig_interrupt;
 	sigemptyset (&act.sa_mask);
@@ -253,53 +835,150 @@ trace (int daemonise,
 	sigaction (SIGTERM, &old_sigterm, NULL);
 	sigaction (SIGINT, &old_sigint, NULL);
 
-	/* Restore previous tracing settings */
-	if (set_value (dfd, "tracing_on",
-		       old_tracing_enabled, NULL) < 0)
-		goto error;
-	if (! use_existing_trace_events) {
-		if (old_uselib_enabled >= 0)
-			if (set_value (dfd, "events/fs/uselib/enable",
-				       old_uselib_enabled, NULL) < 0)
-				goto error;
-		if (set_value (dfd, "events/fs/open_exec/enable",
-			       old_open_exec_enabled, NULL) < 0)
+	if (raw) {
+		drain_stop = TRUE;
+		pthread_join (drain_thread, NULL);
+	}
+	if (fan) {
+		fan_trace_stop (fan);
+		pthread_join (fan_thread, NULL);
+	}
+
+	/* Anything the replay hasn't finished by now is too late anyway,
+	 * and it may be holding pinned pages.
+	 */
+	if (replay_pid > 0) {
+		kill (replay_pid, SIGTERM);
+		waitpid (replay_pid, NULL, 0);
+	}
+
+	if (dfd >= 0) {
+		/* Restore previous tracing settings */
+		if (set_value (dfd, "tracing_on",
+			       old_tracing_enabled, NULL) < 0)
+			goto error;
+		if ((old_record_tgid >= 0)
+		    && (set_value (root_dfd, "options/record-tgid",
+				   old_record_tgid, NULL) < 0))
 			goto error;
-		if (set_value (dfd, "events/fs/do_sys_open/enable",
-			       old_sys_open_enabled, NULL) < 0)
+
+		/* Grow the buffers for next time if they still weren't big enough */
+		overruns = raw_trace_overruns (dfd);
+		if (overruns) {
+			nih_warn (_("%lu trace events were lost, the trace buffer was too small"),
+				  overruns);
+			buffer_size_kb = nih_min (buffer_size_kb * 2, TRACE_BUFFER_MAX_KB);
+		}
+		trace_write_buffer_size (buffer_size_kb, overruns);
+		if ((old_filemap_enabled >= 0)
+		    && (set_value (dfd, "events/filemap/mm_filemap_add_to_page_cache/enable",
+				   old_filemap_enabled, NULL) < 0))
 			goto error;
+		if (probes) {
+			trace_remove_probes (root_dfd, dfd, old_exit_enabled);
+		} else if (! use_existing_trace_events) {
+			if (old_uselib_enabled >= 0)
+				if (set_value (dfd, "events/fs/uselib/enable",
+					       old_uselib_enabled, NULL) < 0)
+					goto error;
+			if (set_value (dfd, "events/fs/open_exec/enable",
+				       old_open_exec_enabled, NULL) < 0)
+				goto error;
+			if (set_value (dfd, "events/fs/do_sys_open/enable",
+				       old_sys_open_enabled, NULL) < 0)
+				goto error;
+		}
 	}
 
 	/* Be nicer */
 	if (nice (15))
 		;
 
-	/* Read trace log */
-	if (read_trace (NULL, dfd, "trace", path_prefix_filter, path_prefix,
-			&files, &num_files, force_ssd_mode) < 0)
-		goto error;
-
-	/*
-	 * Restore the trace buffer size (which has just been read) and free
-	 * a bunch of memory.
+	/* Learn from the order files were opened in as well, on top of
+	 * what was learned from previous traces.
 	 */
-	if (set_value (dfd, "buffer_size_kb", old_buffer_size_kb, NULL) < 0)
-		goto error;
+	if (learn) {
+		model = model_read (NULL, PATH_MODEL);
+		if (! model) {
+			NihError *err;
 
-	/* Unmount the temporary debugfs mount if we mounted it */
-	if (close (dfd)) {
-		nih_error_raise_system ();
-		goto error;
+			err = nih_error_get ();
+			nih_warn ("%s: %s", PATH_MODEL, err->message);
+			nih_free (err);
+		}
 	}
-	if (unmount
-	    && (umount (PATH_DEBUGFS_TMP) < 0)) {
-		nih_error_raise_system ();
-		goto error;
+
+	/* Read trace log, from the binary buffers where we can; when both
+	 * tracers ran, the pack comes from tracefs and fanotify is only
+	 * measured.
+	 */
+	if (fan) {
+		read_fan_trace (NULL, fan, replay_pid, path_prefix_filter,
+				path_prefix,
+				(tracer == TRACER_FANOTIFY) ? &files : NULL,
+				&num_files, force_ssd_mode, critical_time, model);
+
+		nih_free (fan);
+		fan = NULL;
+	}
+
+	if (raw) {
+		read_raw_trace (NULL, raw, replay_pid, path_prefix_filter,
+				path_prefix, &files, &num_files, force_ssd_mode,
+				critical_time, model, trace_pages);
+
+		nih_free (raw);
+		raw = NULL;
+	} else if ((dfd >= 0)
+		   && (read_trace (NULL, dfd, "trace", path_prefix_filter,
+				   path_prefix, &files, &num_files,
+				   force_ssd_mode, critical_time, model) < 0)) {
+		goto error;
+	}
+
+	trace_report_overhead ();
+
+	if (dfd >= 0) {
+		/*
+		 * Restore the trace buffer size (which has just been read) and free
+		 * a bunch of memory; removing our own instance frees its buffers.
+		 */
+		if (dfd != root_dfd) {
+			close (dfd);
+			dfd = root_dfd;
+
+			trace_remove_instance (root_dfd);
+		} else if (set_value (dfd, "buffer_size_kb", old_buffer_size_kb, NULL) < 0) {
+			goto error;
+		}
+
+		/* Unmount the temporary debugfs mount if we mounted it */
+		dfd = -1;
+		if (close (root_dfd)) {
+			root_dfd = -1;
+			nih_error_raise_system ();
+			goto error;
+		}
+		root_dfd = -1;
+		if (unmount
+		    && (umount (PATH_DEBUGFS_TMP) < 0)) {
+			nih_error_raise_system ();
+			goto error;
+		}
+	}
+
+	if (model && (model_write (model, PATH_MODEL) < 0)) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_warn ("%s: %s", PATH_MODEL, err->message);
+		nih_free (err);
 	}
 
 	/* Write out pack files */
 	for (size_t i = 0; i < num_files; i++) {
-		nih_local char *filename = NULL;
+		nih_local char *  filename = NULL;
+		const MetaPlugin *plugin;
 		if (pack_file) {
 			filename = NIH_MUST (nih_strdup (NULL, pack_file));
 		} else {
@@ -326,20 +1005,29 @@ trace (int daemonise,
 		}
 		nih_info ("Writing %s", filename);
 
+		/* Have the filesystem's plugin record the metadata needed
+		 * to open the files, such as the inode groups to preload,
+		 * along with the directory blocks where the filesystem
+		 * will look for them in the block device's page cache.
+		 */
+		plugin = meta_plugin (files[i].fs_type);
+		if (plugin && plugin->trace)
+			plugin->trace (files, &files[i]);
+
+		if (plugin && plugin->bdev_directories)
+			trace_add_directories (files, &files[i]);
+
 		/* We only need to apply additional sorting to the
 		 * HDD-optimised packs, the SSD ones can read in random
 		 * order quite happily.
-		 *
-		 * Also for HDD, generate the inode group preloading
-		 * array.
 		 */
 		if (files[i].rotational) {
-			trace_add_groups (files, &files[i]);
-
 			trace_sort_blocks (files, &files[i]);
 			trace_sort_paths (files, &files[i]);
 		}
 
+		trace_tune_queue (&files[i], queue_scheduler);
+
 		write_pack (filename, &files[i]);
 
 		if (nih_log_priority < NIH_LOG_MESSAGE)
@@ -348,7 +1036,15 @@ trace (int daemonise,
 
 	return 0;
 error:
-	close (dfd);
+	if (probes)
+		trace_remove_probes (root_dfd, dfd, old_exit_enabled);
+
+	if (dfd != root_dfd) {
+		close (dfd);
+		trace_remove_instance (root_dfd);
+	}
+	if (root_dfd >= 0)
+		close (root_dfd);
 	if (unmount)
 		umount (PATH_DEBUGFS_TMP);
 
@@ -364,11 +1060,14 @@ read_trace (const void *parent,
 	    const PathPrefixOption *path_prefix,
 	    PackFile ** files,
 	    size_t *    num_files,
-	    int         force_ssd_mode)
+	    int         force_ssd_mode,
+	    int         critical_time,
+	    Model *     model)
 {
-	int   fd;
-	FILE *fp;
-	char *line;
+	nih_local TraceQueue *queue = NULL;
+	TraceTextCtx          ctx;
+	int                   fd;
+	ssize_t               len;
 
 	nih_assert (path != NULL);
 	nih_assert (path_prefix != NULL);
@@ -379,216 +1078,1391 @@ read_trace (const void *parent,
 	if (fd < 0)
 		nih_return_system_error (-1);
 
-	fp = fdopen (fd, "r");
-	if (! fp) {
-		nih_error_raise_system ();
-		close (fd);
+	queue = trace_queue_new (NULL);
+
+	ctx.queue = queue;
+	ctx.path_prefix_filter = path_prefix_filter;
+	ctx.critical_time = critical_time;
+	ctx.first = -1.0;
+
+	/* Paths opened within critical_time seconds of the first one are
+	 * marked critical, if asked.
+	 */
+	len = trace_parse_text (fd, critical_time, read_trace_event, &ctx);
+	close (fd);
+	if (len < 0)
 		return -1;
+
+	trace_resolve (parent, queue, path_prefix, files, num_files,
+		       force_ssd_mode, model, NULL);
+
+	return 0;
+}
+
+static void
+read_trace_event (void * data,
+		  char * path,
+		  double timestamp)
+{
+	TraceTextCtx *ctx = data;
+
+	nih_assert (ctx != NULL);
+
+	trace_event (ctx->queue, path, timestamp, &ctx->first,
+		     ctx->path_prefix_filter, ctx->critical_time);
+}
+
+/**
+ * trace_parse_text:
+ * @fd: open text trace,
+ * @timestamps: TRUE if the time of each open is wanted,
+ * @handler: function to call for each file opened,
+ * @data: data pointer to pass to @handler.
+ *
+ * Reads the text trace from @fd in large blocks, splitting it into lines
+ * in place, and calls @handler with the path of each file opened, which
+ * points into the block and is only valid for the call.  Nothing is
+ * allocated per line.
+ *
+ * Returns: number of bytes read, or negative value on raised error.
+ **/
+static ssize_t
+trace_parse_text (int              fd,
+		  int              timestamps,
+		  TraceTextHandler handler,
+		  void *           data)
+{
+	nih_local char *buf = NULL;
+	size_t          size = TRACE_READ_SIZE;
+	size_t          len = 0;
+	size_t          total = 0;
+	int             eof = FALSE;
+
+	nih_assert (handler != NULL);
+
+	buf = NIH_MUST (nih_alloc (NULL, size + 1));
+
+	while (! eof) {
+		ssize_t ret;
+		char *  line;
+		char *  end;
+		char *  nl;
+
+		ret = read (fd, buf + len, size - len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			nih_return_system_error (-1);
+		}
+
+		eof = (ret == 0);
+		len += ret;
+		total += ret;
+
+		line = buf;
+		end = buf + len;
+		while ((nl = memchr (line, '\n', end - line)) != NULL) {
+			*nl = '\0';
+			trace_parse_line (line, nl, timestamps, handler, data);
+			line = nl + 1;
+		}
+
+		if (eof && (line < end)) {
+			*end = '\0';
+			trace_parse_line (line, end, timestamps, handler, data);
+			line = end;
+		}
+
+		/* Keep the start of a line that runs into the next block,
+		 * making room if it fills this one.
+		 */
+		len = end - line;
+		if (len && (line != buf))
+			memmove (buf, line, len);
+
+		if (len == size) {
+			size *= 2;
+			buf = NIH_MUST (nih_realloc (buf, NULL, size + 1));
+		}
 	}
 
-	while ((line = fgets_alloc (NULL, fp)) != NULL) {
-		char *ptr;
-		char *end;
-
-		ptr = strstr (line, " do_sys_open:");
-		if (! ptr)
-			ptr = strstr (line, " open_exec:");
-		if (! ptr)
-			ptr = strstr (line, " uselib:");
-		if (! ptr) {
-			nih_free (line);
+	return total;
+}
+
+/**
+ * trace_parse_line:
+ * @line: line of the text trace,
+ * @end: terminating nul of @line,
+ * @timestamps: TRUE if the time of the open is wanted,
+ * @handler: function to call if the line is an open,
+ * @data: data pointer to pass to @handler.
+ *
+ * Events are named by a word ending in a colon after the timestamp; each
+ * colon is checked once for any of trace_open_events, rather than the
+ * line being searched for each of them in turn.  The path follows in
+ * quotes.
+ **/
+static void
+trace_parse_line (char *           line,
+		  char *           end,
+		  int              timestamps,
+		  TraceTextHandler handler,
+		  void *           data)
+{
+	char * ptr;
+	char * event = NULL;
+	char * quote;
+	double timestamp = 0.0;
+
+	nih_assert (line != NULL);
+	nih_assert (end != NULL);
+
+	/* Lines start with the task name and pid; ignore those of our own
+	 * replay of the old pack.
+	 */
+	ptr = line + strspn (line, " ");
+	if (! strncmp (ptr, REPLAY_COMM "-", strlen (REPLAY_COMM) + 1))
+		return;
+
+	for (ptr = line; (ptr = memchr (ptr, ':', end - ptr)) != NULL; ptr++) {
+		char *word;
+
+		for (word = ptr; (word > line) && (word[-1] != ' '); word--)
+			;
+		if (word == line)
 			continue;
+
+		for (size_t i = 0; i < sizeof trace_open_events / sizeof trace_open_events[0]; i++) {
+			if ((strlen (trace_open_events[i]) == (size_t)(ptr - word))
+			    && (! memcmp (word, trace_open_events[i], ptr - word))) {
+				event = word - 1;
+				break;
+			}
 		}
+		if (event)
+			break;
+	}
+	if (! event)
+		return;
 
-		ptr = strchr (ptr, '"');
-		if (! ptr) {
-			nih_free (line);
-			continue;
+	if (timestamps)
+		timestamp = trace_timestamp (line, event);
+
+	ptr = memchr (event, '"', end - event);
+	if (! ptr)
+		return;
+
+	ptr++;
+
+	quote = memrchr (ptr, '"', end - ptr);
+	if (! quote)
+		return;
+
+	*quote = '\0';
+
+	handler (data, ptr, timestamp);
+}
+
+/**
+ * trace_benchmark:
+ * @filename: text trace saved from the kernel.
+ *
+ * Parses @filename as a trace several times over, fixing up each path as
+ * tracing would, and reports the best throughput; no files are looked at
+ * and nothing is written.
+ *
+ * Returns: zero on success, negative value on raised error.
+ **/
+int
+trace_benchmark (const char *filename)
+{
+	double best = 0.0;
+	size_t bytes = 0;
+	size_t opens = 0;
+	int    fd;
+
+	nih_assert (filename != NULL);
+
+	fd = open (filename, O_RDONLY);
+	if (fd < 0)
+		nih_return_system_error (-1);
+
+	for (int i = 0; i < TRACE_BENCHMARK_RUNS; i++) {
+		struct timespec start;
+		struct timespec finish;
+		ssize_t         len;
+		double          secs;
+
+		opens = 0;
+
+		if (lseek (fd, 0, SEEK_SET) < 0) {
+			nih_error_raise_system ();
+			close (fd);
+			return -1;
+		}
+
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		len = trace_parse_text (fd, TRUE, trace_benchmark_event, &opens);
+		clock_gettime (CLOCK_MONOTONIC, &finish);
+		if (len < 0) {
+			close (fd);
+			return -1;
 		}
 
-		ptr++;
+		bytes = len;
+		secs = ((finish.tv_sec - start.tv_sec)
+			+ (finish.tv_nsec - start.tv_nsec) / 1000000000.0);
+		if ((i == 0) || (secs < best))
+			best = secs;
+	}
+
+	close (fd);
+
+	nih_message (_("%zu bytes, %zu opens parsed in %.3fs (%.1f MB/s, %.0f opens/s)"),
+		     bytes, opens, best,
+		     best > 0.0 ? bytes / best / 1048576.0 : 0.0,
+		     best > 0.0 ? opens / best : 0.0);
+
+	return 0;
+}
+
+static void
+trace_benchmark_event (void * data,
+		       char * path,
+		       double timestamp)
+{
+	size_t *opens = data;
+
+	nih_assert (opens != NULL);
+
+	fix_path (path);
+	(*opens)++;
+}
+
+/**
+ * read_raw_trace:
+ *
+ * As read_trace(), but from the binary per-CPU trace buffers opened as
+ * @raw, including any events already read from them while tracing; this
+ * avoids the kernel formatting every event as text only for us to parse
+ * it back again.
+ **/
+static void
+read_raw_trace (const void *parent,
+		RawTrace *  raw,
+		pid_t       replay_pid,
+		const char *path_prefix_filter,  /* May be null */
+		const PathPrefixOption *path_prefix,
+		PackFile ** files,
+		size_t *    num_files,
+		int         force_ssd_mode,
+		int         critical_time,
+		Model *     model,
+		int         trace_pages)
+{
+	nih_local RawEvent *events = NULL;
+	size_t              num_events = 0;
+	nih_local RawFault *faults = NULL;
+	size_t              num_faults = 0;
+	TraceFaults         trace_faults;
+	nih_local TraceQueue *queue = NULL;
+	double              first = -1.0;
+	unsigned long long  start;
+
+	nih_assert (raw != NULL);
+	nih_assert (path_prefix != NULL);
+	nih_assert (files != NULL);
+	nih_assert (num_files != NULL);
+
+	start = trace_cpu_time ();
+	raw_trace_events (NULL, raw, &events, &num_events,
+			  trace_pages ? &faults : NULL, &num_faults);
+
+	tracefs_overhead.measured = TRUE;
+	tracefs_overhead.events = num_events;
+	tracefs_overhead.cpu_ns = (raw_trace_cpu_time (raw)
+				   + trace_cpu_time () - start);
+
+	/* Pages are looked up by file, and only for files the boot itself
+	 * opened; those our own replay read are kept, since the boot found
+	 * them already cached and so never read them itself.
+	 */
+	if (trace_pages) {
+		qsort (faults, num_faults, sizeof (RawFault),
+		       trace_fault_compar);
+
+		trace_faults.faults = faults;
+		trace_faults.num_faults = num_faults;
+
+		nih_info ("Read %zu page cache events", num_faults);
+	}
 
-		end = strrchr (ptr, '"');
-		if (! end) {
-			nih_free (line);
+	queue = trace_queue_new (NULL);
+
+	for (size_t i = 0; i < num_events; i++) {
+		/* Ignore our own replay of the old pack */
+		if (trace_replayed (replay_pid, events[i].tgid,
+				    events[i].comm))
 			continue;
-		}
 
-		*end = '\0';
+		trace_event (queue, events[i].path,
+			     events[i].timestamp / 1000000000.0, &first,
+			     path_prefix_filter, critical_time);
+	}
 
-		fix_path (ptr);
+	trace_resolve (parent, queue, path_prefix, files, num_files,
+		       force_ssd_mode, model,
+		       trace_pages ? &trace_faults : NULL);
+}
 
-		if (path_prefix_filter &&
-		    strncmp (ptr, path_prefix_filter,
-			     strlen (path_prefix_filter))) {
-			nih_warn ("Skipping %s due to path prefix filter", ptr);
+/**
+ * read_fan_trace:
+ * @parent: parent object for new array,
+ * @fan: fanotify trace,
+ * @replay_pid: process reading the old pack, or zero,
+ * @path_prefix_filter: path prefix that files must match,
+ * @path_prefix: path prefix to prepend,
+ * @files: pointer to array of packs, or NULL,
+ * @num_files: pointer to number of packs,
+ * @force_ssd_mode: TRUE to force SSD mode,
+ * @critical_time: seconds from the first open for files to be critical,
+ * @model: model to learn open order into, or NULL.
+ *
+ * As read_raw_trace(), but from the opens reported by fanotify.  When
+ * @files is NULL the opens are only resolved, to measure what that costs.
+ **/
+static void
+read_fan_trace (const void *parent,
+		FanTrace *  fan,
+		pid_t       replay_pid,
+		const char *path_prefix_filter,  /* May be null */
+		const PathPrefixOption *path_prefix,
+		PackFile ** files,
+		size_t *    num_files,
+		int         force_ssd_mode,
+		int         critical_time,
+		Model *     model)
+{
+	nih_local RawEvent *  events = NULL;
+	size_t                num_events = 0;
+	nih_local TraceQueue *queue = NULL;
+	double                first = -1.0;
+	unsigned long long    start;
+
+	nih_assert (fan != NULL);
+	nih_assert (path_prefix != NULL);
+	nih_assert (num_files != NULL);
+
+	start = trace_cpu_time ();
+	fan_trace_events (NULL, fan, &events, &num_events);
+
+	fanotify_overhead.measured = TRUE;
+	fanotify_overhead.events = num_events;
+	fanotify_overhead.cpu_ns += trace_cpu_time () - start;
+
+	if (! files)
+		return;
+
+	queue = trace_queue_new (NULL);
+
+	for (size_t i = 0; i < num_events; i++) {
+		/* Ignore our own replay of the old pack */
+		if (replay_pid && (events[i].pid == replay_pid))
 			continue;
+
+		trace_event (queue, events[i].path,
+			     events[i].timestamp / 1000000000.0, &first,
+			     path_prefix_filter, critical_time);
+	}
+
+	trace_resolve (parent, queue, path_prefix, files, num_files,
+		       force_ssd_mode, model, NULL);
+}
+
+/**
+ * trace_replayed:
+ * @replay_pid: process reading the old pack, or zero,
+ * @tgid: process of the thread behind an event, or zero if not known,
+ * @comm: name of that thread, or NULL if not known.
+ *
+ * Events of our own replay of the old pack are recognised by the process
+ * their thread belongs to; only where the kernel didn't record that is
+ * the name relied on, which it may well have forgotten.
+ *
+ * Returns: TRUE if the event came from the replay.
+ **/
+static int
+trace_replayed (pid_t       replay_pid,
+		pid_t       tgid,
+		const char *comm)
+{
+	if (tgid)
+		return replay_pid && (tgid == replay_pid);
+
+	return comm && (! strcmp (comm, REPLAY_COMM));
+}
+
+static int
+trace_fault_compar (const void *a,
+		    const void *b)
+{
+	const RawFault *fault_a = a;
+	const RawFault *fault_b = b;
+
+	nih_assert (fault_a != NULL);
+	nih_assert (fault_b != NULL);
+
+	/* Faults are already in time order, which breaks ties */
+	if (fault_a->dev < fault_b->dev) {
+		return -1;
+	} else if (fault_a->dev > fault_b->dev) {
+		return 1;
+	} else if (fault_a->ino < fault_b->ino) {
+		return -1;
+	} else if (fault_a->ino > fault_b->ino) {
+		return 1;
+	} else if (fault_a->timestamp < fault_b->timestamp) {
+		return -1;
+	} else if (fault_a->timestamp > fault_b->timestamp) {
+		return 1;
+	} else if (fault_a->index < fault_b->index) {
+		return -1;
+	} else if (fault_a->index > fault_b->index) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+/**
+ * trace_open_instance:
+ * @root_dfd: top-level tracing directory.
+ *
+ * Creates a tracing instance of our own, with its own buffers, events
+ * and tracing_on, so that tracing doesn't disturb anyone else using the
+ * top level during boot.  One left behind by a trace that didn't finish
+ * is replaced, so as not to read its events.
+ *
+ * Returns: open instance directory, or negative value if instances
+ * aren't available.
+ **/
+static int
+trace_open_instance (int root_dfd)
+{
+	int dfd;
+
+	if ((mkdirat (root_dfd, TRACE_INSTANCE, 0750) < 0)
+	    && ((errno != EEXIST)
+		|| (unlinkat (root_dfd, TRACE_INSTANCE, AT_REMOVEDIR) < 0)
+		|| (mkdirat (root_dfd, TRACE_INSTANCE, 0750) < 0))) {
+		nih_debug ("%s: %s", TRACE_INSTANCE, strerror (errno));
+		return -1;
+	}
+
+	dfd = openat (root_dfd, TRACE_INSTANCE,
+		      O_NOFOLLOW | O_RDONLY | O_DIRECTORY);
+	if (dfd < 0) {
+		nih_debug ("%s: %s", TRACE_INSTANCE, strerror (errno));
+		trace_remove_instance (root_dfd);
+		return -1;
+	}
+
+	return dfd;
+}
+
+/**
+ * trace_remove_instance:
+ * @root_dfd: top-level tracing directory.
+ *
+ * Removes the instance created by trace_open_instance(), along with its
+ * buffers, once nothing has it open.
+ **/
+static void
+trace_remove_instance (int root_dfd)
+{
+	if (unlinkat (root_dfd, TRACE_INSTANCE, AT_REMOVEDIR) < 0)
+		nih_warn ("%s: %s", _("Unable to remove tracing instance"),
+			  strerror (errno));
+}
+
+/**
+ * trace_filter:
+ * @parent: parent of returned string,
+ * @path_prefix_filter: path prefix that files must match, or NULL.
+ *
+ * Builds an event filter that leaves out opens of files that would be
+ * ignored anyway, so that they don't take up room in the trace buffers.
+ * Paths containing // or /. might mean something else once fixed up, so
+ * are always kept.
+ *
+ * Returns: newly allocated filter expression.
+ **/
+static char *
+trace_filter (const void *parent,
+	      const char *path_prefix_filter)
+{
+	nih_local char *ignored = NULL;
+	char *          filter;
+
+	for (size_t i = 0; i < sizeof ignore_prefixes / sizeof ignore_prefixes[0]; i++) {
+		if (ignored) {
+			NIH_MUST (nih_strcat_sprintf (&ignored, NULL,
+						      " || filename ~ \"%s*\"",
+						      ignore_prefixes[i]));
+		} else {
+			ignored = NIH_MUST (nih_sprintf (NULL, "filename ~ \"%s*\"",
+							 ignore_prefixes[i]));
+		}
+	}
+
+	/* A prefix that can't be matched literally is left to be checked
+	 * once the trace is read.
+	 */
+	if (path_prefix_filter
+	    && (! strpbrk (path_prefix_filter, "\"\\*?[]"))) {
+		filter = NIH_MUST (nih_sprintf (parent, "filename ~ \"*/.*\""
+						" || filename ~ \"*//*\""
+						" || (filename ~ \"%s*\""
+						" && !(%s))",
+						path_prefix_filter, ignored));
+	} else {
+		filter = NIH_MUST (nih_sprintf (parent, "filename ~ \"*/.*\""
+						" || filename ~ \"*//*\""
+						" || !(%s)", ignored));
+	}
+
+	return filter;
+}
+
+/**
+ * trace_set_filters:
+ * @dfd: tracing instance,
+ * @path_prefix_filter: path prefix that files must match, or NULL,
+ * @probes: TRUE if our own events are used rather than the fs ones.
+ *
+ * Sets the filter from trace_filter() on each event naming the files
+ * opened.  Kernels that can't take it trace every open as before, and
+ * those opens are still ignored when the trace is read.
+ **/
+static void
+trace_set_filters (int         dfd,
+		   const char *path_prefix_filter,
+		   int         probes)
+{
+	nih_local char *filter = NULL;
+	size_t          num_events;
+
+	filter = trace_filter (NULL, path_prefix_filter);
+	nih_debug ("Filtering opens with: %s", filter);
+
+	num_events = (probes ? TRACE_NUM_PROBES
+		      : sizeof trace_open_events / sizeof trace_open_events[0]);
+	for (size_t i = 0; i < num_events; i++) {
+		nih_local char *path = NULL;
+
+		if (probes) {
+			path = NIH_MUST (nih_sprintf (NULL, "events/ureadahead/%s/filter",
+						      trace_probes[i].name));
+		} else {
+			path = NIH_MUST (nih_sprintf (NULL, "events/fs/%s/filter",
+						      trace_open_events[i]));
+		}
+
+		if (set_string (dfd, path, filter) < 0) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_debug ("%s: %s", path, err->message);
+			nih_free (err);
 		}
+	}
+}
+
+/**
+ * trace_add_probes:
+ * @root_dfd: top-level tracing directory, where events are defined,
+ * @dfd: tracing directory or instance to enable them in,
+ * @old_exit_enabled: set to previous values of the exit events.
+ *
+ * Adds and enables the events in trace_probes, along with the exit
+ * events of their system calls; those that can't be added on this kernel
+ * are skipped.
+ *
+ * Returns: zero if at least the openat events could be enabled, negative
+ * value on raised error.
+ **/
+static int
+trace_add_probes (int  root_dfd,
+		  int  dfd,
+		  int *old_exit_enabled)
+{
+	nih_assert (old_exit_enabled != NULL);
+
+	for (size_t i = 0; i < TRACE_NUM_PROBES; i++)
+		old_exit_enabled[i] = -1;
+
+	/* A run that was killed leaves its events defined, and defining
+	 * them again fails, so get rid of any first.
+	 */
+	trace_remove_probes (root_dfd, dfd, old_exit_enabled);
+
+	for (size_t i = 0; i < TRACE_NUM_PROBES; i++) {
+		const TraceProbe *probe = &trace_probes[i];
+		nih_local char *  path = NULL;
 
-		if (path_prefix->st_dev != NODEV && ptr[0] == '/') {
-			struct stat stbuf;
-			char *rewritten = nih_sprintf (
-			    line, "%s%s", path_prefix->prefix, ptr);
-			if (! lstat (rewritten, &stbuf) &&
-			    stbuf.st_dev == path_prefix->st_dev) {
-				/* If |rewritten| exists on the same device as
-				 * path_prefix->st_dev, record the rewritten one
-				 * instead of the original path.
-				 */
-				ptr = rewritten;
+		path = NIH_MUST (nih_sprintf (NULL, "events/ureadahead/%s/enable",
+					      probe->name));
+
+		if ((set_string (root_dfd, "dynamic_events", probe->definition) < 0)
+		    || (set_value (dfd, path, TRUE, NULL) < 0)
+		    || (probe->exit
+			&& (set_value (dfd, probe->exit, TRUE,
+				       &old_exit_enabled[i]) < 0))) {
+			NihError *err;
+
+			err = nih_error_get ();
+			if (i == 0) {
+				trace_remove_probes (root_dfd, dfd,
+						     old_exit_enabled);
+				nih_error_raise_error (err);
+				return -1;
 			}
+
+			nih_debug ("Missing %s tracing: %s", probe->name,
+				   err->message);
+			nih_free (err);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * trace_remove_probes:
+ * @root_dfd: top-level tracing directory,
+ * @dfd: tracing directory or instance they were enabled in,
+ * @old_exit_enabled: previous values of the exit events.
+ *
+ * Disables and removes the events added by trace_add_probes(), putting
+ * back the exit events as they were.
+ **/
+static void
+trace_remove_probes (int        root_dfd,
+		     int        dfd,
+		     const int *old_exit_enabled)
+{
+	nih_assert (old_exit_enabled != NULL);
+
+	for (size_t i = 0; i < TRACE_NUM_PROBES; i++) {
+		const TraceProbe *probe = &trace_probes[i];
+		nih_local char *  path = NULL;
+		nih_local char *  removal = NULL;
+
+		if (probe->exit && (old_exit_enabled[i] >= 0)
+		    && (set_value (dfd, probe->exit, old_exit_enabled[i],
+				   NULL) < 0)) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_free (err);
 		}
-		trace_add_path (parent, ptr, files, num_files, force_ssd_mode);
 
-		nih_free (line);  /* also frees |rewritten| */
+		path = NIH_MUST (nih_sprintf (NULL, "events/ureadahead/%s/enable",
+					      probe->name));
+		removal = NIH_MUST (nih_sprintf (NULL, "-:ureadahead/%s",
+						 probe->name));
+
+		if ((set_value (dfd, path, FALSE, NULL) < 0)
+		    || (set_string (root_dfd, "dynamic_events", removal) < 0)) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_free (err);
+		}
+	}
+}
+
+/**
+ * trace_start_thread:
+ * @thread: set to new thread,
+ * @func: function for it to run,
+ * @arg: argument to @func.
+ *
+ * Starts a thread to read a trace while we wait; it mustn't take the
+ * signals we're waiting for.
+ **/
+static void
+trace_start_thread (pthread_t *thread,
+		    void *(*func) (void *),
+		    void *     arg)
+{
+	sigset_t mask;
+	sigset_t old_mask;
+
+	nih_assert (thread != NULL);
+	nih_assert (func != NULL);
+
+	sigemptyset (&mask);
+	sigaddset (&mask, SIGTERM);
+	sigaddset (&mask, SIGINT);
+	pthread_sigmask (SIG_BLOCK, &mask, &old_mask);
+
+	pthread_create (thread, NULL, func, arg);
+
+	pthread_sigmask (SIG_SETMASK, &old_mask, NULL);
+}
+
+static void *
+trace_drain (void *ptr)
+{
+	RawTrace *      raw = ptr;
+	struct timespec interval;
+
+	interval.tv_sec = 0;
+	interval.tv_nsec = TRACE_DRAIN_INTERVAL * 1000000L;
+
+	while (! drain_stop) {
+		raw_trace_drain (raw);
+		nanosleep (&interval, NULL);
+	}
+
+	return NULL;
+}
+
+static void *
+trace_fan (void *ptr)
+{
+	FanTrace *fan = ptr;
+
+	fan_trace_read (fan);
+
+	fanotify_overhead.cpu_ns += trace_cpu_time ();
+
+	return NULL;
+}
+
+/**
+ * trace_cpu_time:
+ *
+ * Returns: CPU time used by the calling thread, in nanoseconds.
+ **/
+static unsigned long long
+trace_cpu_time (void)
+{
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+		return 0;
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * trace_report_overhead:
+ *
+ * Reports what each tracer used cost us, side by side.
+ **/
+static void
+trace_report_overhead (void)
+{
+	const struct {
+		const char *         name;
+		const TraceOverhead *overhead;
+	} tracers[] = {
+		{ "tracefs",  &tracefs_overhead  },
+		{ "fanotify", &fanotify_overhead },
+	};
+
+	for (size_t i = 0; i < sizeof tracers / sizeof tracers[0]; i++) {
+		const TraceOverhead *overhead = tracers[i].overhead;
+
+		if (! overhead->measured)
+			continue;
+
+		nih_info ("%-8s %8zu opens %8.3fs CPU %8.2fus per open",
+			  tracers[i].name, overhead->events,
+			  overhead->cpu_ns / 1000000000.0,
+			  (overhead->events
+			   ? overhead->cpu_ns / 1000.0 / overhead->events
+			   : 0.0));
+	}
+}
+
+/**
+ * trace_buffer_size:
+ * @num_cpus: number of CPUs.
+ *
+ * Returns: size of each CPU's trace buffer in kB, as grown by previous
+ * traces that lost events.
+ **/
+static int
+trace_buffer_size (size_t num_cpus)
+{
+	FILE *fp;
+	char *line;
+	int   buffer_size_kb = TRACE_BUFFER_KB / num_cpus;
+
+	fp = fopen (PATH_TRACE_STATS, "r");
+	if (! fp)
+		return buffer_size_kb;
+
+	while ((line = fgets_alloc (NULL, fp)) != NULL) {
+		int value;
+
+		if ((sscanf (line, "buffer_size_kb %d", &value) == 1)
+		    && (value > 0))
+			buffer_size_kb = nih_min (value, TRACE_BUFFER_MAX_KB);
+
+		nih_free (line);
 	}
 
+	fclose (fp);
+
+	return buffer_size_kb;
+}
+
+/**
+ * trace_write_buffer_size:
+ * @buffer_size_kb: size of each CPU's trace buffer for the next trace,
+ * @overruns: number of events this trace lost.
+ **/
+static void
+trace_write_buffer_size (int           buffer_size_kb,
+			 unsigned long overruns)
+{
+	FILE *fp;
+
+	fp = fopen (PATH_TRACE_STATS, "w");
+	if (! fp) {
+		nih_warn ("%s: %s", PATH_TRACE_STATS, strerror (errno));
+		return;
+	}
+
+	fprintf (fp, "buffer_size_kb %d\n", buffer_size_kb);
+	fprintf (fp, "overruns %lu\n", overruns);
+
 	if (fclose (fp) < 0)
-		nih_return_system_error (-1);
+		nih_warn ("%s: %s", PATH_TRACE_STATS, strerror (errno));
+}
 
-	return 0;
+/**
+ * trace_event:
+ * @queue: queue to add the path to,
+ * @path: path opened, modified in place,
+ * @timestamp: time of the event in seconds,
+ * @first: time of the first event, or negative before there is one,
+ * @path_prefix_filter: only paths starting with this are added, or NULL,
+ * @critical_time: seconds after @first that paths are critical.
+ *
+ * Queues the path opened by a traced event to be added to the packs,
+ * whichever way the event was read.
+ **/
+static void
+trace_event (TraceQueue *queue,
+	     char *      path,
+	     double      timestamp,
+	     double *    first,
+	     const char *path_prefix_filter,  /* May be null */
+	     int         critical_time)
+{
+	nih_assert (queue != NULL);
+	nih_assert (path != NULL);
+	nih_assert (first != NULL);
+
+	if (critical_time && (*first < 0.0))
+		*first = timestamp;
+
+	fix_path (path);
+
+	if (path_prefix_filter &&
+	    strncmp (path, path_prefix_filter,
+		     strlen (path_prefix_filter))) {
+		nih_warn ("Skipping %s due to path prefix filter", path);
+		return;
+	}
+
+	trace_queue_path (queue, path,
+			  critical_time && (timestamp - *first <= critical_time));
 }
 
+/**
+ * trace_timestamp:
+ * @line: line from the trace,
+ * @event: position of the event name within @line.
+ *
+ * The timestamp, in seconds, is the last field before the event name and
+ * is followed by a colon.
+ *
+ * Returns: timestamp of the event, or zero if it couldn't be found.
+ **/
+static double
+trace_timestamp (const char *line,
+		 const char *event)
+{
+	const char *ptr;
+
+	nih_assert (line != NULL);
+	nih_assert (event != NULL);
+
+	ptr = event;
+	if ((ptr > line) && (ptr[-1] == ':'))
+		ptr--;
+
+	while ((ptr > line) && (strchr ("0123456789.", ptr[-1])))
+		ptr--;
+
+	return strtod (ptr, NULL);
+}
+
+/**
+ * fix_path:
+ * @pathname: path to fix up.
+ *
+ * Removes // and /./ from @pathname, along with each /../ and the
+ * component before it, and any trailing /, in place.  This is done in one
+ * pass, copying each component down over what was removed, with only a
+ * /../ looking back over the component it removes.
+ **/
 static void
 fix_path (char *pathname)
 {
-	char *ptr;
+	const char *src;
+	char *      dest;
 
 	nih_assert (pathname != NULL);
 
-	for (ptr = pathname; *ptr; ptr++) {
+	src = dest = pathname;
+	while (*src) {
 		size_t len;
 
-		if (ptr[0] != '/')
+		if (src[0] != '/') {
+			*(dest++) = *(src++);
 			continue;
+		}
 
-		len = strcspn (ptr + 1, "/");
+		len = strcspn (src + 1, "/");
 
-		/* // and /./, we shorten the string and repeat the loop
-		 * looking at the new /
-		 */
-		if ((len == 0) || ((len == 1) && ptr[1] == '.')) {
-			memmove (ptr, ptr + len + 1, strlen (ptr) - len);
-			ptr--;
+		/* // and /./ are dropped */
+		if ((len == 0) || ((len == 1) && (src[1] == '.'))) {
+			src += len + 1;
 			continue;
 		}
 
-		/* /../, we shorten back to the previous / or the start
-		 * of the string and repeat the loop looking at the new /
+		/* /../ goes back to the previous / or the start of the
+		 * string
 		 */
-		if ((len == 2) && (ptr[1] == '.') && (ptr[2] == '.')) {
-			char *root;
-
-			for (root = ptr - 1;
-			     (root >= pathname) && (root[0] != '/');
-			     root--)
+		if ((len == 2) && (src[1] == '.') && (src[2] == '.')) {
+			while ((dest > pathname) && (*(--dest) != '/'))
 				;
-			if (root < pathname)
-				root = pathname;
 
-			memmove (root, ptr + len + 1, strlen (ptr) - len);
-			ptr = root - 1;
+			src += len + 1;
 			continue;
 		}
+
+		memmove (dest, src, len + 1);
+		dest += len + 1;
+		src += len + 1;
+	}
+
+	*dest = '\0';
+
+	while ((dest != pathname) && (*(--dest) == '/'))
+		*dest = '\0';
+}
+
+
+/**
+ * trace_queue_new:
+ * @parent: parent of the returned queue.
+ *
+ * Returns: newly allocated, empty, queue of paths.
+ **/
+static TraceQueue *
+trace_queue_new (const void *parent)
+{
+	TraceQueue *queue;
+
+	queue = NIH_MUST (nih_new (parent, TraceQueue));
+	memset (queue, 0, sizeof (TraceQueue));
+
+	queue->paths = NIH_MUST (nih_hash_string_new (queue, 2500));
+
+	return queue;
+}
+
+/**
+ * trace_queue_path:
+ * @queue: queue to add to,
+ * @pathname: path opened,
+ * @critical: TRUE if opened within the critical time.
+ *
+ * Records that @pathname was opened; each path is only looked up once,
+ * however often it was opened, and is critical if it was the first time.
+ **/
+static void
+trace_queue_path (TraceQueue *queue,
+		  const char *pathname,
+		  int         critical)
+{
+	TracePath *item;
+
+	nih_assert (queue != NULL);
+	nih_assert (pathname != NULL);
+
+	item = (TracePath *)nih_hash_lookup (queue->paths, pathname);
+	if (! item) {
+		item = NIH_MUST (nih_new (queue->paths, TracePath));
+		memset (item, 0, sizeof (TracePath));
+		nih_list_init (&item->entry);
+		nih_alloc_set_destructor (item, nih_list_destroy);
+
+		item->path = NIH_MUST (nih_strdup (item, pathname));
+		item->critical = critical;
+
+		nih_hash_add (queue->paths, &item->entry);
+
+		if (queue->num_items == queue->max_items) {
+			queue->max_items = queue->max_items ? queue->max_items * 2 : 1024;
+			queue->items = NIH_MUST (nih_realloc (queue->items, queue,
+							      (sizeof (TracePath *)
+							       * queue->max_items)));
+		}
+
+		queue->items[queue->num_items++] = item;
+	}
+
+	if (queue->num_events == queue->max_events) {
+		queue->max_events = queue->max_events ? queue->max_events * 2 : 1024;
+		queue->events = NIH_MUST (nih_realloc (queue->events, queue,
+						       (sizeof (TracePath *)
+							* queue->max_events)));
+	}
+
+	queue->events[queue->num_events++] = item;
+}
+
+/**
+ * trace_resolve:
+ * @parent: parent of @files,
+ * @queue: paths opened,
+ * @path_prefix: path prefix to prepend,
+ * @files: pointer to array of packs,
+ * @num_files: pointer to number of packs,
+ * @force_ssd_mode: TRUE to force SSD mode,
+ * @model: model to learn open order into, or NULL,
+ * @faults: pages read while tracing, or NULL to use those in memory.
+ *
+ * Looks up each path in @queue, finding the blocks of the file to read,
+ * with several threads at once since each path means waiting on the
+ * filesystem several times over.  The threads take the paths in order of
+ * path, to keep their directories open between them, but the results are
+ * added to @files in the order the paths were first opened, so the packs
+ * come out the same whichever thread did what.
+ **/
+static void
+trace_resolve (const void *            parent,
+	       TraceQueue *            queue,
+	       const PathPrefixOption *path_prefix,
+	       PackFile **             files,
+	       size_t *                num_files,
+	       int                     force_ssd_mode,
+	       Model *                 model,
+	       const TraceFaults *     faults)
+{
+	nih_local TracePath **order = NULL;
+	nih_local NihHash *   path_hash = NULL;
+	nih_local NihHash *   inode_hash = NULL;
+	TraceResolveCtx       ctx;
+	pthread_t             thread[TRACE_NUM_THREADS];
+	size_t                num_threads;
+
+	nih_assert (queue != NULL);
+	nih_assert (path_prefix != NULL);
+	nih_assert (files != NULL);
+	nih_assert (num_files != NULL);
+
+	order = NIH_MUST (nih_alloc (NULL, (sizeof (TracePath *)
+					    * (queue->num_items + 1))));
+	memcpy (order, queue->items, sizeof (TracePath *) * queue->num_items);
+	qsort (order, queue->num_items, sizeof (TracePath *), trace_path_compar);
+
+	ctx.order = order;
+	ctx.num_paths = queue->num_items;
+	ctx.idx = 0;
+	ctx.path_prefix = path_prefix;
+	ctx.force_ssd_mode = force_ssd_mode;
+	ctx.faults = faults;
+
+	num_threads = nih_min ((size_t)TRACE_NUM_THREADS,
+			       ((queue->num_items + TRACE_BATCH_SIZE - 1)
+				/ TRACE_BATCH_SIZE));
+	for (size_t t = 0; t < num_threads; t++)
+		pthread_create (&thread[t], NULL, trace_resolve_thread, &ctx);
+	for (size_t t = 0; t < num_threads; t++)
+		pthread_join (thread[t], NULL);
+
+	nih_info ("Looked up %zu paths with %zu threads",
+		  queue->num_items, num_threads);
+
+	/* Use hash tables of paths, to eliminate duplicate path names
+	 * that would waste pack space (and fds), and of inodes, so the
+	 * blocks of hard links are only read once.
+	 */
+	path_hash = NIH_MUST (nih_hash_string_new (NULL, 2500));
+	inode_hash = NIH_MUST (nih_hash_string_new (NULL, 2500));
+
+	for (size_t i = 0; i < queue->num_items; i++)
+		trace_add_path (parent, queue->items[i], files, num_files,
+				force_ssd_mode, path_hash, inode_hash);
+
+	/* The model learns from every open, in the order they were made;
+	 * it's keyed by the path as recorded in the pack, with any path
+	 * prefix, since that's the namespace prediction runs in.
+	 */
+	if (model) {
+		for (size_t i = 0; i < queue->num_events; i++) {
+			const char *path = queue->events[i]->resolved;
+
+			if ((path[0] == '/') && (! ignore_path (path)))
+				model_observe (model, path);
+		}
+	}
+}
+
+static int
+trace_path_compar (const void *a,
+		   const void *b)
+{
+	const TracePath *const *item_a = a;
+	const TracePath *const *item_b = b;
+
+	nih_assert (item_a != NULL);
+	nih_assert (item_b != NULL);
+
+	return strcmp ((*item_a)->path, (*item_b)->path);
+}
+
+static void *
+trace_resolve_thread (void *ptr)
+{
+	TraceResolveCtx *ctx = ptr;
+	char             dirname[PACK_PATH_MAX + 1];
+	int              dfd = -1;
+
+	nih_assert (ctx != NULL);
+
+	for (;;) {
+		size_t i;
+
+		i = __sync_fetch_and_add (&ctx->idx, TRACE_BATCH_SIZE);
+		if (i >= ctx->num_paths)
+			break;
+
+		for (size_t j = i; j < nih_min (i + TRACE_BATCH_SIZE, ctx->num_paths); j++)
+			trace_resolve_path (ctx, ctx->order[j], &dfd, dirname);
 	}
 
-	while ((ptr != pathname) && (*(--ptr) == '/'))
-		*ptr = '\0';
-}
+	if (dfd >= 0)
+		close (dfd);
 
+	return NULL;
+}
 
-static int
-trace_add_path (const void *parent,
-		const char *pathname,
-		PackFile ** files,
-		size_t *    num_files,
-		int         force_ssd_mode)
+/**
+ * trace_resolve_path:
+ * @ctx: paths being looked up,
+ * @item: path to look up,
+ * @dfd: directory kept open, or negative,
+ * @dirname: path of @dfd.
+ *
+ * Called from a thread of its own, so only @item is filled in and any
+ * warning is left in it rather than given; the directory of the last
+ * path looked up is kept open in @dfd to look up the next from, as it's
+ * likely to be the same one.
+ **/
+static void
+trace_resolve_path (TraceResolveCtx *ctx,
+		    TracePath *      item,
+		    int *            dfd,
+		    char *           dirname)
 {
-	static NihHash *path_hash = NULL;
-	struct stat     statbuf;
-	int             fd;
-	PackFile *      file;
-	PackPath *      path;
-	static NihHash *inode_hash = NULL;
-	nih_local char *inode_key = NULL;
-
-	nih_assert (pathname != NULL);
-	nih_assert (files != NULL);
-	nih_assert (num_files != NULL);
+	const PathPrefixOption *path_prefix;
+	struct stat             statbuf;
+	struct statfs           statfsbuf;
+	const char *            basename;
+	size_t                  len;
+	int                     fd;
+
+	nih_assert (ctx != NULL);
+	nih_assert (item != NULL);
+	nih_assert (dfd != NULL);
+	nih_assert (dirname != NULL);
+
+	path_prefix = ctx->path_prefix;
+	item->resolved = item->path;
+
+	if (path_prefix->st_dev != NODEV && item->path[0] == '/') {
+		char *rewritten;
+
+		rewritten = NIH_MUST (nih_sprintf (
+			item, "%s%s", path_prefix->prefix, item->path));
+		if (! lstat (rewritten, &statbuf) &&
+		    statbuf.st_dev == path_prefix->st_dev) {
+			/* If |rewritten| exists on the same device as
+			 * path_prefix->st_dev, record the rewritten one
+			 * instead of the original path.
+			 */
+			item->resolved = rewritten;
+		}
+	}
 
 	/* We can't really deal with relative paths since we don't know
 	 * the working directory that they were opened from.
 	 */
-	if (pathname[0] != '/') {
-		nih_warn ("%s: %s", pathname, _("Ignored relative path"));
-		return 0;
+	if (item->resolved[0] != '/') {
+		item->message = N_("Ignored relative path");
+		return;
 	}
 
 	/* Certain paths aren't worth caching, because they're virtual or
 	 * temporary filesystems and would waste pack space.
 	 */
-	if (ignore_path (pathname))
-		return 0;
+	if (ignore_path (item->resolved))
+		return;
 
 	/* Ignore paths that won't fit in the pack; we could use PATH_MAX,
 	 * but with 1000 files that'd be 4M just for the
 	 * pack.
 	 */
-	if (strlen (pathname) > PACK_PATH_MAX) {
-		nih_warn ("%s: %s", pathname, _("Ignored far too long path"));
-		return 0;
+	if (strlen (item->resolved) > PACK_PATH_MAX) {
+		item->message = N_("Ignored far too long path");
+		return;
 	}
 
-	/* Use a hash table of paths to eliminate duplicate path names from
-	 * the table since that would waste pack space (and fds).
-	 */
-	if (! path_hash)
-		path_hash = NIH_MUST (nih_hash_string_new (NULL, 2500));
+	/* Open the directory unless it's the one we already have open */
+	basename = strrchr (item->resolved, '/');
+	len = nih_max ((size_t)(basename - item->resolved), (size_t)1);
+	basename++;
 
-	if (nih_hash_lookup (path_hash, pathname)) {
-		return 0;
-	} else {
-		NihListEntry *entry;
+	if ((*dfd < 0)
+	    || strncmp (dirname, item->resolved, len)
+	    || dirname[len]) {
+		if (*dfd >= 0)
+			close (*dfd);
 
-		entry = NIH_MUST (nih_list_entry_new (path_hash));
-		entry->str = NIH_MUST (nih_strdup (entry, pathname));
+		memcpy (dirname, item->resolved, len);
+		dirname[len] = '\0';
 
-		nih_hash_add (path_hash, &entry->entry);
+		*dfd = open (dirname, O_PATH | O_DIRECTORY);
 	}
+	if (*dfd < 0)
+		return;
 
 	/* Make sure that we have an ordinary file
 	 * This avoids us opening a fifo or socket or symlink.
 	 */
-	if ((lstat (pathname, &statbuf) < 0)
+	if ((fstatat (*dfd, basename, &statbuf, AT_SYMLINK_NOFOLLOW) < 0)
 	    || (S_ISLNK (statbuf.st_mode))
 	    || (! S_ISREG (statbuf.st_mode)))
-		return 0;
+		return;
 
 	/* Open and stat again to get the genuine details, in case it
 	 * changes under us.
 	 */
-	fd = open (pathname, O_RDONLY | O_NOATIME);
+	fd = openat (*dfd, basename, O_RDONLY | O_NOATIME);
 	if (fd < 0) {
-		nih_warn ("%s: %s: %s", pathname,
-			  _("File vanished or error reading"),
-			  strerror (errno));
-		return -1;
+		item->message = N_("File vanished or error reading");
+		item->errnum = errno;
+		return;
 	}
 
 	if (fstat (fd, &statbuf) < 0) {
-		nih_warn ("%s: %s: %s", pathname,
-			  _("Error retrieving file stat"),
-			  strerror (errno));
+		item->message = N_("Error retrieving file stat");
+		item->errnum = errno;
 		close (fd);
-		return -1;
+		return;
 	}
 
 	/* Double-check that it's really still a file */
 	if (! S_ISREG (statbuf.st_mode)) {
 		close (fd);
-		return 0;
+		return;
 	}
 
+	/* The type of filesystem decides how its metadata is preloaded */
+	if (fstatfs (fd, &statfsbuf) == 0)
+		item->fs_type = statfsbuf.f_type;
+
+	item->add = TRUE;
+	item->dev = statbuf.st_dev;
+	item->ino = statbuf.st_ino;
+
+	/* There's also no point reading zero byte files, since they
+	 * won't have any blocks (and we can't mmap zero bytes anyway).
+	 */
+	if (statbuf.st_size)
+		trace_add_chunks (item, trace_rotational (item->dev,
+							  ctx->force_ssd_mode),
+				  fd, statbuf.st_size, ctx->faults);
+
+	close (fd);
+}
+
+/**
+ * trace_add_path:
+ * @parent: parent of @files,
+ * @item: path looked up,
+ * @files: pointer to array of packs,
+ * @num_files: pointer to number of packs,
+ * @force_ssd_mode: TRUE to force SSD mode,
+ * @path_hash: paths already added,
+ * @inode_hash: inodes whose blocks have already been added.
+ *
+ * Adds the path looked up as @item, and the blocks of the file if they
+ * haven't been added under another name, to the pack for its device.
+ **/
+static void
+trace_add_path (const void *parent,
+		TracePath * item,
+		PackFile ** files,
+		size_t *    num_files,
+		int         force_ssd_mode,
+		NihHash *   path_hash,
+		NihHash *   inode_hash)
+{
+	PackFile *      file;
+	PackPath *      path;
+	NihListEntry *  entry;
+	nih_local char *inode_key = NULL;
+
+	nih_assert (item != NULL);
+	nih_assert (files != NULL);
+	nih_assert (num_files != NULL);
+	nih_assert (path_hash != NULL);
+	nih_assert (inode_hash != NULL);
+
+	if (item->message && item->errnum) {
+		nih_warn ("%s: %s: %s", item->resolved, _(item->message),
+			  strerror (item->errnum));
+	} else if (item->message) {
+		nih_warn ("%s: %s", item->resolved, _(item->message));
+	}
+
+	if (! item->add)
+		return;
+
+	/* Paths rewritten with the path prefix may be the same as ones
+	 * that were opened as such.
+	 */
+	if (nih_hash_lookup (path_hash, item->resolved))
+		return;
+
+	entry = NIH_MUST (nih_list_entry_new (path_hash));
+	entry->str = NIH_MUST (nih_strdup (entry, item->resolved));
+
+	nih_hash_add (path_hash, &entry->entry);
+
 	/* Some people think it's clever to split their filesystem across
 	 * multiple devices, so we need to generate a different pack file
 	 * for each device.
@@ -596,7 +2470,10 @@ trace_add_path (const void *parent,
 	 * Lookup file based on the dev_t, potentially creating a new
 	 * pack file in the array.
 	 */
-	file = trace_file (parent, statbuf.st_dev, files, num_files, force_ssd_mode);
+	file = trace_file (parent, item->dev, files, num_files, force_ssd_mode);
+
+	if (! file->fs_type)
+		file->fs_type = item->fs_type;
 
 	/* Grow the PackPath array and fill in the details for the new
 	 * path.
@@ -609,53 +2486,46 @@ trace_add_path (const void *parent,
 	memset (path, 0, sizeof (PackPath));
 
 	path->group = -1;
-	path->ino = statbuf.st_ino;
+	path->flags = item->critical ? PACK_PATH_CRITICAL : 0;
+	path->ino = item->ino;
 
-	strncpy (path->path, pathname, PACK_PATH_MAX);
+	strncpy (path->path, item->resolved, PACK_PATH_MAX);
 	path->path[PACK_PATH_MAX] = '\0';
 
 	/* The paths array contains each unique path opened, but these
 	 * might be symbolic or hard links to the same underlying files
 	 * and we don't want to read the same block more than once.
-	 *
-	 * Use a hash table of dev_t/ino_t pairs to make sure we only
-	 * read the blocks of an actual file the first time.
 	 */
-	if (! inode_hash)
-		inode_hash = NIH_MUST (nih_hash_string_new (NULL, 2500));
-
 	inode_key = NIH_MUST (nih_sprintf (NULL, "%llu:%llu",
-					   (unsigned long long)statbuf.st_dev,
-					   (unsigned long long)statbuf.st_ino));
+					   (unsigned long long)item->dev,
+					   (unsigned long long)item->ino));
 
-	if (nih_hash_lookup (inode_hash, inode_key)) {
-		close (fd);
-		return 0;
-	} else {
-		NihListEntry *entry;
+	if (nih_hash_lookup (inode_hash, inode_key))
+		return;
 
-		entry = NIH_MUST (nih_list_entry_new (inode_hash));
-		entry->str = inode_key;
-		nih_ref (entry->str, entry);
+	entry = NIH_MUST (nih_list_entry_new (inode_hash));
+	entry->str = inode_key;
+	nih_ref (entry->str, entry);
 
-		nih_hash_add (inode_hash, &entry->entry);
-	}
+	nih_hash_add (inode_hash, &entry->entry);
 
-	/* There's also no point reading zero byte files, since they
-	 * won't have any blocks (and we can't mmap zero bytes anyway).
-	 */
-	if (! statbuf.st_size) {
-		close (fd);
-		return 0;
-	}
+	/* Now add the chunks of this file that were found */
+	path->flags |= item->flags;
 
-	/* Now read the in-memory chunks of this file and add those to
-	 * the pack file too.
-	 */
-	trace_add_chunks (*files, file, path, fd, statbuf.st_size);
-	close (fd);
+	if (! item->num_blocks)
+		return;
 
-	return 0;
+	file->blocks = NIH_MUST (nih_realloc (file->blocks, *files,
+					      (sizeof (PackBlock)
+					       * (file->num_blocks
+						  + item->num_blocks))));
+
+	for (size_t i = 0; i < item->num_blocks; i++) {
+		PackBlock *block = &file->blocks[file->num_blocks++];
+
+		*block = item->blocks[i];
+		block->pathidx = file->num_paths - 1;
+	}
 }
 
 static int
@@ -663,27 +2533,79 @@ ignore_path (const char *pathname)
 {
 	nih_assert (pathname != NULL);
 
-	if (! strncmp (pathname, "/proc/", 6))
-		return TRUE;
-	if (! strncmp (pathname, "/sys/", 5))
-		return TRUE;
-	if (! strncmp (pathname, "/dev/", 5))
-		return TRUE;
-	if (! strncmp (pathname, "/tmp/", 5))
-		return TRUE;
-	if (! strncmp (pathname, "/run/", 5))
-		return TRUE;
-	if (! strncmp (pathname, "/var/run/", 9))
-		return TRUE;
-	if (! strncmp (pathname, "/var/log/", 9))
-		return TRUE;
-	if (! strncmp (pathname, "/var/lock/", 10))
-		return TRUE;
+	for (size_t i = 0; i < sizeof ignore_prefixes / sizeof ignore_prefixes[0]; i++)
+		if (! strncmp (pathname, ignore_prefixes[i],
+			       strlen (ignore_prefixes[i])))
+			return TRUE;
 
 	return FALSE;
 }
 
 
+/**
+ * trace_rotational:
+ * @dev: device,
+ * @force_ssd_mode: TRUE to force SSD mode.
+ *
+ * Looks up whether @dev is a rotational disk, once for each device; this
+ * is called by the threads looking up paths, so is done with a lock held,
+ * which covers raising and handling the error if it can't be found out.
+ *
+ * Returns: TRUE if @dev is rotational.
+ **/
+static int
+trace_rotational (dev_t dev,
+		  int   force_ssd_mode)
+{
+	static pthread_mutex_t rotational_lock = PTHREAD_MUTEX_INITIALIZER;
+	static dev_t *         devs = NULL;
+	static int *           rotational = NULL;
+	static size_t          num_devs = 0;
+	nih_local char *       filename = NULL;
+	int                    ret;
+
+	if (force_ssd_mode)
+		return FALSE;
+
+	pthread_mutex_lock (&rotational_lock);
+
+	for (size_t i = 0; i < num_devs; i++) {
+		if (devs[i] == dev) {
+			ret = rotational[i];
+			pthread_mutex_unlock (&rotational_lock);
+			return ret;
+		}
+	}
+
+	/* Query sysfs to see whether this disk is rotational; this
+	 * obviously won't work for virtual devices and the like, so
+	 * default to TRUE for now.
+	 */
+	filename = queue_value_path (NULL, dev, "rotational");
+	if (get_value (AT_FDCWD, filename, &ret) < 0) {
+		NihError *err;
+
+		err = nih_error_get ();
+		nih_warn (_("Unable to obtain rotationalness for device %u:%u: %s"),
+			major (dev), minor (dev), err->message);
+		nih_free (err);
+
+		ret = TRUE;
+	}
+
+	devs = NIH_MUST (nih_realloc (devs, NULL,
+				      sizeof (dev_t) * (num_devs + 1)));
+	rotational = NIH_MUST (nih_realloc (rotational, NULL,
+					    sizeof (int) * (num_devs + 1)));
+	devs[num_devs] = dev;
+	rotational[num_devs] = ret;
+	num_devs++;
+
+	pthread_mutex_unlock (&rotational_lock);
+
+	return ret;
+}
+
 static PackFile *
 trace_file (const void *parent,
 	    dev_t       dev,
@@ -691,9 +2613,8 @@ trace_file (const void *parent,
 	    size_t *    num_files,
 	    int         force_ssd_mode)
 {
-	nih_local char *filename = NULL;
-	int             rotational;
-	PackFile *      file;
+	int       rotational;
+	PackFile *file;
 
 	nih_assert (files != NULL);
 	nih_assert (num_files != NULL);
@@ -703,35 +2624,7 @@ trace_file (const void *parent,
 		if ((*files)[i].dev == dev)
 			return &(*files)[i];
 
-	if (force_ssd_mode) {
-		rotational = FALSE;
-	} else {
-		/* Query sysfs to see whether this disk is rotational; this
-		 * obviously won't work for virtual devices and the like, so
-		 * default to TRUE for now.
-		 */
-		filename = NIH_MUST (nih_sprintf (NULL, "/sys/dev/block/%d:%d/queue/rotational",
-						major (dev), minor (dev)));
-		if (access (filename, R_OK) < 0) {
-			/* For devices managed by the scsi stack, the minor device number has to be
-			 * masked to find the queue/rotational file.
-			 */
-			nih_free (filename);
-			filename = NIH_MUST (nih_sprintf (NULL, "/sys/dev/block/%d:%d/queue/rotational",
-							major (dev), minor (dev) & 0xffff0));
-		}
-
-		if (get_value (AT_FDCWD, filename, &rotational) < 0) {
-			NihError *err;
-
-			err = nih_error_get ();
-			nih_warn (_("Unable to obtain rotationalness for device %u:%u: %s"),
-				major (dev), minor (dev), err->message);
-			nih_free (err);
-
-			rotational = TRUE;
-		}
-	}
+	rotational = trace_rotational (dev, force_ssd_mode);
 
 	/* Grow the PackFile array and fill in the details for the new
 	 * file.
@@ -754,99 +2647,211 @@ trace_file (const void *parent,
 
 
 static int
-trace_add_chunks (const void *parent,
-		  PackFile *  file,
-		  PackPath *  path,
-		  int         fd,
-		  off_t       size)
+trace_add_chunks (TracePath *        item,
+		  int                rotational,
+		  int                fd,
+		  off_t              size,
+		  const TraceFaults *faults)
 {
 	static int               page_size = -1;
-	void *                   buf;
 	off_t                    num_pages;
 	nih_local unsigned char *vec = NULL;
+	off_t                    resident = 0;
+	off_t                    runs = 0;
 
-	nih_assert (file != NULL);
-	nih_assert (path != NULL);
+	nih_assert (item != NULL);
 	nih_assert (fd >= 0);
 	nih_assert (size > 0);
 
 	if (page_size < 0)
 		page_size = sysconf (_SC_PAGESIZE);
 
+	num_pages = (size - 1) / page_size + 1;
+	vec = NIH_MUST (nih_alloc (NULL, num_pages));
+	memset (vec, 0, num_pages);
+
+	/* When the pages read while tracing were captured, add those in
+	 * the order they were read; each page is only added the first time.
+	 */
+	if (faults) {
+		size_t lo = 0;
+		size_t hi = faults->num_faults;
+
+		/* Find the first of this file's pages */
+		while (lo < hi) {
+			size_t          mid = lo + (hi - lo) / 2;
+			const RawFault *fault = &faults->faults[mid];
+
+			if ((fault->dev < item->dev)
+			    || ((fault->dev == item->dev)
+				&& (fault->ino < item->ino))) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+
+		for (size_t i = lo; i < faults->num_faults; i++) {
+			const RawFault *fault = &faults->faults[i];
+			off_t           start;
+			off_t           end;
+
+			if ((fault->dev != item->dev)
+			    || (fault->ino != item->ino))
+				break;
+
+			start = fault->index;
+			end = nih_min (start + (off_t)fault->pages, num_pages);
+
+			while ((start < end) && vec[start])
+				start++;
+			if (start >= end)
+				continue;
+
+			/* Carry on through pages read right after */
+			while ((i + 1 < faults->num_faults)
+			       && (faults->faults[i + 1].dev == item->dev)
+			       && (faults->faults[i + 1].ino == item->ino)
+			       && (faults->faults[i + 1].index == end)
+			       && (end < num_pages)) {
+				i++;
+				end = nih_min (end + (off_t)faults->faults[i].pages,
+					       num_pages);
+			}
+
+			for (off_t page = start; page < end; ) {
+				off_t length = 0;
+
+				while ((page + length < end) && (! vec[page + length])) {
+					vec[page + length] = TRUE;
+					length++;
+				}
+
+				if (length) {
+					trace_add_chunk (item, rotational, fd,
+							 page * page_size,
+							 length * page_size);
+					resident += length;
+					runs++;
+				}
+
+				page += length;
+				while ((page < end) && vec[page])
+					page++;
+			}
+		}
+
+	} else {
+		if (trace_mincore (item, fd, size, vec) < 0)
+			return -1;
+
+		/* Now we can figure out which contiguous bits of the file
+		 * are in core memory.
+		 */
+		for (off_t i = 0; i < num_pages; i++) {
+			off_t offset;
+			off_t length;
+
+			if (! vec[i])
+				continue;
+
+			offset = i * page_size;
+			length = page_size;
+
+			while (((i + 1) < num_pages) && vec[i + 1]) {
+				length += page_size;
+				i++;
+			}
+
+			resident += length / page_size;
+			runs++;
+
+			trace_add_chunk (item, rotational, fd, offset, length);
+		}
+	}
+
+	/* A file read through more or less in full is read sequentially,
+	 * while a large one of which only a few short runs of pages were
+	 * read is read at random.
+	 */
+	if (resident * 4 >= num_pages * 3) {
+		item->flags |= PACK_PATH_SEQUENTIAL;
+	} else if ((num_pages >= RANDOM_MIN_SIZE / page_size)
+		   && (resident * 8 <= num_pages)
+		   && (resident <= runs * RANDOM_RUN_PAGES)) {
+		item->flags |= PACK_PATH_RANDOM;
+	}
+
+	return 0;
+}
+
+static int
+trace_mincore (TracePath *    item,
+	       int            fd,
+	       off_t          size,
+	       unsigned char *vec)
+{
+	void *buf;
+
+	nih_assert (item != NULL);
+	nih_assert (vec != NULL);
+
 	/* Map the file into memory */
 	buf = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
 	if (buf == MAP_FAILED) {
-		nih_warn ("%s: %s: %s", path->path,
-			  _("Error mapping into memory"),
-			  strerror (errno));
+		item->message = N_("Error mapping into memory");
+		item->errnum = errno;
 		return -1;
 	}
 
 	/* Grab the core memory map of the file */
-	num_pages = (size - 1) / page_size + 1;
-	vec = NIH_MUST (nih_alloc (NULL, num_pages));
-	memset (vec, 0, num_pages);
-
 	if (mincore (buf, size, vec) < 0) {
-		nih_warn ("%s: %s: %s", path->path,
-			  _("Error retrieving page cache info"),
-			  strerror (errno));
+		item->message = N_("Error retrieving page cache info");
+		item->errnum = errno;
 		munmap (buf, size);
 		return -1;
 	}
 
 	/* Clean up */
 	if (munmap (buf, size) < 0) {
-		nih_warn ("%s: %s: %s", path->path,
-			  _("Error unmapping from memory"),
-			  strerror (errno));
+		item->message = N_("Error unmapping from memory");
+		item->errnum = errno;
 		return -1;
 	}
 
+	return 0;
+}
 
-	/* Now we can figure out which contiguous bits of the file are
-	 * in core memory.
-	 */
-	for (off_t i = 0; i < num_pages; i++) {
-		off_t offset;
-		off_t length;
-
-		if (! vec[i])
-			continue;
-
-		offset = i * page_size;
-		length = page_size;
-
-		while (((i + 1) < num_pages) && vec[i + 1]) {
-			length += page_size;
-			i++;
-		}
+static void
+trace_add_chunk (TracePath *item,
+		 int        rotational,
+		 int        fd,
+		 off_t      offset,
+		 off_t      length)
+{
+	PackBlock *block;
 
-		/* The rotational crowd need this split down further into
-		 * on-disk extents, the non-rotational folks can just use
-		 * the chunks data.
-		 */
-		if (file->rotational) {
-			trace_add_extents (parent, file, path, fd, size,
-					   offset, length);
-		} else {
-			PackBlock *block;
+	nih_assert (item != NULL);
 
-			file->blocks = NIH_MUST (nih_realloc (file->blocks, parent,
-							      (sizeof (PackBlock)
-							       * (file->num_blocks + 1))));
+	/* The rotational crowd need this split down further into
+	 * on-disk extents, the non-rotational folks can just use
+	 * the chunks data.
+	 */
+	if (rotational) {
+		trace_add_extents (item, fd, offset, length);
+		return;
+	}
 
-			block = &file->blocks[file->num_blocks++];
-			memset (block, 0, sizeof (PackBlock));
+	item->blocks = NIH_MUST (nih_realloc (item->blocks, item,
+					      (sizeof (PackBlock)
+					       * (item->num_blocks + 1))));
 
-			block->pathidx = file->num_paths - 1;
-			block->offset = offset;
-			block->length = length;
-			block->physical = -1;
-		}
-	}
+	block = &item->blocks[item->num_blocks++];
+	memset (block, 0, sizeof (PackBlock));
 
-	return 0;
+	block->offset = offset;
+	block->length = length;
+	block->physical = -1;
 }
 
 struct fiemap *
@@ -859,6 +2864,35 @@ get_fiemap (const void *parent,
 
 	nih_assert (fd >= 0);
 
+	fiemap = trace_fiemap (parent, fd, offset, length);
+	if (! fiemap)
+		nih_return_system_error (NULL);
+
+	return fiemap;
+}
+
+/**
+ * trace_fiemap:
+ * @parent: parent of returned map,
+ * @fd: open file,
+ * @offset: start of range to map,
+ * @length: length of range to map.
+ *
+ * As get_fiemap(), but without raising an error, so that it may be
+ * called from the threads looking up paths.
+ *
+ * Returns: newly allocated map, or NULL with errno set.
+ **/
+static struct fiemap *
+trace_fiemap (const void *parent,
+	      int         fd,
+	      off_t       offset,
+	      off_t       length)
+{
+	struct fiemap *fiemap;
+
+	nih_assert (fd >= 0);
+
 	fiemap = NIH_MUST (nih_new (parent, struct fiemap));
 	memset (fiemap, 0, sizeof (struct fiemap));
 
@@ -872,8 +2906,10 @@ get_fiemap (const void *parent,
 		fiemap->fm_extent_count = 0;
 
 		if (ioctl (fd, FS_IOC_FIEMAP, fiemap) < 0) {
-			nih_error_raise_system ();
+			int saved_errno = errno;
+
 			nih_free (fiemap);
+			errno = saved_errno;
 			return NULL;
 		}
 
@@ -891,8 +2927,10 @@ get_fiemap (const void *parent,
 						* fiemap->fm_extent_count));
 
 		if (ioctl (fd, FS_IOC_FIEMAP, fiemap) < 0) {
-			nih_error_raise_system ();
+			int saved_errno = errno;
+
 			nih_free (fiemap);
+			errno = saved_errno;
 			return NULL;
 		}
 	} while (fiemap->fm_mapped_extents
@@ -902,33 +2940,25 @@ get_fiemap (const void *parent,
 }
 
 static int
-trace_add_extents (const void *parent,
-		   PackFile *  file,
-		   PackPath *  path,
-		   int         fd,
-		   off_t       size,
-		   off_t       offset,
-		   off_t       length)
+trace_add_extents (TracePath *item,
+		   int        fd,
+		   off_t      offset,
+		   off_t      length)
 {
 	nih_local struct fiemap *fiemap = NULL;
 
-	nih_assert (file != NULL);
-	nih_assert (path != NULL);
+	nih_assert (item != NULL);
 	nih_assert (fd >= 0);
-	nih_assert (size > 0);
 
 	/* Get the extents map for this chunk, then iterate the extents
 	 * and put those in the pack instead of the chunks.
 	 */
-	fiemap = get_fiemap (NULL, fd, offset, length);
+	fiemap = trace_fiemap (NULL, fd, offset, length);
 	if (! fiemap) {
-		NihError *err;
-
-		err = nih_error_get ();
-		nih_warn ("%s: %s: %s", path->path,
-			  _("Error retrieving chunk extents"),
-			  err->message);
-		nih_free (err);
+		if (! item->message) {
+			item->message = N_("Error retrieving chunk extents");
+			item->errnum = errno;
+		}
 
 		return -1;
 	}
@@ -949,14 +2979,13 @@ trace_add_extents (const void *parent,
 				+ fiemap->fm_extents[j].fe_length));
 
 		/* Grow the blocks array to add the extent */
-		file->blocks = NIH_MUST (nih_realloc (file->blocks, parent,
+		item->blocks = NIH_MUST (nih_realloc (item->blocks, item,
 						      (sizeof (PackBlock)
-						       * (file->num_blocks + 1))));
+						       * (item->num_blocks + 1))));
 
-		block = &file->blocks[file->num_blocks++];
+		block = &item->blocks[item->num_blocks++];
 		memset (block, 0, sizeof (PackBlock));
 
-		block->pathidx = file->num_paths - 1;
 		block->offset = start;
 		block->length = end - start;
 		block->physical = (fiemap->fm_extents[j].fe_physical
@@ -966,65 +2995,155 @@ trace_add_extents (const void *parent,
 	return 0;
 }
 
-static int
-trace_add_groups (const void *parent,
-		  PackFile *  file)
+/**
+ * trace_add_directories:
+ * @parent: parent of extents array,
+ * @file: pack file.
+ *
+ * Most of the time taken to open files with a cold cache is spent
+ * reading the directories on the way to them.  Add where the blocks of
+ * each directory above the paths in @file lie to its metadata extents,
+ * so that they're read in advance of the files being opened; only for
+ * filesystems that read directories through the block device.
+ **/
+static void
+trace_add_directories (const void *parent,
+		       PackFile *  file)
 {
-	const char *devname;
-	ext2_filsys fs = NULL;
+	nih_local NihHash *dirs = NULL;
+	size_t             num_extents;
 
 	nih_assert (file != NULL);
 
-	devname = blkid_devno_to_devname (file->dev);
-	if (devname
-	    && (! ext2fs_open (devname, 0, 0, 0, unix_io_manager, &fs))) {
-		nih_assert (fs != NULL);
-		size_t            num_groups = 0;
-		nih_local size_t *num_inodes = NULL;
-		size_t            mean = 0;
-		size_t            hits = 0;
+	dirs = NIH_MUST (nih_hash_string_new (NULL, 1000));
+	num_extents = file->num_extents;
 
-		nih_assert (fs != NULL);
+	for (size_t i = 0; i < file->num_paths; i++) {
+		char  dirname[PACK_PATH_MAX + 1];
+		char *ptr;
 
-		/* Calculate the number of inode groups on this filesystem */
-		num_groups = ((fs->super->s_blocks_count - 1)
-			      / fs->super->s_blocks_per_group) + 1;
+		strcpy (dirname, file->paths[i].path);
 
-		/* Fill in the pack path's group member, and count the
-		 * number of inodes in each group.
+		/* Walk up to the root, stopping early at a directory
+		 * we've already seen since we'll have seen its parents.
 		 */
-		num_inodes = NIH_MUST (nih_alloc (NULL, (sizeof (size_t)
-							 * num_groups)));
-		memset (num_inodes, 0, sizeof (size_t) * num_groups);
+		while ((ptr = strrchr (dirname, '/')) != NULL) {
+			NihListEntry *  entry;
+			struct stat     statbuf;
+			int             fd;
+			struct fiemap * fiemap;
+
+			if (ptr == dirname) {
+				if (! dirname[1])
+					break;
+				dirname[1] = '\0';
+			} else {
+				*ptr = '\0';
+			}
 
-		for (size_t i = 0; i < file->num_paths; i++) {
-			file->paths[i].group = ext2fs_group_of_ino (fs, file->paths[i].ino);
-			num_inodes[file->paths[i].group]++;
-		}
+			if (nih_hash_lookup (dirs, dirname))
+				break;
 
-		/* Iterate the groups and add any group that exceeds the
-		 * inode preload threshold.
-		 */
-		for (size_t i = 0; i < num_groups; i++) {
-			mean += num_inodes[i];
-			if (num_inodes[i] > INODE_GROUP_PRELOAD_THRESHOLD) {
-				file->groups = NIH_MUST (nih_realloc (file->groups, parent,
-								      (sizeof (int)
-								       * (file->num_groups + 1))));
-				file->groups[file->num_groups++] = i;
-				hits++;
+			entry = NIH_MUST (nih_list_entry_new (dirs));
+			entry->str = NIH_MUST (nih_strdup (entry, dirname));
+			nih_hash_add (dirs, &entry->entry);
+
+			fd = open (dirname, O_RDONLY | O_DIRECTORY | O_NOATIME);
+			if (fd < 0)
+				continue;
+
+			/* Directories on other filesystems mounted above
+			 * this one aren't on this device.
+			 */
+			if ((fstat (fd, &statbuf) < 0)
+			    || (statbuf.st_dev != file->dev)
+			    || (! statbuf.st_size)) {
+				close (fd);
+				continue;
 			}
-		}
 
-		mean /= num_groups;
+			fiemap = get_fiemap (NULL, fd, 0, statbuf.st_size);
+			close (fd);
+
+			if (! fiemap) {
+				NihError *err;
+
+				err = nih_error_get ();
+				nih_debug ("%s: %s", dirname, err->message);
+				nih_free (err);
+				continue;
+			}
+
+			for (__u32 j = 0; j < fiemap->fm_mapped_extents; j++) {
+				PackExtent *extent;
+
+				if (fiemap->fm_extents[j].fe_flags
+				    & (FIEMAP_EXTENT_UNKNOWN
+				       | FIEMAP_EXTENT_DATA_INLINE))
+					continue;
+
+				file->extents = NIH_MUST (nih_realloc (
+					file->extents, parent,
+					(sizeof (PackExtent)
+					 * (file->num_extents + 1))));
 
-		nih_debug ("%zu inode groups, mean %zu inodes per group, %zu hits",
-			   num_groups, mean, hits);
+				extent = &file->extents[file->num_extents++];
+				extent->physical = fiemap->fm_extents[j].fe_physical;
+				extent->length = fiemap->fm_extents[j].fe_length;
+			}
 
-		ext2fs_close (fs);
+			nih_free (fiemap);
+		}
 	}
 
-	return 0;
+	nih_debug ("%zu directory block extents",
+		   file->num_extents - num_extents);
+}
+
+/**
+ * trace_tune_queue:
+ * @file: pack file,
+ * @scheduler: I/O scheduler to use while reading, may be NULL.
+ *
+ * Works out the block queue settings for reading @file: read_ahead_kb
+ * large enough for its largest block, and nr_requests deep enough to
+ * queue all of its blocks at once, within reason.  Settings that would
+ * be no higher than the usual defaults are left at zero, and won't be
+ * touched.
+ **/
+static void
+trace_tune_queue (PackFile *  file,
+		  const char *scheduler)
+{
+	off_t largest = 0;
+	int   read_ahead_kb;
+	int   nr_requests;
+
+	nih_assert (file != NULL);
+
+	for (size_t i = 0; i < file->num_blocks; i++)
+		largest = nih_max (largest, file->blocks[i].length);
+
+	read_ahead_kb = 128;
+	while ((read_ahead_kb < QUEUE_READ_AHEAD_KB_MAX)
+	       && ((off_t)read_ahead_kb * 1024 < largest))
+		read_ahead_kb *= 2;
+
+	nr_requests = 128;
+	while ((nr_requests < QUEUE_NR_REQUESTS_MAX)
+	       && ((size_t)nr_requests < file->num_blocks))
+		nr_requests *= 2;
+
+	memset (&file->queue, 0, sizeof (PackQueue));
+	file->queue.read_ahead_kb = read_ahead_kb > 128 ? read_ahead_kb : 0;
+	file->queue.nr_requests = nr_requests > 128 ? nr_requests : 0;
+
+	if (scheduler)
+		strncpy (file->queue.scheduler, scheduler, PACK_SCHEDULER_MAX);
+
+	nih_debug ("read_ahead_kb %d, nr_requests %d, scheduler %s",
+		   file->queue.read_ahead_kb, file->queue.nr_requests,
+		   file->queue.scheduler[0] ? file->queue.scheduler : "unchanged");
 }
 
 
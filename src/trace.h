@@ -25,6 +25,8 @@
 #include <nih/macros.h>
 #include <nih/list.h>
 
+#include "pack.h"
+
 
 NIH_BEGIN_EXTERN
 
@@ -33,13 +35,36 @@ typedef struct path_prefix_option {
         char prefix[PATH_MAX];
 } PathPrefixOption;
 
+/**
+ * TracerOption:
+ *
+ * TRACER_TRACEFS traces opens with the kernel's trace events, and
+ * TRACER_FANOTIFY with fanotify, which doesn't need tracefs;
+ * TRACER_BOTH uses both, reporting the cost of each, and makes the pack
+ * from the trace events.
+ **/
+typedef enum tracer_option {
+	TRACER_TRACEFS,
+	TRACER_FANOTIFY,
+	TRACER_BOTH,
+} TracerOption;
+
 int trace (int daemonise, int timeout,
            const char *filename_to_replace,
            const char *pack_file,  /* May be null */
            const char *path_prefix_filter,  /* May be null */
            const PathPrefixOption *path_prefix,
            int use_existing_trace_events,
-           int force_ssd_mode);
+           int force_ssd_mode,
+           int critical_time,
+           const char *queue_scheduler,  /* May be null */
+           PackFile *replay,  /* May be null */
+           const ReadaheadOptions *replay_options,
+           int learn,
+           int trace_pages,
+           TracerOption tracer);
+
+int trace_benchmark (const char *filename);
 
 NIH_END_EXTERN
 
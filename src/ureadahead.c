@@ -47,6 +47,9 @@
 
 #include "pack.h"
 #include "trace.h"
+#include "rewarm.h"
+#include "server.h"
+#include "model.h"
 
 
 /**
@@ -65,6 +68,46 @@ static int daemonise = FALSE;
  **/
 static int force_trace = FALSE;
 
+/**
+ * retrace:
+ *
+ * Set to TRUE if we should read the existing pack file in the background
+ * while tracing to generate a new one.
+ **/
+static int retrace = FALSE;
+
+/**
+ * rewarm:
+ *
+ * Set to non-zero to stay running and re-read up to this many megabytes
+ * of the pack whenever memory pressure has evicted it.
+ **/
+static int rewarm = 0;
+
+/**
+ * server_socket:
+ *
+ * Set to the path of a control socket to stay running and read packs and
+ * files as they are asked for.
+ **/
+static char *server_socket = NULL;
+
+/**
+ * learn:
+ *
+ * Set to TRUE if we should learn the order in which files are opened
+ * while tracing.
+ **/
+static int learn = FALSE;
+
+/**
+ * predict:
+ *
+ * Set to non-zero to stay running and read the files that have at least
+ * this percent chance of being opened next, whenever one is opened.
+ **/
+static int predict = 0;
+
 /**
  * timeout:
  *
@@ -73,6 +116,13 @@ static int force_trace = FALSE;
  **/
 static int timeout = 0;
 
+/**
+ * benchmark_trace:
+ *
+ * Set to the path of a saved text trace to only time how fast it's parsed.
+ **/
+static char *benchmark_trace = NULL;
+
 /**
  * dump_pack:
  *
@@ -128,6 +178,46 @@ static int use_existing_trace_events = FALSE;
  */
 static int force_ssd_mode = FALSE;
 
+/**
+ * critical_time:
+ *
+ * Set to non-zero to mark files opened within this many seconds of the
+ * start of the trace as critical, so they are read at a higher priority
+ * than the rest.
+ **/
+static int critical_time = 0;
+
+/**
+ * trace_pages:
+ *
+ * Set to TRUE to put the pages read while tracing in the pack, in the
+ * order they were read, rather than the pages in memory once tracing
+ * stops.
+ **/
+static int trace_pages = FALSE;
+
+/**
+ * tracer:
+ *
+ * Set to how opens are traced; fanotify needs no access to tracefs.
+ **/
+static TracerOption tracer = TRACER_TRACEFS;
+
+/**
+ * queue_scheduler:
+ *
+ * I/O scheduler to switch the device to while reading the pack, recorded
+ * in the pack when tracing.
+ **/
+static char *queue_scheduler = NULL;
+
+/**
+ * readahead_options:
+ *
+ * Options that alter how the pack is read.
+ **/
+static ReadaheadOptions readahead_options = { FALSE, NULL, 0, 0, NULL, FALSE };
+
 static int
 path_prefix_option (NihOption  *option,
                     const char *arg)
@@ -175,6 +265,24 @@ dup_string_handler (NihOption   *option,
 	return 0;
 }
 
+static int
+scheduler_option (NihOption  *option,
+		  const char *arg)
+{
+	nih_assert (option != NULL);
+	nih_assert (option->value != NULL);
+	nih_assert (arg != NULL);
+
+	if ((! *arg) || (strlen (arg) > PACK_SCHEDULER_MAX)) {
+		fprintf (stderr, _("%s: illegal argument: %s\n"),
+			 program_name, arg);
+		nih_main_suggest_help ();
+		return -1;
+	}
+
+	return dup_string_handler (option, arg);
+}
+
 static int
 sort_option (NihOption  *option,
 	     const char *arg)
@@ -205,6 +313,34 @@ sort_option (NihOption  *option,
 	return 0;
 }
 
+static int
+tracer_option (NihOption  *option,
+	       const char *arg)
+{
+	TracerOption *value;
+
+	nih_assert (option != NULL);
+	nih_assert (option->value != NULL);
+	nih_assert (arg != NULL);
+
+	value = (TracerOption *)option->value;
+
+	if (! strcmp (arg, "tracefs")) {
+		*value = TRACER_TRACEFS;
+	} else if (! strcmp (arg, "fanotify")) {
+		*value = TRACER_FANOTIFY;
+	} else if (! strcmp (arg, "both")) {
+		*value = TRACER_BOTH;
+	} else {
+		fprintf (stderr, _("%s: illegal argument: %s\n"),
+			 program_name, arg);
+		nih_main_suggest_help ();
+		return -1;
+	}
+
+	return 0;
+}
+
 
 /**
  * options:
@@ -216,12 +352,24 @@ static NihOption options[] = {
 	  NULL, NULL, &daemonise, NULL },
 	{ 0, "force-trace", N_("ignore existing pack and force retracing"),
 	  NULL, NULL, &force_trace, NULL },
+	{ 0, "retrace", N_("read the existing pack while tracing a new one"),
+	  NULL, NULL, &retrace, NULL },
+	{ 0, "rewarm", N_("stay running and re-read up to this much of the pack after memory pressure"),
+	  NULL, "MEGABYTES", &rewarm, nih_option_int },
+	{ 0, "server", N_("stay running and read packs and files on request"),
+	  NULL, "SOCKET", &server_socket, dup_string_handler },
+	{ 0, "learn", N_("learn the order files are opened in while tracing"),
+	  NULL, NULL, &learn, NULL },
+	{ 0, "predict", N_("stay running and read files this likely to be opened next"),
+	  NULL, "PERCENT", &predict, nih_option_int },
 	{ 0, "timeout", N_("maximum time to trace [default: until terminated]"),
 	  NULL, "SECONDS", &timeout, nih_option_int },
 	{ 0, "dump", N_("dump the current pack file"),
 	  NULL, NULL, &dump_pack, NULL },
 	{ 0, "sort", N_("how to sort the pack file when dumping [default: open]"),
 	  NULL, "SORT", &sort_pack, sort_option },
+	{ 0, "benchmark-trace", N_("time parsing a saved text trace"),
+	  NULL, "FILE", &benchmark_trace, dup_string_handler },
 	{ 0, "path-prefix", N_("pathname to prepend for files on the device"),
 	  NULL, "PREFIX", &path_prefix, path_prefix_option },
 	{ 0, "path-prefix-filter",
@@ -233,6 +381,22 @@ static NihOption options[] = {
 	  NULL, NULL, &use_existing_trace_events, NULL },
 	{ 0, "force-ssd-mode", N_("force ssd setting in pack file during tracing"),
 	  NULL, NULL, &force_ssd_mode, NULL },
+	{ 0, "critical-time", N_("mark files opened within this time of the start of tracing as critical"),
+	  NULL, "SECONDS", &critical_time, nih_option_int },
+	{ 0, "tracer", N_("how to trace opens: tracefs, fanotify or both [default: tracefs]"),
+	  NULL, "TRACER", &tracer, tracer_option },
+	{ 0, "trace-pages", N_("put the pages read while tracing in the pack, in the order read"),
+	  NULL, NULL, &trace_pages, NULL },
+	{ 0, "queue-scheduler", N_("I/O scheduler to use while reading the pack"),
+	  NULL, "SCHEDULER", &queue_scheduler, scheduler_option },
+	{ 0, "warm", N_("wait for blocks to be read rather than only queueing them"),
+	  NULL, NULL, &readahead_options.warm, NULL },
+	{ 0, "ready-file", N_("file to create once all blocks have been read"),
+	  NULL, "FILE", &readahead_options.ready_file, dup_string_handler },
+	{ 0, "hdd-queue-depth", N_("number of reads to keep in flight on hard drives"),
+	  NULL, "DEPTH", &readahead_options.queue_depth, nih_option_int },
+	{ 0, "pin", N_("keep up to this much of the critical files locked in memory until signalled"),
+	  NULL, "MEGABYTES", &readahead_options.pin_limit, nih_option_int },
 
 	NIH_OPTION_LAST
 };
@@ -264,6 +428,25 @@ main (int   argc,
 	if (! args)
 		exit (1);
 
+	/* Only a warm read can promise that everything is in memory */
+	if (readahead_options.ready_file)
+		readahead_options.warm = TRUE;
+
+	/* Measure how fast a trace is parsed, without tracing */
+	if (benchmark_trace) {
+		if (trace_benchmark (benchmark_trace) < 0) {
+			NihError *err;
+
+			err = nih_error_get ();
+			nih_fatal ("%s: %s", benchmark_trace, err->message);
+			nih_free (err);
+
+			exit (3);
+		}
+
+		exit (0);
+	}
+
 	/* Lookup the filename for the pack based on the path given
 	 * (if any).
 	 */
@@ -271,6 +454,45 @@ main (int   argc,
 		? NIH_MUST (nih_strdup (NULL, pack_file))
 		: pack_file_name (NULL, args[0]);
 
+	/* Read files as they become likely to be opened */
+	if (predict > 0) {
+		nih_local Model *model = NULL;
+		NihError *       err;
+
+		model = model_read (NULL, PATH_MODEL);
+		if (model)
+			do_predict (model, predict, daemonise);
+
+		err = nih_error_get ();
+		nih_error ("%s: %s", _("Error while predicting"),
+			   err->message);
+		nih_free (err);
+		exit (3);
+	}
+
+	/* Serve requests, the pack being read only when asked for */
+	if (server_socket) {
+		NihError *err;
+
+		if (! filename) {
+			err = nih_error_get ();
+			nih_fatal ("%s: %s: %s", args[0] ?: "/",
+				   _("Unable to determine pack file name"),
+				   err->message);
+			nih_free (err);
+
+			exit (2);
+		}
+
+		do_server (server_socket, filename, daemonise);
+
+		err = nih_error_get ();
+		nih_error ("%s: %s: %s", server_socket,
+			   _("Error while serving"), err->message);
+		nih_free (err);
+		exit (3);
+	}
+
 	if (! force_trace) {
 		NihError *err;
 
@@ -286,16 +508,37 @@ main (int   argc,
 			exit (2);
 		}
 
+		/* The cost of opening files is measured on each boot and
+		 * kept alongside the pack.
+		 */
+		readahead_options.stats_file = NIH_MUST (nih_sprintf (
+			NULL, "%s.stats", filename));
+
 		/* Read the current pack file */
 		file = read_pack (NULL, filename, dump_pack);
-		if (file) {
+		if (file && retrace && (! dump_pack)) {
+			/* Read the pack while tracing below */
+			nih_info ("%s: %s", filename, _("Reading while tracing"));
+		} else if (file) {
 			if (dump_pack) {
 				pack_dump (file, sort_pack);
 				exit (0);
 			}
 
+			/* Watch for the pack being evicted */
+			if (rewarm > 0) {
+				do_rewarm (file, daemonise, rewarm);
+
+				err = nih_error_get ();
+				nih_error ("%s: %s", _("Error while re-reading"),
+					   err->message);
+				nih_free (err);
+				exit (3);
+			}
+
 			/* Read the pack */
-			if (do_readahead (file, daemonise) < 0) {
+			if (do_readahead (file, daemonise,
+					  &readahead_options) < 0) {
 				err = nih_error_get ();
 				nih_error ("%s: %s", _("Error while reading"),
 					   err->message);
@@ -304,27 +547,29 @@ main (int   argc,
 			}
 
 			exit (0);
-		}
-
-		/* Error reading file means we retrace if not given a PATH,
-		 * otherwise we error out.
-		 */
-		err = nih_error_get ();
-		if (args[0] || dump_pack) {
-			nih_fatal ("%s: %s", filename, err->message);
 		} else {
-			nih_info ("%s: %s", filename, err->message);
-		}
-		nih_free (err);
+			/* Error reading file means we retrace if not given
+			 * a PATH, otherwise we error out.
+			 */
+			err = nih_error_get ();
+			if (args[0] || dump_pack) {
+				nih_fatal ("%s: %s", filename, err->message);
+			} else {
+				nih_info ("%s: %s", filename, err->message);
+			}
+			nih_free (err);
 
-		if (args[0] || dump_pack)
-			exit (4);
+			if (args[0] || dump_pack)
+				exit (4);
+		}
 	}
 
 	/* Trace to generate new pack files */
 	if (trace (daemonise, timeout, filename, pack_file,
 		   path_prefix_filter, &path_prefix, use_existing_trace_events,
-		   force_ssd_mode) < 0) {
+		   force_ssd_mode, critical_time, queue_scheduler,
+		   file, &readahead_options, learn, trace_pages,
+		   tracer) < 0) {
 		NihError *err;
 
 		err = nih_error_get ();
@@ -28,6 +28,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #include <fcntl.h>
 #include <stdio.h>
@@ -35,6 +36,8 @@
 #include <unistd.h>
 
 #include <nih/macros.h>
+#include <nih/alloc.h>
+#include <nih/string.h>
 #include <nih/logging.h>
 #include <nih/error.h>
 
@@ -119,3 +122,105 @@ set_value (int         dfd,
 
 	return 0;
 }
+
+int
+get_string (int         dfd,
+	    const char *path,
+	    char *      value,
+	    size_t      len)
+{
+	int     fd;
+	ssize_t ret;
+
+	nih_assert (path != NULL);
+	nih_assert (value != NULL);
+	nih_assert (len > 0);
+
+	fd = openat (dfd, path, O_RDONLY);
+	if (fd < 0)
+		nih_return_system_error (-1);
+
+	ret = read (fd, value, len - 1);
+	if (ret < 0) {
+		nih_error_raise_system ();
+		close (fd);
+		return -1;
+	}
+
+	value[ret] = '\0';
+	value[strcspn (value, "\n")] = '\0';
+
+	if (close (fd) < 0)
+		nih_return_system_error (-1);
+
+	return 0;
+}
+
+int
+set_string (int         dfd,
+	    const char *path,
+	    const char *value)
+{
+	int     fd;
+	ssize_t len;
+
+	nih_assert (path != NULL);
+	nih_assert (value != NULL);
+
+	fd = openat (dfd, path, O_WRONLY);
+	if (fd < 0)
+		nih_return_system_error (-1);
+
+	len = write (fd, value, strlen (value));
+	if (len < 0) {
+		nih_error_raise_system ();
+		close (fd);
+		return -1;
+	}
+
+	if (close (fd) < 0)
+		nih_return_system_error (-1);
+
+	return 0;
+}
+
+/**
+ * queue_value_path:
+ * @parent: parent of returned string,
+ * @dev: block device,
+ * @name: name of queue attribute.
+ *
+ * Works out the path of the sysfs block queue attribute @name for the
+ * device @dev.  Partitions don't have a queue of their own, so when @dev
+ * is one we use the queue of the disk it is on.
+ *
+ * Returns: newly allocated path, which may not exist.
+ **/
+char *
+queue_value_path (const void *parent,
+		  dev_t       dev,
+		  const char *name)
+{
+	char *path;
+
+	nih_assert (name != NULL);
+
+	path = NIH_MUST (nih_sprintf (parent, "/sys/dev/block/%d:%d/queue/%s",
+				      major (dev), minor (dev), name));
+	if (! access (path, F_OK))
+		return path;
+
+	/* The partition's sysfs directory lives inside the disk's */
+	nih_free (path);
+	path = NIH_MUST (nih_sprintf (parent, "/sys/dev/block/%d:%d/../queue/%s",
+				      major (dev), minor (dev), name));
+	if (! access (path, F_OK))
+		return path;
+
+	/* For devices managed by the scsi stack, the minor device number
+	 * has to be masked to find the disk.
+	 */
+	nih_free (path);
+	return NIH_MUST (nih_sprintf (parent, "/sys/dev/block/%d:%d/queue/%s",
+				      major (dev), minor (dev) & 0xffff0, name));
+}
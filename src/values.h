@@ -34,8 +34,12 @@
 
 NIH_BEGIN_EXTERN
 
-int get_value (int dfd, const char *path, int *value);
-int set_value (int dfd, const char *path, int value, int *oldvalue);
+int   get_value        (int dfd, const char *path, int *value);
+int   set_value        (int dfd, const char *path, int value, int *oldvalue);
+int   get_string       (int dfd, const char *path, char *value, size_t len);
+int   set_string       (int dfd, const char *path, const char *value);
+
+char *queue_value_path (const void *parent, dev_t dev, const char *name);
 
 NIH_END_EXTERN
 